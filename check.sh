@@ -0,0 +1,85 @@
+#!/bin/sh
+# Small headless runs that have to agree with each other, ran by make check.
+#  - a traced run's grid against the trace replayed onto its start
+#  - -G on 1 thread against 4 threads and 2 -F shards
+#  - the species census against the plain C one, and the AVX2 one where the
+#    machine has it
+# Prints a line per case and exits 1 if any of them differ.
+
+HEADLESS=./silicon-genesis-headless
+REPLAY=./silicon-genesis-replay
+SCALAR=./silicon-genesis-headless-scalar
+AVX2=./silicon-genesis-headless-avx2
+MAKE=${MAKE:-make}
+
+# Checkpoint header is padded out to CKPT_ALIGN, the arena starts after it.
+CKPT_ALIGN=16384
+
+WORLD="-s 3 -x 96 -y 96 -n 3000 -m 1024"
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+# Report a case, $1 its name and $2 the status of its comparison.
+result() {
+    if [ "$2" -eq 0 ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1"
+        failed=1
+    fi
+}
+
+# Replay only rebuilds the grid, the stats and generator in its checkpoint are
+# the starting ones so only the arenas are compared.
+replay_case() {
+    name=$1
+    shift
+    rm -f "$dir"/trace*
+    $HEADLESS $WORLD "$@" -T "$dir/trace" -C "$dir/run.ckpt" > /dev/null &&
+        $REPLAY -C "$dir/replay.ckpt" "$dir/trace.ckpt" "$dir/trace" > /dev/null &&
+        cmp -s -i $CKPT_ALIGN "$dir/run.ckpt" "$dir/replay.ckpt"
+    result "replay $name" $?
+}
+
+# -G is meant to come out the same on any -j or -F, checkpoints and all.
+sync_case() {
+    name=$1
+    shift
+    $HEADLESS $WORLD "$@" -G -j 1 -C "$dir/j1.ckpt" > /dev/null &&
+        $HEADLESS $WORLD "$@" -G -j 4 -C "$dir/j4.ckpt" > /dev/null &&
+        $HEADLESS $WORLD "$@" -G -F 2 -C "$dir/f2.ckpt" > /dev/null &&
+        cmp -s "$dir/j1.ckpt" "$dir/j4.ckpt" &&
+        cmp -s "$dir/j1.ckpt" "$dir/f2.ckpt"
+    result "sync $name" $?
+}
+
+# Censuses of the same run from builds with different distance code.
+census_case() {
+    name=$1
+    bin=$2
+    shift 2
+    $bin $WORLD "$@" -I 250000 -D "$dir/census.$name" > /dev/null &&
+        cmp -s "$dir/census.scalar" "$dir/census.$name"
+    result "census $name" $?
+}
+
+replay_case vonneumann -t 1000000
+replay_case hex -t 1000000 -N hex -B
+
+sync_case vonneumann -t 2000000
+sync_case moore -t 2000000 -N moore
+
+$SCALAR $WORLD -t 2000000 -I 250000 -D "$dir/census.scalar" > /dev/null
+result "census scalar" $?
+census_case default $HEADLESS -t 2000000
+if grep -qw avx2 /proc/cpuinfo 2> /dev/null ||
+        sysctl -n machdep.cpu.leaf7_features 2> /dev/null | grep -qi avx2; then
+    $MAKE -s silicon-genesis-headless-avx2 &&
+        census_case avx2 $AVX2 -t 2000000
+else
+    echo "skip census avx2, not supported here"
+fi
+
+exit $failed
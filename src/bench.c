@@ -0,0 +1,397 @@
+/** @file
+ *  Benchmark entry point, times the hot parts of the VM, scheduler and renderer
+ *  on a set of fixed seed workloads and prints one key:value line per result,
+ *  so runs on the same machine can be compared to catch regressions.
+ *
+ *  Every benchmark rebuilds its workload from the seed first, so each one
+ *  starts from the same grid every run. Each is repeated and the fastest kept,
+ *  the slower runs are noise from the rest of the machine.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "cellvm.h"
+#include "cellgenome.h"
+#include "cellrender.h"
+#include "cellspecies.h"
+
+/** Ticks ran to let a workload settle before its timed. */
+#define BENCH_WARMUP 2000000
+
+/** Largest frame rendered, the GUI never draws more than this a side. */
+#define BENCH_FRAMEMAX 1024
+
+/** One in this many cells change between the frames of render_dirty. */
+#define BENCH_DIRTY 64
+
+/** Settings shared by every benchmark. */
+struct bench_opts {
+    unsigned long seed;
+    int w, h;
+    /** Ticks cluster_sched runs for, and calls made by the other benchmarks. */
+    unsigned long ticks;
+    unsigned long calls;
+    /** Frames rendered per view, and species censuses taken. */
+    unsigned long frames;
+    /** Times each benchmark is repeated. */
+    int repeats;
+};
+
+/** A workload, sets up a fresh cluster. */
+struct bench_workload {
+    const char *name;
+    void (*setup)(struct cell_cluster *cluster);
+};
+
+/** A benchmark, times ops of something on a workload and returns how many it did. */
+struct bench_def {
+    const char *name;
+    unsigned long (*run)(struct cell_cluster *cluster, const struct bench_opts *opts);
+};
+
+/** Results are summed into this so the compiler cant drop the timed loops. */
+static volatile unsigned long sink;
+
+/**
+ * Print program usage information to console.
+ * @param name Name the program was run as.
+ */
+static void print_help(const char *name) {
+    printf("Silicion Genesis %s (bench)\n", SGVER);
+    printf("Usage: %s [options]\n", name);
+    printf("\t-s seed\t\tSeed every workload is built from (default 1).\n");
+    printf("\t-x width\tGrid width (default %d).\n", DEFAULTX);
+    printf("\t-y height\tGrid height (default %d).\n", DEFAULTY);
+    printf("\t-t ticks\tTicks to schedule (default 20000000).\n");
+    printf("\t-c calls\tCalls made by the single function benchmarks (default 10000000).\n");
+    printf("\t-f frames\tFrames rendered per view, species censuses and restarts (default 50).\n");
+    printf("\t-r repeats\tTimes to repeat each benchmark, the fastest is kept (default 3).\n");
+    printf("\t-w name\t\tOnly run this workload, can be repeated.\n");
+    printf("\t-b name\t\tOnly run this benchmark, can be repeated.\n");
+}
+
+/**
+ * Nothing alive, the scheduler only ever picks empty cells.
+ */
+static void setup_empty(struct cell_cluster *cluster) {
+}
+
+/**
+ * A dense colony of star, which spores in every direction.
+ */
+static void setup_star(struct cell_cluster *cluster) {
+    const struct genome_def *star = genome_find("star");
+    int x, y;
+
+    for (y = 0; y < cluster->h; y += 4)
+        for (x = 0; x < cluster->w; x += 4)
+            cell_pop(cluster, x, y, 1, ENERGY, star->instructions);
+    cluster_run(cluster, BENCH_WARMUP);
+}
+
+/**
+ * A soup of random genomes over a quarter of the grid.
+ */
+static void setup_soup(struct cell_cluster *cluster) {
+    size_t i;
+
+    for (i = 0; i < cluster->area / 4; i++)
+        cell_seed(cluster, RANDX(cluster), RANDY(cluster));
+    cluster_run(cluster, BENCH_WARMUP);
+}
+
+/**
+ * Sporers and CRCH heavy predators, randpop and randpopeat.
+ */
+static void setup_predator(struct cell_cluster *cluster) {
+    const struct genome_def *prey = genome_find("randpop"), *eater = genome_find("randpopeat");
+    size_t i;
+
+    for (i = 0; i < cluster->area / 16; i++) {
+        cell_pop(cluster, RANDX(cluster), RANDY(cluster), 1, ENERGY, prey->instructions);
+        cell_pop(cluster, RANDX(cluster), RANDY(cluster), 1, ENERGY, eater->instructions);
+    }
+    cluster_run(cluster, BENCH_WARMUP);
+}
+
+/** Workloads in the order they run. */
+static const struct bench_workload workloads[] = {
+    { "empty", setup_empty },
+    { "star", setup_star },
+    { "soup", setup_soup },
+    { "predator", setup_predator },
+    { NULL, NULL }
+};
+
+/**
+ * cluster_sched ticks.
+ */
+static unsigned long bench_sched(struct cell_cluster *cluster, const struct bench_opts *opts) {
+    cluster_run(cluster, opts->ticks);
+    return opts->ticks;
+}
+
+/**
+ * proc_cell then cell_reap on random cells, the work of one tick without the
+ * scheduler around it.
+ */
+static unsigned long bench_proc(struct cell_cluster *cluster, const struct bench_opts *opts) {
+    unsigned long i;
+    char didstuff = 0;
+    int x, y;
+
+    for (i = 0; i < opts->calls; i++) {
+        x = RANDX(cluster);
+        y = RANDY(cluster);
+        if (proc_cell(cluster, &cluster->ctx, x, y, &didstuff))
+            exit(1);
+        cell_reap(cluster, &cluster->ctx, x, y);
+    }
+    sink += didstuff;
+    return opts->calls;
+}
+
+/**
+ * get_neighbour_coords over every cell and direction in turn.
+ */
+static unsigned long bench_neighbour(struct cell_cluster *cluster, const struct bench_opts *opts) {
+    unsigned long i, sum = 0;
+    int x = 0, y = 0, xp, yp;
+
+    for (i = 0; i < opts->calls; i++) {
+        get_neighbour_coords(cluster, x, y, i & 3, &xp, &yp);
+        sum += xp + yp;
+        if ((i & 3) == 3 && ++x == cluster->w) {
+            x = 0;
+            if (++y == cluster->h)
+                y = 0;
+        }
+    }
+    sink += sum;
+    return opts->calls;
+}
+
+/**
+ * cell_mutate on random cells at the clusters mutation rate.
+ */
+static unsigned long bench_mutate(struct cell_cluster *cluster, const struct bench_opts *opts) {
+    unsigned long i, sum = 0;
+
+    for (i = 0; i < opts->calls; i++)
+        sum += cell_mutate(cluster, &cluster->ctx, RANDX(cluster), RANDY(cluster));
+    sink += sum;
+    return opts->calls;
+}
+
+/**
+ * Render whole frames with each view, what the GUI does every frame before
+ * uploading it.
+ */
+static unsigned long bench_render(struct cell_cluster *cluster, const struct bench_opts *opts) {
+    static const render_view views[] = { render_energy, render_living, render_gmap };
+    struct cell_frame frame;
+    unsigned long f;
+    size_t v;
+
+    if (frame_init(&frame, cluster->w < BENCH_FRAMEMAX ? cluster->w : BENCH_FRAMEMAX,
+                   cluster->h < BENCH_FRAMEMAX ? cluster->h : BENCH_FRAMEMAX))
+        exit(1);
+    for (f = 0; f < opts->frames; f++) {
+        for (v = 0; v < sizeof views / sizeof *views; v++) {
+            render_all(&frame, cluster, views[v]);
+            frame_clean(&frame);
+        }
+    }
+    sink += frame.pixels[0];
+    frame_free(&frame);
+    return opts->frames * (sizeof views / sizeof *views);
+}
+
+/**
+ * Frames drawn by the GUI between view switches, with BENCH_DIRTY of the cells
+ * marked as changed before each.
+ */
+static unsigned long bench_render_dirty(struct cell_cluster *cluster, const struct bench_opts *opts) {
+    struct cell_frame frame;
+    unsigned long f, i, sum = 0;
+
+    if (frame_init(&frame, cluster->w < BENCH_FRAMEMAX ? cluster->w : BENCH_FRAMEMAX,
+                   cluster->h < BENCH_FRAMEMAX ? cluster->h : BENCH_FRAMEMAX))
+        exit(1);
+    cluster_track_dirty(cluster, 1);
+    render_all(&frame, cluster, render_gmap);
+    for (f = 0; f < opts->frames; f++) {
+        for (i = 0; i < cluster->area / BENCH_DIRTY; i++)
+            cell_mark(cluster, rng_below64(&cluster->ctx.rng, cluster->area));
+        sum += render_dirty(&frame, cluster, render_gmap);
+        frame_clean(&frame);
+    }
+    cluster_track_dirty(cluster, 0);
+    sink += sum + frame.pixels[0];
+    frame_free(&frame);
+    return opts->frames;
+}
+
+/**
+ * Species censuses of the whole grid at the default threshold.
+ */
+static unsigned long bench_species(struct cell_cluster *cluster, const struct bench_opts *opts) {
+    struct species_census census;
+    unsigned long f, sum = 0;
+
+    species_init(&census, SPECIES_THRESHOLD, SPECIES_MAX);
+    for (f = 0; f < opts->frames; f++)
+        sum += species_take(&census, cluster);
+    species_free(&census);
+    sink += sum;
+    return opts->frames;
+}
+
+/**
+ * World restarts, cluster_reset then the default genomes populated, what the
+ * GUI does at the end of each run.
+ */
+static unsigned long bench_reset(struct cell_cluster *cluster, const struct bench_opts *opts) {
+    struct cluster_stats stats = cluster->stats;
+    unsigned long f;
+
+    for (f = 0; f < opts->frames; f++) {
+        if (cluster_reset(cluster))
+            exit(1);
+        genome_pop_defaults(cluster, ENERGY);
+    }
+    /* Put the counters back so no instructions look to have ran. */
+    cluster->stats = stats;
+    sink += cell_gen(cluster, 0);
+    return opts->frames;
+}
+
+/** Benchmarks in the order they run, ops are ticks, calls, frames, censuses or restarts. */
+static const struct bench_def benches[] = {
+    { "sched", bench_sched },
+    { "proc_cell", bench_proc },
+    { "neighbour", bench_neighbour },
+    { "mutate", bench_mutate },
+    { "render", bench_render },
+    { "render_dirty", bench_render_dirty },
+    { "species", bench_species },
+    { "reset", bench_reset },
+    { NULL, NULL }
+};
+
+/**
+ * See if a name was picked on the command line.
+ * @param name Name to look for.
+ * @param picked Names picked.
+ * @param npicked Number picked, 0 picks everything.
+ * @return 1 if picked, 0 if not.
+ */
+static int picked(const char *name, const char **picked, int npicked) {
+    int i;
+
+    for (i = 0; i < npicked; i++)
+        if (!strcmp(name, picked[i]))
+            return 1;
+    return !npicked;
+}
+
+/**
+ * Application entry point.
+ */
+int main(int argc, char *argv[]) {
+    struct cell_cluster cluster;
+    struct bench_opts opts;
+    const char *wpick[16], *bpick[16];
+    const struct bench_workload *w;
+    const struct bench_def *b;
+    unsigned long ops, instructions;
+    double secs, best, best_ips;
+    int opt, nw, nb, r;
+
+    opts.seed = 1;
+    opts.w = DEFAULTX;
+    opts.h = DEFAULTY;
+    opts.ticks = 20000000;
+    opts.calls = 10000000;
+    opts.frames = 50;
+    opts.repeats = 3;
+    nw = nb = 0;
+
+    while ((opt = getopt(argc, argv, "s:x:y:t:c:f:r:w:b:h")) != -1) {
+        switch (opt) {
+        case 's':
+            opts.seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'x':
+            opts.w = atoi(optarg);
+            break;
+        case 'y':
+            opts.h = atoi(optarg);
+            break;
+        case 't':
+            opts.ticks = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            opts.calls = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            opts.frames = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            opts.repeats = atoi(optarg);
+            break;
+        case 'w':
+            if (nw < 16)
+                wpick[nw++] = optarg;
+            break;
+        case 'b':
+            if (nb < 16)
+                bpick[nb++] = optarg;
+            break;
+        default:
+            print_help(argv[0]);
+            return 1;
+        }
+    }
+    if (opts.repeats < 1 || !opts.ticks || !opts.calls || !opts.frames) {
+        print_help(argv[0]);
+        return 1;
+    }
+
+    for (w = workloads; w->name; w++) {
+        if (!picked(w->name, wpick, nw))
+            continue;
+        for (b = benches; b->name; b++) {
+            if (!picked(b->name, bpick, nb))
+                continue;
+
+            best = best_ips = 0;
+            for (ops = 0, r = 0; r < opts.repeats; r++) {
+                if (cluster_init(&cluster, opts.w, opts.h)) {
+                    fprintf(stderr, "Cant allocate a %dx%d grid\n", opts.w, opts.h);
+                    return 1;
+                }
+                cluster_seed(&cluster, opts.seed);
+                w->setup(&cluster);
+
+                instructions = cluster.stats.instructions;
+                secs = clock_seconds();
+                ops = b->run(&cluster, &opts);
+                secs = clock_seconds() - secs;
+                if (!r || secs < best) {
+                    best = secs;
+                    best_ips = (cluster.stats.instructions - instructions) / secs;
+                }
+                cluster_free(&cluster);
+            }
+
+            printf("bench:%s workload:%s grid:%dx%d seed:%lu ops:%lu secs:%.6f ops/s:%.0f ns/op:%.2f instructions/s:%.0f\n",
+                   b->name, w->name, opts.w, opts.h, opts.seed, ops, best, ops / best, best * 1e9 / ops, best_ips);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,339 @@
+/** @file
+ * Binary checkpoints of a running cluster, see cellckpt.h.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "cellckpt.h"
+
+/** Magic at the start of every checkpoint. */
+static const char ckpt_magic[8] = "SGCKPT";
+
+_Static_assert(sizeof(struct cluster_stats) <= CKPT_STATS * sizeof(unsigned long),
+               "cluster_stats has outgrown the checkpoint header");
+_Static_assert(sizeof(struct cell_rng) <= sizeof(((struct ckpt_header *)0)->rng),
+               "generator state doesnt fit in the checkpoint header");
+_Static_assert(sizeof(struct ckpt_header) <= CKPT_ALIGN, "checkpoint header overlaps the arena");
+_Static_assert(sizeof(size_t) == sizeof(unsigned long), "live index entries arent covered by the word check");
+
+/**
+ * Layout flags of this build.
+ */
+static uint32_t ckpt_layout(void) {
+    uint32_t layout = 0;
+
+#ifdef CELL_SOA
+    layout |= CKPT_SOA;
+#endif
+#ifdef CELL_PACKED
+    layout |= CKPT_PACKED;
+#endif
+#ifdef RNG_PCG32
+    layout |= CKPT_PCG32;
+#endif
+    return layout;
+}
+
+/**
+ * Fill in a header describing a cluster.
+ * @param cluster Cluster to describe.
+ * @param hdr Header to fill.
+ */
+static void ckpt_header_fill(const struct cell_cluster *cluster, struct ckpt_header *hdr) {
+    const unsigned long *stats = (const unsigned long *)&cluster->stats;
+    size_t i;
+
+    memset(hdr, '\0', sizeof *hdr);
+    memcpy(hdr->magic, ckpt_magic, sizeof hdr->magic);
+    hdr->version = CKPT_VERSION;
+    hdr->layout = ckpt_layout();
+    hdr->csize = CSIZE;
+    hdr->word = sizeof(unsigned long);
+    hdr->byteorder = 0x0102030405060708ULL;
+    hdr->w = cluster->w;
+    hdr->h = cluster->h;
+    hdr->arena_offset = CKPT_ALIGN;
+    hdr->arena_size = cluster->arena_size;
+    hdr->tick = cluster->tick;
+    hdr->seed = cluster->seed;
+    hdr->mutation_rate = cluster->mutation.rate;
+    hdr->mutation_mode = cluster->mutation.mode;
+    hdr->sched_mode = cluster->sched_mode;
+    hdr->topology = cluster->topology;
+    hdr->mut_skip = cluster->ctx.mut_skip;
+    memcpy(hdr->rng, &cluster->ctx.rng, sizeof cluster->ctx.rng);
+    if (cluster->live_track) {
+        hdr->live_offset = hdr->arena_offset + hdr->arena_size;
+        hdr->nlive = cluster->nlive;
+    }
+
+    /* cluster_stats is nothing but unsigned long counters. */
+    hdr->nstats = sizeof(struct cluster_stats) / sizeof(unsigned long);
+    for (i = 0; i < hdr->nstats; i++)
+        hdr->stats[i] = stats[i];
+}
+
+/**
+ * Write all of a buffer, carrying on after short writes.
+ * @param fd File to write to.
+ * @param buf Data to write.
+ * @param len Bytes to write.
+ * @return 0 ok, 1 fail.
+ */
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    ssize_t n;
+
+    while (len) {
+        /* Some systems refuse single writes past 2GB. */
+        if ((n = write(fd, p, len < (1UL << 30) ? len : (1UL << 30))) < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Write a checkpoint to tmp then rename it over path. Only uses calls that
+ * are safe in a child forked from a threaded process.
+ * @param cluster Cluster to save.
+ * @param hdr Header of the checkpoint.
+ * @param path File to write.
+ * @param tmp File to write to first.
+ * @return 0 ok, 1 fail.
+ */
+static int ckpt_write(const struct cell_cluster *cluster, const struct ckpt_header *hdr,
+                      const char *path, const char *tmp) {
+    int fd;
+
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return 1;
+
+    /* The gap between the header and arena is left as a hole. */
+    if (write_all(fd, hdr, sizeof *hdr) || lseek(fd, hdr->arena_offset, SEEK_SET) < 0 ||
+        write_all(fd, cluster->arena, hdr->arena_size) ||
+        (hdr->live_offset && write_all(fd, cluster->live, hdr->nlive * sizeof(size_t))) || fsync(fd)) {
+        close(fd);
+        unlink(tmp);
+        return 1;
+    }
+    if (close(fd) || rename(tmp, path)) {
+        unlink(tmp);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Get the name a checkpoint is written under before being renamed.
+ * @param path File being written.
+ * @param tmp Buffer of PATH_MAX for the name.
+ * @return 0 ok, 1 if path is too long.
+ */
+static int ckpt_tmp_path(const char *path, char *tmp) {
+    return snprintf(tmp, PATH_MAX, "%s.tmp", path) >= PATH_MAX;
+}
+
+int cluster_save(const struct cell_cluster *cluster, const char *path) {
+    struct ckpt_header hdr;
+    char tmp[PATH_MAX];
+
+    if (ckpt_tmp_path(path, tmp))
+        return 1;
+    ckpt_header_fill(cluster, &hdr);
+    return ckpt_write(cluster, &hdr, path, tmp);
+}
+
+pid_t cluster_save_bg(const struct cell_cluster *cluster, const char *path) {
+    struct ckpt_header hdr;
+    char tmp[PATH_MAX];
+    pid_t pid;
+
+    if (ckpt_tmp_path(path, tmp))
+        return -1;
+    ckpt_header_fill(cluster, &hdr);
+
+    /* The child gets a copy on write snapshot of the cluster, only the pages
+     * the parent goes on to change ever get copied. */
+    if ((pid = fork()) == 0)
+        _exit(ckpt_write(cluster, &hdr, path, tmp));
+    return pid;
+}
+
+int cluster_save_wait(pid_t pid, int block) {
+    pid_t ret;
+    int status;
+
+    while ((ret = waitpid(pid, &status, block ? 0 : WNOHANG)) < 0 && errno == EINTR)
+        ;
+    if (ret == 0)
+        return -1;
+    if (ret < 0)
+        return 1;
+    return !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+/**
+ * Read all of a buffer, carrying on after short reads.
+ * @param fd File to read from.
+ * @param buf Where to store the data.
+ * @param len Bytes to read.
+ * @return 0 ok, 1 fail or end of file.
+ */
+static int read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    ssize_t n;
+
+    while (len) {
+        if ((n = read(fd, p, len)) <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return 1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Check a header was written by a build that lays clusters out like this one.
+ * @param hdr Header to check.
+ * @return 0 ok, 1 if it cant be loaded.
+ */
+static int ckpt_header_check(const struct ckpt_header *hdr) {
+    if (memcmp(hdr->magic, ckpt_magic, sizeof hdr->magic) ||
+        hdr->version < CKPT_VERSION_MIN || hdr->version > CKPT_VERSION) {
+#ifdef DEBUG
+        printf("Checkpoint: not a version %d to %d checkpoint\n", CKPT_VERSION_MIN, CKPT_VERSION);
+#endif
+        return 1;
+    }
+    if (hdr->byteorder != 0x0102030405060708ULL || hdr->layout != ckpt_layout() ||
+        hdr->csize != CSIZE || hdr->word != sizeof(unsigned long)) {
+#ifdef DEBUG
+        printf("Checkpoint: written by a build with a different layout\n");
+#endif
+        return 1;
+    }
+    if (hdr->w > INT_MAX || hdr->h > INT_MAX || hdr->nstats > CKPT_STATS || hdr->arena_offset % CKPT_ALIGN)
+        return 1;
+    if (hdr->topology >= TOPO_MAX || hdr->sched_mode >= SCHED_MAX || hdr->mutation_mode >= MUTATE_MAX) {
+#ifdef DEBUG
+        printf("Checkpoint: unknown topology, scheduler or mutation mode\n");
+#endif
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Read the live index saved with a checkpoint and start keeping it.
+ * @param cluster Cluster loaded from the checkpoint.
+ * @param fd The checkpoint.
+ * @param hdr Its header, with a live_offset.
+ * @param size Size of the file.
+ * @return 0 ok, 1 if its cut short or names cells outside the grid or twice.
+ */
+static int ckpt_live_read(struct cell_cluster *cluster, int fd, const struct ckpt_header *hdr, uint64_t size) {
+    size_t i, pos;
+
+    if (hdr->nlive > cluster->area || size < hdr->live_offset + hdr->nlive * sizeof(size_t))
+        return 1;
+    if (!(cluster->live = malloc(cluster->area * sizeof(size_t))) ||
+        !(cluster->live_pos = malloc(cluster->area * sizeof(size_t))))
+        exit(1);
+    if (lseek(fd, hdr->live_offset, SEEK_SET) < 0 || read_all(fd, cluster->live, hdr->nlive * sizeof(size_t)))
+        return 1;
+    for (i = 0; i < hdr->nlive; i++) {
+        if (cluster->live[i] >= cluster->area)
+            return 1;
+        /* Same check as live_add(), a duplicate would leave a cell in the
+         * index twice with only one of them removable. */
+        pos = cluster->live_pos[cluster->live[i]];
+        if (pos < i && cluster->live[pos] == cluster->live[i])
+            return 1;
+        cluster->live_pos[cluster->live[i]] = i;
+    }
+    cluster->nlive = hdr->nlive;
+    cluster->live_track = 1;
+    return 0;
+}
+
+int cluster_load(struct cell_cluster *cluster, const char *path) {
+    struct ckpt_header hdr;
+    struct stat st;
+    unsigned long *stats;
+    size_t i, j;
+    void *arena;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return 1;
+    if (read_all(fd, &hdr, sizeof hdr) || ckpt_header_check(&hdr) || fstat(fd, &st) ||
+        (uint64_t)st.st_size < hdr.arena_offset + hdr.arena_size) {
+        close(fd);
+        return 1;
+    }
+
+    /* Set the cluster up as normal then map the file over the top of the fresh
+     * arena, so all the arena pointers stay where cluster_init() put them. */
+    if (cluster_init(cluster, hdr.w, hdr.h)) {
+        close(fd);
+        return 1;
+    }
+    if (hdr.arena_size != cluster->arena_size) {
+        cluster_free(cluster);
+        close(fd);
+        return 1;
+    }
+    if (cluster_set_topology(cluster, hdr.topology)) {
+        cluster_free(cluster);
+        close(fd);
+        return 1;
+    }
+    if (hdr.live_offset && ckpt_live_read(cluster, fd, &hdr, st.st_size)) {
+        cluster_free(cluster);
+        close(fd);
+        return 1;
+    }
+    arena = mmap(cluster->arena, cluster->arena_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_FIXED, fd, hdr.arena_offset);
+    close(fd);
+    if (arena == MAP_FAILED) {
+        cluster_free(cluster);
+        return 1;
+    }
+
+    cluster->tick = hdr.tick;
+    cluster->seed = hdr.seed;
+    cluster->sched_mode = hdr.sched_mode;
+    cluster_set_mutation(cluster, hdr.mutation_rate, hdr.mutation_mode);
+    memcpy(&cluster->ctx.rng, hdr.rng, sizeof cluster->ctx.rng);
+    cluster->ctx.mut_skip = hdr.mut_skip;
+
+    /* Counters added since the file was written just start at 0. */
+    stats = (unsigned long *)&cluster->stats;
+    for (i = j = 0; i < hdr.nstats && j < sizeof(struct cluster_stats) / sizeof(unsigned long); i++) {
+        if (hdr.version == 1 && i == 2)
+            continue;
+        stats[j++] = hdr.stats[i];
+    }
+
+#ifdef DEBUG
+    printf("Checkpoint: loaded %dx%d at tick %lu from %s\n", cluster->w, cluster->h, cluster->tick, path);
+#endif
+    return 0;
+}
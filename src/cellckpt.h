@@ -0,0 +1,128 @@
+/** @file
+ * Binary checkpoints of a running cluster. A checkpoint is a fixed header
+ * followed by the cell arena exactly as it sits in memory, starting on a
+ * CKPT_ALIGN boundary so cluster_load() can map it straight in rather than
+ * reading it, a huge world loads in the time it takes to map it and pages
+ * come in as cells get touched.
+ *
+ * Checkpoints can be written in the background with cluster_save_bg(), which
+ * forks so the child writes a copy on write snapshot while the parent keeps
+ * scheduling. Files are written next to the target and renamed over it once
+ * complete, so a crash mid write never leaves a half checkpoint behind and a
+ * cluster mapped from the old file is never touched.
+ *
+ * The grid, tick, stats, seed, mutation settings and the clusters generator
+ * are saved, and the live index after the arena if its being kept. SCHED_LIVE
+ * picks cells by their place in the index, so its saved in the order it was
+ * in rather than rebuilt in cell order on load. A single threaded run, or a
+ * SCHED_SYNC one on any number of threads, resumed from a checkpoint carries
+ * on exactly as if it had never stopped. The tiled scheduler draws fresh tile
+ * generators from the cluster each time it starts so carries on differently.
+ * Checkpoints are only readable by builds with the same layout, CSIZE,
+ * generator and byte order.
+ *
+ * Version 1 files still load. They predate the topology and live index, which
+ * sit in what was zero padding and so read as von Neumann with no index, and
+ * have a never counted vs_lucky third in their stats that is skipped.
+ */
+#ifndef _CELLCKPT_H
+#define _CELLCKPT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "cellvm.h"
+
+/** Checkpoint file format version, bump when the header or arena changes. */
+#define CKPT_VERSION 2
+/** Oldest version cluster_load() still reads. */
+#define CKPT_VERSION_MIN 1
+
+/** Offset of the arena in the file, a multiple of every page size we run on. */
+#define CKPT_ALIGN 16384
+
+/** Most stats counters a checkpoint can hold. */
+#define CKPT_STATS 32
+
+/** Layout flag, the arena is structure of arrays. */
+#define CKPT_SOA 0x1
+/** Layout flag, the generator is PCG32. */
+#define CKPT_PCG32 0x2
+/** Layout flag, the arena is packed cells. */
+#define CKPT_PACKED 0x4
+
+/** Header at the start of a checkpoint file. */
+struct ckpt_header {
+    /** "SGCKPT" and two NULs. */
+    char magic[8];
+    /** CKPT_VERSION the file was written as. */
+    uint32_t version;
+    /** CKPT_SOA, CKPT_PCG32 and CKPT_PACKED flags. */
+    uint32_t layout;
+    /** CSIZE of the writer. */
+    uint32_t csize;
+    /** sizeof(unsigned long) of the writer. */
+    uint32_t word;
+    /** 0x0102030405060708 as written, to catch a different byte order. */
+    uint64_t byteorder;
+    /** Grid size. */
+    uint64_t w, h;
+    /** Where the arena starts in the file and how big it is. */
+    uint64_t arena_offset, arena_size;
+    /** Cluster tick and seed. */
+    uint64_t tick, seed;
+    /** Mutation rate and mode, see cluster_set_mutation(). */
+    uint64_t mutation_rate, mutation_mode;
+    /** Single threaded scheduler mode. */
+    uint64_t sched_mode;
+    /** Instructions left before the clusters context next mutates. */
+    uint64_t mut_skip;
+    /** Clusters generator state. */
+    uint64_t rng[4];
+    /** Number of counters in stats. */
+    uint64_t nstats;
+    /** The cluster_stats counters in order. */
+    uint64_t stats[CKPT_STATS];
+    /** One of CELL_TOPOLOGIES, version 1 files can have 0 here which is TOPO_VONNEUMANN. */
+    uint64_t topology;
+    /** Where the live index starts in the file, 0 if it wasnt being kept,
+      * and how many cell indexes (size_t) are in it. */
+    uint64_t live_offset, nlive;
+};
+
+/**
+ * Write a checkpoint of a cluster, blocking until its on disk.
+ * @param cluster Cluster to save.
+ * @param path File to write.
+ * @return 0 ok, 1 fail.
+ */
+int cluster_save(const struct cell_cluster *cluster, const char *path);
+
+/**
+ * Start writing a checkpoint of a cluster in a forked child, the cluster is
+ * snapshotted as it is now and can carry on running straight away. Only call
+ * between ticks, ie from a callback.
+ * @param cluster Cluster to save.
+ * @param path File to write.
+ * @return Pid of the writer to pass to cluster_save_wait(), -1 on fail.
+ */
+pid_t cluster_save_bg(const struct cell_cluster *cluster, const char *path);
+
+/**
+ * Check on or wait for a checkpoint started with cluster_save_bg().
+ * @param pid Pid of the writer.
+ * @param block Wait for the writer to finish if true.
+ * @return 0 written ok, 1 failed, -1 still writing.
+ */
+int cluster_save_wait(pid_t pid, int block);
+
+/**
+ * Init a cluster from a checkpoint, use instead of cluster_init(). The arena
+ * is mapped copy on write from the file, which is never written to.
+ * @param cluster Cluster to init.
+ * @param path File to read.
+ * @return 0 ok, 1 if the file cant be read or isnt a checkpoint this build can load.
+ */
+int cluster_load(struct cell_cluster *cluster, const char *path);
+
+#endif
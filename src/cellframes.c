@@ -0,0 +1,410 @@
+/** @file
+ * Offscreen frame export, see cellframes.h.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#include "cellframes.h"
+
+/** Longest file name a frame gets. */
+#define FRAMES_NAME 4096
+/** Most bytes in a stored deflate block. */
+#define STORED_MAX 65535
+
+/** CRC of PNG chunks, table filled in on the first PNG. */
+static uint32_t crc_table[256];
+
+/** A PNG being streamed out, tracking the checksums as it goes. */
+struct png_out {
+    FILE *file;
+    /** CRC of the chunk so far. */
+    uint32_t crc;
+    /** Adler-32 halves of the image data so far. */
+    uint32_t a, b;
+    /** Image data left to write, and left in the current stored block. */
+    size_t left, block;
+};
+
+/**
+ * Check a file pattern has exactly one %d for the frame number, with an
+ * optional width, and nothing else printf would take.
+ * @param pattern Pattern to check.
+ * @return 1 ok, 0 not.
+ */
+static int pattern_ok(const char *pattern) {
+    const char *c;
+    int numbers = 0;
+
+    for (c = pattern; *c; c++) {
+        if (*c != '%')
+            continue;
+        if (c[1] == '%') {
+            c++;
+            continue;
+        }
+        for (c++; isdigit((unsigned char)*c); c++)
+            ;
+        if (*c != 'd')
+            return 0;
+        numbers++;
+    }
+    return numbers == 1;
+}
+
+/**
+ * Convert a row of a frame to 3 bytes a pixel.
+ * @param frame Frame to take it from.
+ * @param y Row.
+ * @param row Where to put its w * 3 bytes.
+ */
+static void frame_rgb(const struct cell_frame *frame, int y, unsigned char *row) {
+    const unsigned char *p = &frame->pixels[(size_t)y * frame->w * 4];
+    int x;
+
+    for (x = 0; x < frame->w; x++, p += 4) {
+        *row++ = p[0];
+        *row++ = p[1];
+        *row++ = p[2];
+    }
+}
+
+/**
+ * Write a frame as a binary PPM.
+ * @param exp Export writing it, for the row buffer.
+ * @param frame Frame to write.
+ * @param file File to write to.
+ */
+static void write_ppm(struct frame_export *exp, const struct cell_frame *frame, FILE *file) {
+    int y;
+
+    fprintf(file, "P6\n%d %d\n255\n", frame->w, frame->h);
+    for (y = 0; y < frame->h; y++) {
+        frame_rgb(frame, y, exp->row);
+        fwrite(exp->row, 3, frame->w, file);
+    }
+}
+
+/**
+ * Fill in the CRC table.
+ */
+static void crc_init(void) {
+    uint32_t c;
+    int i, k;
+
+    for (i = 0; i < 256; i++) {
+        for (c = i, k = 0; k < 8; k++)
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+/**
+ * Write bytes of a chunk, adding them to its CRC.
+ * @param out PNG being written.
+ * @param data Bytes to write.
+ * @param n How many.
+ */
+static void png_bytes(struct png_out *out, const unsigned char *data, size_t n) {
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        out->crc = crc_table[(out->crc ^ data[i]) & 0xff] ^ (out->crc >> 8);
+    fwrite(data, 1, n, out->file);
+}
+
+/**
+ * Write a big endian 32 bit number in a chunk.
+ * @param out PNG being written.
+ * @param v Number to write.
+ */
+static void png_u32(struct png_out *out, uint32_t v) {
+    unsigned char b[4] = { v >> 24, v >> 16, v >> 8, v };
+
+    png_bytes(out, b, 4);
+}
+
+/**
+ * Start a chunk.
+ * @param out PNG being written.
+ * @param type Four letter chunk type.
+ * @param length Bytes of data in the chunk.
+ */
+static void png_chunk(struct png_out *out, const char *type, uint32_t length) {
+    unsigned char b[4] = { length >> 24, length >> 16, length >> 8, length };
+
+    /* The length isnt part of the CRC. */
+    fwrite(b, 1, 4, out->file);
+    out->crc = 0xffffffff;
+    png_bytes(out, (const unsigned char *)type, 4);
+}
+
+/**
+ * End a chunk with its CRC.
+ * @param out PNG being written.
+ */
+static void png_end(struct png_out *out) {
+    uint32_t crc = out->crc ^ 0xffffffff;
+
+    png_u32(out, crc);
+}
+
+/**
+ * Write image data, splitting it into stored deflate blocks and adding it to
+ * the adler sum.
+ * @param out PNG being written.
+ * @param data Bytes to write.
+ * @param n How many.
+ */
+static void png_data(struct png_out *out, const unsigned char *data, size_t n) {
+    unsigned char head[5];
+    size_t i, chunk;
+
+    while (n) {
+        if (!out->block) {
+            out->block = out->left < STORED_MAX ? out->left : STORED_MAX;
+            head[0] = out->block == out->left;
+            head[1] = out->block;
+            head[2] = out->block >> 8;
+            head[3] = ~out->block;
+            head[4] = ~out->block >> 8;
+            png_bytes(out, head, 5);
+        }
+        chunk = n < out->block ? n : out->block;
+        for (i = 0; i < chunk; i++) {
+            out->a = (out->a + data[i]) % 65521;
+            out->b = (out->b + out->a) % 65521;
+        }
+        png_bytes(out, data, chunk);
+        data += chunk;
+        n -= chunk;
+        out->block -= chunk;
+        out->left -= chunk;
+    }
+}
+
+/**
+ * Write a frame as an uncompressed PNG.
+ * @param exp Export writing it, for the row buffer.
+ * @param frame Frame to write.
+ * @param file File to write to.
+ */
+static void write_png(struct frame_export *exp, const struct cell_frame *frame, FILE *file) {
+    static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    unsigned char header[5] = { 8, 2, 0, 0, 0 }, filter = 0;
+    struct png_out out;
+    size_t raw, blocks;
+    int y;
+
+    memset(&out, '\0', sizeof out);
+    out.file = file;
+    fwrite(signature, 1, sizeof signature, file);
+
+    /* 8 bit RGB, no interlace. */
+    png_chunk(&out, "IHDR", 13);
+    png_u32(&out, frame->w);
+    png_u32(&out, frame->h);
+    png_bytes(&out, header, sizeof header);
+    png_end(&out);
+
+    /* Each row is a filter byte then the pixels, in one zlib stream of stored
+     * blocks so its size is known up front. */
+    raw = (size_t)frame->h * (1 + (size_t)frame->w * 3);
+    blocks = (raw + STORED_MAX - 1) / STORED_MAX;
+    png_chunk(&out, "IDAT", 2 + blocks * 5 + raw + 4);
+    png_bytes(&out, (const unsigned char *)"\x78\x01", 2);
+    out.a = 1;
+    out.left = raw;
+    for (y = 0; y < frame->h; y++) {
+        png_data(&out, &filter, 1);
+        frame_rgb(frame, y, exp->row);
+        png_data(&out, exp->row, (size_t)frame->w * 3);
+    }
+    png_u32(&out, out.b << 16 | out.a);
+    png_end(&out);
+
+    png_chunk(&out, "IEND", 0);
+    png_end(&out);
+}
+
+/**
+ * Write a frame out.
+ * @param exp Export writing it.
+ * @param frame Frame to write.
+ * @param number Frame number, for the file name.
+ * @return 0 ok, 1 fail.
+ */
+static int frame_write(struct frame_export *exp, const struct cell_frame *frame, unsigned long number) {
+    char name[FRAMES_NAME];
+    FILE *file;
+    int error;
+
+    if (exp->format == FRAMES_PIPE) {
+        write_ppm(exp, frame, exp->pipe);
+        return fflush(exp->pipe) != 0 || ferror(exp->pipe);
+    }
+
+    if (snprintf(name, sizeof name, exp->pattern, (int)number) >= (int)sizeof name)
+        return 1;
+    if (!(file = fopen(name, "wb")))
+        return 1;
+    if (exp->format == FRAMES_PNG)
+        write_png(exp, frame, file);
+    else
+        write_ppm(exp, frame, file);
+    error = ferror(file) != 0;
+    if (fclose(file))
+        error = 1;
+    return error;
+}
+
+/**
+ * Writer thread, writes queued frames in order until closed.
+ * @param arg The export.
+ */
+static void *frames_writer(void *arg) {
+    struct frame_export *exp = arg;
+    unsigned long number;
+    int slot;
+
+    for (number = 0; ; number++) {
+        pthread_mutex_lock(&exp->lock);
+        while (!exp->count && !exp->closing)
+            pthread_cond_wait(&exp->cond, &exp->lock);
+        if (!exp->count) {
+            pthread_mutex_unlock(&exp->lock);
+            break;
+        }
+        slot = exp->head;
+        pthread_mutex_unlock(&exp->lock);
+
+        /* Once somethings failed just empty the queue, theres no point
+         * writing frames after a gap. */
+        if (!exp->failed && frame_write(exp, &exp->frames[slot], number))
+            exp->failed = 1;
+        if (!exp->failed)
+            exp->written++;
+
+        pthread_mutex_lock(&exp->lock);
+        exp->head = (exp->head + 1) % FRAMES_QUEUE;
+        exp->count--;
+        pthread_cond_broadcast(&exp->cond);
+        pthread_mutex_unlock(&exp->lock);
+    }
+    return NULL;
+}
+
+int frames_open(struct frame_export *exp, const char *target, render_view view, int w, int h) {
+    size_t len;
+    int i;
+
+    memset(exp, '\0', sizeof *exp);
+    exp->view = view;
+    exp->last_tick = -1;
+
+    if (target[0] == '|') {
+        exp->format = FRAMES_PIPE;
+        if (!(exp->pipe = popen(target + 1, "w")))
+            return 1;
+    } else {
+        if (!pattern_ok(target))
+            return 1;
+        len = strlen(target);
+        exp->format = len > 4 && !strcmp(target + len - 4, ".png") ? FRAMES_PNG : FRAMES_PPM;
+        exp->pattern = target;
+        if (exp->format == FRAMES_PNG && !crc_table[1])
+            crc_init();
+    }
+
+    for (i = 0; i < FRAMES_QUEUE; i++)
+        if (frame_init(&exp->frames[i], w, h))
+            exit(1);
+    if (!(exp->row = malloc((size_t)w * 3)))
+        exit(1);
+    pthread_mutex_init(&exp->lock, NULL);
+    pthread_cond_init(&exp->cond, NULL);
+    if (pthread_create(&exp->writer, NULL, frames_writer, exp)) {
+        if (exp->pipe)
+            pclose(exp->pipe);
+        for (i = 0; i < FRAMES_QUEUE; i++)
+            frame_free(&exp->frames[i]);
+        free(exp->row);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Draw a frame and queue it.
+ * @param exp Export to queue on.
+ * @param cluster Cluster to draw.
+ * @param wait Wait for room rather than dropping the frame.
+ * @return 0 queued, 1 dropped.
+ */
+static int frames_queue(struct frame_export *exp, struct cell_cluster *cluster, int wait) {
+    int slot;
+
+    pthread_mutex_lock(&exp->lock);
+    while (wait && exp->count == FRAMES_QUEUE)
+        pthread_cond_wait(&exp->cond, &exp->lock);
+    if (exp->count == FRAMES_QUEUE) {
+        pthread_mutex_unlock(&exp->lock);
+        exp->dropped++;
+        return 1;
+    }
+    slot = (exp->head + exp->count) % FRAMES_QUEUE;
+    pthread_mutex_unlock(&exp->lock);
+
+    /* The writer doesnt touch slots past count, so this can be drawn unlocked. */
+    render_all(&exp->frames[slot], cluster, exp->view);
+    exp->last_tick = cluster->tick;
+    exp->queued++;
+
+    pthread_mutex_lock(&exp->lock);
+    exp->count++;
+    pthread_cond_broadcast(&exp->cond);
+    pthread_mutex_unlock(&exp->lock);
+    return 0;
+}
+
+int frames_push(struct frame_export *exp, struct cell_cluster *cluster) {
+    return frames_queue(exp, cluster, 0);
+}
+
+/**
+ * Queue a frame, ran as a callback.
+ */
+static void callback_frames(void *userdata, int x, int y, char didstuff) {
+    struct frame_export *exp = userdata;
+
+    frames_push(exp, exp->cluster);
+}
+
+int frames_attach(struct frame_export *exp, struct cell_cluster *cluster, unsigned long every) {
+    exp->cluster = cluster;
+    return add_callback(&cluster->callbacks, callback_frames, every, exp, "FRAMES");
+}
+
+int frames_close(struct frame_export *exp, struct cell_cluster *cluster) {
+    int i;
+
+    if (cluster && cluster->tick != exp->last_tick)
+        frames_queue(exp, cluster, 1);
+
+    pthread_mutex_lock(&exp->lock);
+    exp->closing = 1;
+    pthread_cond_broadcast(&exp->cond);
+    pthread_mutex_unlock(&exp->lock);
+    pthread_join(exp->writer, NULL);
+
+    if (exp->pipe && pclose(exp->pipe))
+        exp->failed = 1;
+    for (i = 0; i < FRAMES_QUEUE; i++)
+        frame_free(&exp->frames[i]);
+    free(exp->row);
+    pthread_mutex_destroy(&exp->lock);
+    pthread_cond_destroy(&exp->cond);
+    return exp->failed;
+}
@@ -0,0 +1,116 @@
+/** @file
+ * Offscreen frame export, for time-lapses of runs on machines with no display.
+ *
+ * Every so many ticks a view (see cellrender.h) is drawn into a frame, the same
+ * as the GUI would show, and handed to a writer thread thru a queue of
+ * FRAMES_QUEUE frames. Drawing is on the scheduler but encoding and writing are
+ * all on the writer, and when the writer falls behind and the queue is full
+ * frames are dropped and counted rather than waited for, so a slow disk or
+ * encoder never holds up the run.
+ *
+ * Frames go to:
+ *  - a numbered file per frame, the target being a pattern with one %d (or
+ *    %06d and the like) for the frame number. Files ending in .png are PNGs,
+ *    the rest binary PPMs.
+ *  - a program, when the target starts with a |. The rest is ran by the shell
+ *    and gets the frames as back to back binary PPMs on its stdin, which an
+ *    encoder like ffmpeg -f image2pipe -c:v ppm -i - takes as is.
+ *
+ * PNGs are written uncompressed (stored deflate blocks) so there is no zlib to
+ * link, pipe them thru something like optipng or use the pipe to an encoder if
+ * size matters.
+ */
+#ifndef _CELLFRAMES_H
+#define _CELLFRAMES_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "cellvm.h"
+#include "cellrender.h"
+
+/** Frames that can be waiting for the writer. */
+#define FRAMES_QUEUE 4
+/** Most pixels along a side, bigger grids are sampled down to fit. */
+#define FRAMES_MAX 1024
+
+/** How frames are written. */
+enum FRAMES_FORMATS {
+    /** A binary PPM file per frame. */
+    FRAMES_PPM,
+    /** An uncompressed PNG file per frame. */
+    FRAMES_PNG,
+    /** PPMs back to back down a pipe. */
+    FRAMES_PIPE
+};
+
+/** Export being written. */
+struct frame_export {
+    /** One of FRAMES_FORMATS. */
+    int format;
+    /** File name pattern, or the pipe for FRAMES_PIPE. */
+    const char *pattern;
+    FILE *pipe;
+    /** View frames are drawn with. */
+    render_view view;
+
+    /** Frames queued for the writer, count of them from head on. */
+    struct cell_frame frames[FRAMES_QUEUE];
+    int head, count;
+    /** Guards head, count and closing. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t writer;
+    /** Set to have the writer finish the queue and stop. */
+    int closing;
+    /** Set by the writer if anything failed to write. */
+    int failed;
+    /** Rows of a frame as written, 3 bytes a pixel. */
+    unsigned char *row;
+
+    /** Tick of the last frame queued, so the final one isnt queued twice. */
+    unsigned long last_tick;
+    /** Frames queued, written and dropped for want of room in the queue. */
+    unsigned long queued, written, dropped;
+    /** Cluster frames_attach() draws. */
+    struct cell_cluster *cluster;
+};
+
+/**
+ * Start an export and its writer thread.
+ * @param exp Export to set up.
+ * @param target File name pattern with one %d, or | and a command to pipe to.
+ * @param view View to draw frames with.
+ * @param w Frame width in pixels.
+ * @param h Frame height in pixels.
+ * @return 0 ok, 1 fail.
+ */
+int frames_open(struct frame_export *exp, const char *target, render_view view, int w, int h);
+
+/**
+ * Draw a frame of a cluster and queue it, or count it dropped if the queue is full.
+ * @param exp Export to queue on.
+ * @param cluster Cluster to draw.
+ * @return 0 queued, 1 dropped.
+ */
+int frames_push(struct frame_export *exp, struct cell_cluster *cluster);
+
+/**
+ * Queue a frame every so many ticks.
+ * @param exp Export to queue on.
+ * @param cluster Cluster to draw.
+ * @param every Ticks between frames.
+ * @return Return value of add_callback().
+ */
+int frames_attach(struct frame_export *exp, struct cell_cluster *cluster, unsigned long every);
+
+/**
+ * Queue a last frame unless one was just queued for this tick, waiting for room
+ * if need be, then let the writer finish and stop it.
+ * @param exp Export to close.
+ * @param cluster Cluster to draw the last frame of, NULL for none.
+ * @return 0 ok, 1 if anything failed to write.
+ */
+int frames_close(struct frame_export *exp, struct cell_cluster *cluster);
+
+#endif
@@ -0,0 +1,41 @@
+/** @file
+ * Table of hand written test genomes that can be used to populate a cluster
+ * by name from any of the front ends.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "cellgenome.h"
+
+/* Test instructions, they do what they are called... */
+const struct genome_def genome_table[] = {
+    { "randpop",    { SPOR, STOP } },
+    { "popleft",    { ZERO, TURN, SPOR, STOP } },
+    { "popright",   { INCR, TURN, SPOR, STOP } },
+    { "popup",      { INCR, INCR, TURN, SPOR, STOP } },
+    { "popdown",    { INCR, INCR, INCR, TURN, SPOR, STOP } },
+    { "star",       { TURN, SPOR, INCR, TURN, SPOR, INCR, TURN, SPOR, INCR, TURN, SPOR, STOP } },
+    { "rightup",    { INCR, TURN, SPOR, INCR, TURN, SPOR, STOP } },
+    { "randpopeat", { SPOR, RDIR, CRCH, STOP } },
+    { NULL }
+};
+
+const char *genome_defaults[] = {
+    "randpop", "popup", "popleft", "popright", "popdown", "star", "rightup", NULL
+};
+
+const struct genome_def *genome_find(const char *name) {
+    const struct genome_def *def;
+
+    for (def = genome_table; def->name; def++)
+        if (!strcmp(def->name, name))
+            return def;
+    return NULL;
+}
+
+void genome_pop_defaults(struct cell_cluster *cluster, int energy) {
+    const char **name;
+
+    for (name = genome_defaults; *name; name++)
+        cell_pop(cluster, RANDX(cluster), RANDY(cluster), 1, energy, genome_find(*name)->instructions);
+}
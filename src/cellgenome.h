@@ -0,0 +1,38 @@
+/** @file
+ * Table of hand written test genomes that can be used to populate a cluster
+ * by name from any of the front ends.
+ */
+#ifndef _CELLGENOME_H
+#define _CELLGENOME_H
+
+#include "cellvm.h"
+
+/** A named test genome. */
+struct genome_def {
+    /** Name the genome is looked up by. */
+    const char *name;
+    /** Instructions, anything past the listed ones is NOOP. */
+    char instructions[CSIZE];
+};
+
+/** Test genomes, terminated by an entry with a NULL name. */
+extern const struct genome_def genome_table[];
+
+/** Names of the genomes populated by genome_pop_defaults(), NULL terminated. */
+extern const char *genome_defaults[];
+
+/**
+ * Find a test genome by name.
+ * @param name Name of the genome.
+ * @return The genome on success, NULL if there is no such genome.
+ */
+const struct genome_def *genome_find(const char *name);
+
+/**
+ * Populate random spots in the cluster with one of each default test genome.
+ * @param cluster Cluster to populate.
+ * @param energy Starting energy of each cell.
+ */
+void genome_pop_defaults(struct cell_cluster *cluster, int energy);
+
+#endif
@@ -0,0 +1,56 @@
+/** @file
+ * Per opcode profile of the cell VM, see cellprof.h.
+ */
+#include <stdio.h>
+
+#include "cellprof.h"
+
+/** Names of each PROF_ENDS for printing. */
+static const char *end_names[PROF_ENDS_MAX] = { "stop", "exhausted", "end" };
+
+void prof_add(struct cell_prof *dst, const struct cell_prof *src) {
+    int i, j;
+
+    for (i = 0; i <= IEND; i++) {
+        dst->execs[i] += src->execs[i];
+        dst->energy[i] += src->energy[i];
+        for (j = 0; j < PROF_ENDS_MAX; j++)
+            dst->ends[j][i] += src->ends[j][i];
+    }
+    dst->runs += src->runs;
+    dst->picks += src->picks;
+}
+
+void prof_dump(const struct cell_prof *prof, FILE *file) {
+    unsigned long total, ends[PROF_ENDS_MAX] = { 0 };
+    int i, j;
+
+    for (total = 0, i = 0; i <= IEND; i++) {
+        total += prof->execs[i];
+        for (j = 0; j < PROF_ENDS_MAX; j++)
+            ends[j] += prof->ends[j][i];
+    }
+
+    fprintf(file, "profile: picks:%lu runs:%lu instructions:%lu per_pick:%.2f per_run:%.2f\n",
+            prof->picks, prof->runs, total,
+            prof->picks ? (double)total / prof->picks : 0.0,
+            prof->runs ? (double)total / prof->runs : 0.0);
+    fprintf(file, "ends:");
+    for (j = 0; j < PROF_ENDS_MAX; j++)
+        fprintf(file, " %s:%lu", end_names[j], ends[j]);
+    fprintf(file, "\n");
+
+    fprintf(file, "%-6s %14s %7s %14s", "op", "execs", "%", "energy");
+    for (j = 0; j < PROF_ENDS_MAX; j++)
+        fprintf(file, " %12s", end_names[j]);
+    fprintf(file, "\n");
+    for (i = 0; i <= IEND; i++) {
+        if (!prof->execs[i])
+            continue;
+        fprintf(file, "%-6s %14lu %6.2f%% %14ld", i < IEND ? instrlookup[i] : "INVL",
+                prof->execs[i], 100.0 * prof->execs[i] / total, prof->energy[i]);
+        for (j = 0; j < PROF_ENDS_MAX; j++)
+            fprintf(file, " %12lu", prof->ends[j][i]);
+        fprintf(file, "\n");
+    }
+}
@@ -0,0 +1,62 @@
+/** @file
+ * Per opcode profile of the cell VM, for finding out which instructions real
+ * workloads spend their time in.
+ *
+ * Profiling is switched on by pointing a clusters context at a cell_prof and
+ * off by setting it back to NULL, which can be done between any two ticks.
+ * While on cells are ran by the plain interpreter so every opcode is seen, the
+ * translation cache would hide the pure ones, and the results are the same.
+ * While off it costs a pointer test per scheduled cell. The tiled scheduler
+ * gives each tile its own counters and adds them up after each round.
+ */
+#ifndef _CELLPROF_H
+#define _CELLPROF_H
+
+#include <stdio.h>
+
+#include "cellvm.h"
+
+/** Ways a cells run can end. */
+enum PROF_ENDS {
+    /** Hit a STOP. */
+    PROF_STOP,
+    /** Ran out of energy. */
+    PROF_EXHAUSTED,
+    /** Ran off the end of its instructions. */
+    PROF_END,
+
+    /** Number of ways, keep it at the end. */
+    PROF_ENDS_MAX
+};
+
+/** Profile counters. Opcodes are indexed by their INSTRUCTIONS value, IEND
+  * counts the invalid ones. */
+struct cell_prof {
+    /** Times each opcode was executed. */
+    unsigned long execs[IEND + 1];
+    /** Energy each opcode took from the cell running it, the 1 every
+      * instruction costs plus what it gave away. CRCH can make it negative. */
+    long energy[IEND + 1];
+    /** Opcode that was last to run when a cell finished, by how it finished. */
+    unsigned long ends[PROF_ENDS_MAX][IEND + 1];
+    /** Cells ran, ones that had energy to run with. */
+    unsigned long runs;
+    /** Cells picked by the scheduler, ran or not. */
+    unsigned long picks;
+};
+
+/**
+ * Add one profile to another.
+ * @param dst Profile to add to.
+ * @param src Profile to add.
+ */
+void prof_add(struct cell_prof *dst, const struct cell_prof *src);
+
+/**
+ * Print a profile as a table, one row per opcode.
+ * @param prof Profile to print.
+ * @param file File to print to.
+ */
+void prof_dump(const struct cell_prof *prof, FILE *file);
+
+#endif
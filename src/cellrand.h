@@ -0,0 +1,140 @@
+/** @file
+ * Small fast random number generators for the cellvm. Each execution context
+ * carries its own generator so there is no shared state between threads, and a
+ * whole run can be replayed from the seed given to cluster_seed(). The default
+ * is xoshiro256**, define RNG_PCG32 in config.h to use PCG32 instead.
+ */
+#ifndef _CELLRAND_H
+#define _CELLRAND_H
+
+#include <stdint.h>
+
+#include "config.h"
+
+#ifdef RNG_PCG32
+/** PCG32 generator state. */
+struct cell_rng {
+    /** LCG state. */
+    uint64_t state;
+    /** LCG increment, selects the stream, always odd. */
+    uint64_t inc;
+};
+#else
+/** xoshiro256** generator state. */
+struct cell_rng {
+    /** State words, never all zero. */
+    uint64_t s[4];
+};
+#endif
+
+/**
+ * splitmix64, used to spread a seed out over the generator state.
+ * @param x Pointer to the splitmix state, advanced each call.
+ * @return Next splitmix output.
+ */
+static inline uint64_t rng_splitmix(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+#ifdef RNG_PCG32
+/**
+ * Seed a generator. Different streams with the same seed are independent.
+ * @param rng Generator to seed.
+ * @param seed Seed value.
+ * @param stream Stream number.
+ */
+static inline void rng_seed(struct cell_rng *rng, uint64_t seed, uint64_t stream) {
+    uint64_t sm = seed ^ (stream * 0xd1342543de82ef95ULL);
+
+    rng->inc = (rng_splitmix(&sm) << 1) | 1;
+    rng->state = rng_splitmix(&sm) + rng->inc;
+}
+
+/** Next 32 random bits. */
+static inline uint32_t rng_next32(struct cell_rng *rng) {
+    uint64_t old = rng->state;
+    uint32_t xorshifted, rot;
+
+    rng->state = old * 6364136223846793005ULL + rng->inc;
+    xorshifted = ((old >> 18) ^ old) >> 27;
+    rot = old >> 59;
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+/** Next 64 random bits. */
+static inline uint64_t rng_next(struct cell_rng *rng) {
+    uint64_t hi = rng_next32(rng);
+    return (hi << 32) | rng_next32(rng);
+}
+#else
+/**
+ * Seed a generator. Different streams with the same seed are independent.
+ * @param rng Generator to seed.
+ * @param seed Seed value.
+ * @param stream Stream number.
+ */
+static inline void rng_seed(struct cell_rng *rng, uint64_t seed, uint64_t stream) {
+    uint64_t sm = seed ^ (stream * 0xd1342543de82ef95ULL);
+
+    rng->s[0] = rng_splitmix(&sm);
+    rng->s[1] = rng_splitmix(&sm);
+    rng->s[2] = rng_splitmix(&sm);
+    rng->s[3] = rng_splitmix(&sm);
+}
+
+/** Rotate left. */
+static inline uint64_t rng_rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+/** Next 64 random bits. */
+static inline uint64_t rng_next(struct cell_rng *rng) {
+    uint64_t *s = rng->s;
+    uint64_t result = rng_rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotl(s[3], 45);
+    return result;
+}
+
+/** Next 32 random bits. */
+static inline uint32_t rng_next32(struct cell_rng *rng) {
+    return rng_next(rng) >> 32;
+}
+#endif
+
+/**
+ * Random number between 0 and n-1, uses a multiply instead of a divide.
+ * @param rng Generator to use.
+ * @param n Upper bound, must not be 0.
+ */
+static inline uint32_t rng_below(struct cell_rng *rng, uint32_t n) {
+    return ((uint64_t)rng_next32(rng) * n) >> 32;
+}
+
+/**
+ * Random number between 0 and n-1 for bounds past 32 bits.
+ * @param rng Generator to use.
+ * @param n Upper bound, must not be 0.
+ */
+static inline uint64_t rng_below64(struct cell_rng *rng, uint64_t n) {
+    return ((__uint128_t)rng_next(rng) * n) >> 64;
+}
+
+/**
+ * Random double in (0, 1], never 0 so it is safe to take the log of.
+ * @param rng Generator to use.
+ */
+static inline double rng_unit(struct cell_rng *rng) {
+    return ((rng_next(rng) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+#endif
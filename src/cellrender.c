@@ -0,0 +1,163 @@
+/** @file
+ * CPU side framebuffer for drawing the cell grid, see cellrender.h.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cellrender.h"
+
+int frame_init(struct cell_frame *frame, int w, int h) {
+    if (!(frame->pixels = calloc((size_t)w * h, 4)))
+        return 1;
+    frame->w = w;
+    frame->h = h;
+    frame->dirty_lo = 0;
+    frame->dirty_hi = h;
+    return 0;
+}
+
+void frame_free(struct cell_frame *frame) {
+    free(frame->pixels);
+    frame->pixels = NULL;
+}
+
+void frame_fit(int w, int h, int max, int *fw, int *fh) {
+    int longest;
+
+    *fw = w;
+    *fh = h;
+    if (w > max || h > max) {
+        longest = w > h ? w : h;
+        *fw = (size_t)w * max / longest;
+        *fh = (size_t)h * max / longest;
+        *fw = *fw ? *fw : 1;
+        *fh = *fh ? *fh : 1;
+    }
+}
+
+/** Views by name for render_find(). */
+static const struct {
+    const char *name;
+    render_view view;
+} views[] = {
+    { "energy", render_energy },
+    { "generation", render_generation },
+    { "living", render_living },
+    { "genmap", render_gmap },
+};
+
+render_view render_find(const char *name) {
+    size_t i;
+
+    for (i = 0; i < sizeof views / sizeof *views; i++)
+        if (!strcmp(views[i].name, name))
+            return views[i].view;
+    return NULL;
+}
+
+size_t render_all(struct cell_frame *frame, struct cell_cluster *cluster, render_view view) {
+    int px, py, x, y;
+
+    if (cluster->dirty) {
+        cluster->dirty_all = 0;
+        memset(cluster->dirty_blocks, '\0', (cluster->area + (1 << DIRTY_SHIFT) - 1) >> DIRTY_SHIFT);
+        memset(cluster->dirty, '\0', cluster->area);
+    }
+    for (py = 0; py < frame->h; py++) {
+        for (px = 0; px < frame->w; px++) {
+            frame_cell(frame, cluster, px, py, &x, &y);
+            view(frame, cluster, x, y);
+        }
+    }
+    return (size_t)frame->w * frame->h;
+}
+
+size_t render_dirty(struct cell_frame *frame, struct cell_cluster *cluster, render_view view) {
+    size_t b, blocks, i, end, drawn;
+    int x, y, px, py;
+
+    if (!cluster->dirty || cluster->dirty_all)
+        return render_all(frame, cluster, view);
+
+    /* Marks are cleared before the cell is read, so a cell changing while its
+     * drawn is marked again and redrawn next time rather than lost. */
+    blocks = (cluster->area + (1 << DIRTY_SHIFT) - 1) >> DIRTY_SHIFT;
+    for (drawn = b = 0; b < blocks; b++) {
+        if (!cluster->dirty_blocks[b])
+            continue;
+        cluster->dirty_blocks[b] = 0;
+        end = (b + 1) << DIRTY_SHIFT < cluster->area ? (b + 1) << DIRTY_SHIFT : cluster->area;
+        for (i = b << DIRTY_SHIFT; i < end; i++) {
+            if (!cluster->dirty[i])
+                continue;
+            cluster->dirty[i] = 0;
+            cell_coords(cluster, i, &x, &y);
+            frame_pixel(frame, cluster, x, y, &px, &py);
+            frame_cell(frame, cluster, px, py, &x, &y);
+            view(frame, cluster, x, y);
+            drawn++;
+        }
+    }
+    return drawn;
+}
+
+void render_energy(struct cell_frame *frame, const struct cell_cluster *cluster, int x, int y) {
+    unsigned long energy;
+
+    energy = cell_energy(cluster, cell_index(cluster, x, y));
+
+    if (energy < 256)
+        frame_set_cell(frame, cluster, x, y, energy, 0, 0);
+    else if (energy < 512)
+        frame_set_cell(frame, cluster, x, y, 255, energy, 0);
+    else if (energy < 768)
+        frame_set_cell(frame, cluster, x, y, 255, 255, energy);
+    else
+        frame_set_cell(frame, cluster, x, y, 255, 255, 255);
+}
+
+void render_generation(struct cell_frame *frame, const struct cell_cluster *cluster, int x, int y) {
+    unsigned long gen;
+
+    gen = cell_gen(cluster, cell_index(cluster, x, y));
+
+    /* Attempt to fit more colours in by stepping thru the R,G,B scale, very bad way to do this. */
+    if (gen < 256)
+        frame_set_cell(frame, cluster, x, y, 0, gen, 0);
+    else if (gen < 512)
+        frame_set_cell(frame, cluster, x, y, 0, 255, gen);
+    else if (gen < 768)
+        frame_set_cell(frame, cluster, x, y, gen, 255, 255);
+    else
+        frame_set_cell(frame, cluster, x, y, 255, 255, 255);
+}
+
+void render_living(struct cell_frame *frame, const struct cell_cluster *cluster, int x, int y) {
+    if (cell_energy(cluster, cell_index(cluster, x, y)) > 0)
+        frame_set_cell(frame, cluster, x, y, 0, 0, 255);
+    else
+        frame_set_cell(frame, cluster, x, y, 0, 0, 0);
+}
+
+void render_gmap(struct cell_frame *frame, const struct cell_cluster *cluster, int x, int y) {
+    int i, color;
+    char genome[CSIZE];
+
+    color = 0;
+    cell_genome(cluster, cell_index(cluster, x, y), genome);
+
+    /* Simple hash alrogithem to make a unique color for the cell. */
+    for (i = 0; i < CSIZE && genome[i] != STOP; i++) {
+        color += genome[i];
+        color += (color << 10);
+        color ^= (color >> 6);
+    }
+    color += (color << 3);
+    color += (color >> 11);
+    color ^= (color << 15);
+
+    /* the << shifts for the R,G,B channels give the output a little colour
+     * rather than bland grey scale images. */
+    frame_set_cell(frame, cluster, x, y, color<<1, color<<2, color<<4);
+}
@@ -0,0 +1,219 @@
+/** @file
+ * CPU side framebuffer for drawing the cell grid, one RGBA pixel per cell. The
+ * views (energy, generation, living and genmap) colour pixels in here, and the
+ * display uploads the rows that changed as a texture rather than drawing a quad
+ * per cell. Nothing in here touches GL.
+ *
+ * A frame can be smaller than the grid it shows, in which case cells are
+ * sampled down onto the pixels with several cells sharing each pixel.
+ *
+ * Frames are kept up to date with render_dirty(), which only redraws the cells
+ * the VM marked as changed since the last call, see cluster_track_dirty(). So
+ * the work per frame follows how much is going on rather than the grid size or
+ * how many ticks ran. render_all() draws everything, for switching views.
+ */
+#ifndef _CELLRENDER_H
+#define _CELLRENDER_H
+
+#include "cellvm.h"
+
+/** Framebuffer of RGBA pixels. */
+struct cell_frame {
+    /** Pixels, 4 bytes each in R,G,B,A order, row by row from the top. */
+    unsigned char *pixels;
+    /** Size in pixels. */
+    int w, h;
+    /** Rows from dirty_lo up to but not including dirty_hi have changed since
+      * the last frame_clean(), empty when dirty_lo >= dirty_hi. */
+    int dirty_lo, dirty_hi;
+};
+
+/** A view, colours the pixel a cell lands on from the cell. */
+typedef void (*render_view)(struct cell_frame *frame, const struct cell_cluster *cluster, int x, int y);
+
+/**
+ * Allocate a black framebuffer, all rows start dirty.
+ * @param frame Frame to init.
+ * @param w Width in pixels.
+ * @param h Height in pixels.
+ * @return 0 ok, 1 fail.
+ */
+int frame_init(struct cell_frame *frame, int w, int h);
+
+/**
+ * Free a framebuffer from frame_init().
+ * @param frame Frame to free.
+ */
+void frame_free(struct cell_frame *frame);
+
+/**
+ * Size a frame to show a grid, a pixel per cell unless thats more than max
+ * along a side, then sampled down keeping the shape.
+ * @param w Grid width.
+ * @param h Grid height.
+ * @param max Most pixels along a side.
+ * @param fw Returns the frame width.
+ * @param fh Returns the frame height.
+ */
+void frame_fit(int w, int h, int max, int *fw, int *fh);
+
+/**
+ * Mark every row as drawn.
+ * @param frame Frame to clean.
+ */
+static inline void frame_clean(struct cell_frame *frame) {
+    frame->dirty_lo = frame->h;
+    frame->dirty_hi = 0;
+}
+
+/**
+ * Convert a colour channel to a byte, clamping it to 0-1 the same way
+ * glColor3f does.
+ * @param v Channel value.
+ * @return Byte value of the channel.
+ */
+static inline unsigned char frame_channel(float v) {
+    if (v <= 0.0f)
+        return 0;
+    if (v >= 1.0f)
+        return 255;
+    return v * 255.0f + 0.5f;
+}
+
+/**
+ * Set a pixel and mark its row dirty.
+ * @param frame Frame to draw to.
+ * @param x Horizontal coord.
+ * @param y Vertical coord.
+ * @param R Red value, clamped to 0-1.
+ * @param G Green value, clamped to 0-1.
+ * @param B Blue value, clamped to 0-1.
+ */
+static inline void frame_set(struct cell_frame *frame, int x, int y, float R, float G, float B) {
+    unsigned char *p = &frame->pixels[((size_t)y * frame->w + x) * 4];
+
+    p[0] = frame_channel(R);
+    p[1] = frame_channel(G);
+    p[2] = frame_channel(B);
+    p[3] = 255;
+
+    if (y < frame->dirty_lo)
+        frame->dirty_lo = y;
+    if (y >= frame->dirty_hi)
+        frame->dirty_hi = y + 1;
+}
+
+/**
+ * Get the pixel a cell lands on.
+ * @param frame Frame being drawn.
+ * @param cluster Cluster the cell is in.
+ * @param x x coord of the cell.
+ * @param y y coord of the cell.
+ * @param px Pointer to store the x coord of the pixel.
+ * @param py Pointer to store the y coord of the pixel.
+ */
+static inline void frame_pixel(const struct cell_frame *frame, const struct cell_cluster *cluster,
+                               int x, int y, int *px, int *py) {
+    *px = (size_t)x * frame->w / cluster->w;
+    *py = (size_t)y * frame->h / cluster->h;
+}
+
+/**
+ * Get a cell that lands on a pixel, the reverse of frame_pixel().
+ * @param frame Frame being drawn.
+ * @param cluster Cluster the cell is in.
+ * @param px x coord of the pixel.
+ * @param py y coord of the pixel.
+ * @param x Pointer to store the x coord of the cell.
+ * @param y Pointer to store the y coord of the cell.
+ */
+static inline void frame_cell(const struct cell_frame *frame, const struct cell_cluster *cluster,
+                              int px, int py, int *x, int *y) {
+    /* Rounding up makes sure frame_pixel() maps the cell back to this pixel. */
+    *x = ((size_t)px * cluster->w + frame->w - 1) / frame->w;
+    *y = ((size_t)py * cluster->h + frame->h - 1) / frame->h;
+}
+
+/**
+ * Set the pixel a cell lands on.
+ * @param frame Frame to draw to.
+ * @param cluster Cluster the cell is in.
+ * @param x x coord of the cell.
+ * @param y y coord of the cell.
+ * @param R Red value, clamped to 0-1.
+ * @param G Green value, clamped to 0-1.
+ * @param B Blue value, clamped to 0-1.
+ */
+static inline void frame_set_cell(struct cell_frame *frame, const struct cell_cluster *cluster,
+                                  int x, int y, float R, float G, float B) {
+    int px, py;
+
+    frame_pixel(frame, cluster, x, y, &px, &py);
+    frame_set(frame, px, py, R, G, B);
+}
+
+/**
+ * Redraw every pixel of a frame with a view, clearing any marks on the clusters
+ * cells first so changes made while drawing show up next time.
+ * @param frame Frame to draw to.
+ * @param cluster Cluster to draw.
+ * @param view View to draw with.
+ * @return Number of pixels drawn.
+ */
+size_t render_all(struct cell_frame *frame, struct cell_cluster *cluster, render_view view);
+
+/**
+ * Redraw the pixels of the cells marked as changed with a view and clear the
+ * marks. Where a pixel has several cells its redrawn from the same cell
+ * render_all() uses. Draws everything if the cluster isnt tracking changes.
+ * @param frame Frame to draw to.
+ * @param cluster Cluster to draw.
+ * @param view View to draw with.
+ * @return Number of cells redrawn.
+ */
+size_t render_dirty(struct cell_frame *frame, struct cell_cluster *cluster, render_view view);
+
+/**
+ * Look up a view by name.
+ * @param name energy, generation, living or genmap.
+ * @return The view, NULL if theres none by that name.
+ */
+render_view render_find(const char *name);
+
+/**
+ * Colour the pixel a cell lands on by the cells energy.
+ * @param frame Frame to draw to.
+ * @param cluster Cluster to get the cell from.
+ * @param x X coord.
+ * @param y Y coord.
+ */
+void render_energy(struct cell_frame *frame, const struct cell_cluster *cluster, int x, int y);
+
+/**
+ * Colour the pixel a cell lands on by the cells generation.
+ * @param frame Frame to draw to.
+ * @param cluster Cluster to get the cell from.
+ * @param x X coord.
+ * @param y Y coord.
+ */
+void render_generation(struct cell_frame *frame, const struct cell_cluster *cluster, int x, int y);
+
+/**
+ * Colour the pixel a cell lands on blue if the cell is alive, black if not.
+ * @param frame Frame to draw to.
+ * @param cluster Cluster to get the cell from.
+ * @param x X coord.
+ * @param y Y coord.
+ */
+void render_living(struct cell_frame *frame, const struct cell_cluster *cluster, int x, int y);
+
+/**
+ * Colour the pixel a cell lands on by a hash of the cells genome.
+ * @param frame Frame to draw to.
+ * @param cluster Cluster to get the cell from.
+ * @param x X coord.
+ * @param y Y coord.
+ */
+void render_gmap(struct cell_frame *frame, const struct cell_cluster *cluster, int x, int y);
+
+#endif
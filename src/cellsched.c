@@ -0,0 +1,832 @@
+/** @file
+ * Multi threaded tiled scheduler for the cellvm, see cellsched.h for how the
+ * grid is split up so threads never touch the same cells.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include "cellsched.h"
+#include "cellxlat.h"
+#include "cellprof.h"
+#include "cellshard.h"
+
+/** A rectangle of the grid that is scheduled as one unit. */
+struct sched_tile {
+    /** Top left corner of the tile. */
+    int x, y;
+    /** Width and height of the tile. */
+    int w, h;
+    /** Random cells to run per turn. */
+    unsigned long quota;
+    /** Execution context, owned by the tile rather than the thread so the
+      * results dont depend on which thread picked the tile up. */
+    struct cell_ctx ctx;
+    /** Counters updated thru ctx, merged into the cluster after each round. */
+    struct cluster_stats stats;
+    /** Profile counted into while the cluster is being profiled, merged like stats. */
+    struct cell_prof prof;
+    /** Set if any cell had energy to run this round. */
+    char didstuff;
+};
+
+/** State shared by the coordinating thread and the workers. */
+struct sched_pool {
+    /** Cluster being scheduled. */
+    struct cell_cluster *cluster;
+    /** All the tiles of the grid. */
+    struct sched_tile *tiles;
+    /** Number of tiles. */
+    int ntiles;
+    /** Indices of the tiles of each checkerboard colour. */
+    int *colours[4];
+    /** Number of tiles of each colour. */
+    int ncolour[4];
+    /** Colour currently being ran. */
+    int colour;
+    /** Next tile of the current colour to hand out. */
+    atomic_int next;
+    /** Set to make the workers exit at the next start barrier. */
+    char quit;
+    /** Barriers at the start and end of each colour. */
+    struct sched_barrier start, done;
+    /** Translation cache of each thread, NULL if not in use. */
+    struct xcache **caches;
+};
+
+/** Arguments of a worker thread. */
+struct sched_worker {
+    /** Pool the worker belongs to. */
+    struct sched_pool *pool;
+    /** Thread number, 0 is the coordinating thread. */
+    int id;
+};
+
+void sched_barrier_init(struct sched_barrier *barrier, int count, int shared) {
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+
+    pthread_mutexattr_init(&mattr);
+    pthread_condattr_init(&cattr);
+    if (shared) {
+        pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+        pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    }
+    pthread_mutex_init(&barrier->lock, &mattr);
+    pthread_cond_init(&barrier->cond, &cattr);
+    pthread_mutexattr_destroy(&mattr);
+    pthread_condattr_destroy(&cattr);
+    barrier->count = count;
+    barrier->waiting = 0;
+    barrier->generation = 0;
+}
+
+void sched_barrier_destroy(struct sched_barrier *barrier) {
+    pthread_mutex_destroy(&barrier->lock);
+    pthread_cond_destroy(&barrier->cond);
+}
+
+void sched_barrier_wait(struct sched_barrier *barrier) {
+    unsigned long generation;
+
+    pthread_mutex_lock(&barrier->lock);
+    generation = barrier->generation;
+    if (++barrier->waiting == barrier->count) {
+        barrier->waiting = 0;
+        barrier->generation++;
+        pthread_cond_broadcast(&barrier->cond);
+    } else {
+        while (generation == barrier->generation)
+            pthread_cond_wait(&barrier->cond, &barrier->lock);
+    }
+    pthread_mutex_unlock(&barrier->lock);
+}
+
+/**
+ * Split one dimension of the grid into an even number of spans at least two cells
+ * wide, so the checkerboard colours still alternate across the wrap around.
+ * @param len Length of the dimension.
+ * @param starts Returns a malloc'd array of span starts.
+ * @param sizes Returns a malloc'd array of span lengths.
+ * @return Number of spans, 0 if the dimension is too small to split.
+ */
+static int split(int len, int **starts, int **sizes) {
+    int i, count, pos;
+
+    if (len < 4)
+        return 0;
+    count = (len / TILE_SIZE) & ~1;
+    if (count < 2)
+        count = 2;
+
+    if (!(*starts = malloc(count * sizeof(int))) || !(*sizes = malloc(count * sizeof(int))))
+        exit(1);
+
+    /* Spread the remainder over the first few spans. */
+    for (i = pos = 0; i < count; i++) {
+        (*starts)[i] = pos;
+        (*sizes)[i] = len / count + (i < len % count);
+        pos += (*sizes)[i];
+    }
+    return count;
+}
+
+/**
+ * Run one turn of a tile.
+ * @param cluster Cluster the tile is in.
+ * @param tile Tile to run.
+ */
+static void run_tile(struct cell_cluster *cluster, struct sched_tile *tile) {
+    unsigned long n;
+    int x, y;
+    char didstuff;
+
+    for (n = 0; n < tile->quota; n++) {
+        didstuff = 0;
+        x = tile->x + rng_below(&tile->ctx.rng, tile->w);
+        y = tile->y + rng_below(&tile->ctx.rng, tile->h);
+        if (proc_cell(cluster, &tile->ctx, x, y, &didstuff)) {
+#ifdef DEBUG
+            printf("Cell table error: %dx%d\n", x, y);
+#endif
+            exit(1);
+        }
+        cell_reap(cluster, &tile->ctx, x, y);
+        tile->didstuff |= didstuff;
+    }
+}
+
+/**
+ * Grab tiles of the current colour and run them until there are none left.
+ * @param pool Pool to take tiles from.
+ * @param id Thread number of the caller.
+ */
+static void run_colour(struct sched_pool *pool, int id) {
+    struct sched_tile *tile;
+    int t;
+
+    while ((t = atomic_fetch_add(&pool->next, 1)) < pool->ncolour[pool->colour]) {
+        tile = &pool->tiles[pool->colours[pool->colour][t]];
+        /* Caches belong to threads, the context borrows this ones. */
+        tile->ctx.xcache = pool->caches[id];
+        run_tile(pool->cluster, tile);
+    }
+}
+
+/**
+ * Worker thread, runs a colour each time the start barrier opens.
+ * @param arg The sched_worker.
+ */
+static void *worker(void *arg) {
+    struct sched_pool *pool = ((struct sched_worker *)arg)->pool;
+    int id = ((struct sched_worker *)arg)->id;
+
+    for (;;) {
+        sched_barrier_wait(&pool->start);
+        if (pool->quit)
+            break;
+        run_colour(pool, id);
+        sched_barrier_wait(&pool->done);
+    }
+    return NULL;
+}
+
+int cluster_sched_tiled(struct cell_cluster *cluster, int threads) {
+    struct sched_pool pool;
+    struct sched_tile *tile;
+    struct sched_worker *args;
+    pthread_t *workers;
+    int *xstart, *xsize, *ystart, *ysize;
+    int i, j, tx, ty, c, tmp, order[4];
+    unsigned long from;
+    char didstuff;
+
+    /* Too small to keep tiles apart, just run it on this thread. */
+    if (!(tx = split(cluster->w, &xstart, &xsize)) || !(ty = split(cluster->h, &ystart, &ysize))) {
+        if (tx) {
+            free(xstart);
+            free(xsize);
+        }
+        cluster->threads = 1;
+        cluster_sched(cluster);
+        cluster->threads = threads;
+        return 0;
+    }
+
+    /* Cells die and get born on many threads at once now, let SCHED_LIVE
+     * rebuild the index rather than locking it. */
+    cluster->live_track = 0;
+
+    memset(&pool, '\0', sizeof pool);
+    pool.cluster = cluster;
+    pool.ntiles = tx * ty;
+    if (!(pool.tiles = calloc(pool.ntiles, sizeof(struct sched_tile))))
+        exit(1);
+    for (c = 0; c < 4; c++)
+        if (!(pool.colours[c] = malloc(pool.ntiles * sizeof(int))))
+            exit(1);
+
+    for (j = 0; j < ty; j++) {
+        for (i = 0; i < tx; i++) {
+            tile = &pool.tiles[j * tx + i];
+            tile->x = xstart[i];
+            tile->y = ystart[j];
+            tile->w = xsize[i];
+            tile->h = ysize[j];
+            tile->quota = (unsigned long)tile->w * tile->h / TILE_SLICES;
+            if (!tile->quota)
+                tile->quota = 1;
+            /* Each tile gets its own stream off the clusters generator. */
+            cell_ctx_init(&tile->ctx, cluster, &tile->stats, rng_next(&cluster->ctx.rng), j * tx + i + 1);
+
+            c = (i & 1) | ((j & 1) << 1);
+            pool.colours[c][pool.ncolour[c]++] = j * tx + i;
+        }
+    }
+    free(xstart);
+    free(xsize);
+    free(ystart);
+    free(ysize);
+
+    sched_barrier_init(&pool.start, threads, 0);
+    sched_barrier_init(&pool.done, threads, 0);
+    /* This thread shares the clusters cache, the others get their own. */
+    if (!(pool.caches = calloc(threads, sizeof(struct xcache *))))
+        exit(1);
+    pool.caches[0] = cluster->ctx.xcache;
+    for (i = 1; i < threads && cluster->ctx.xcache; i++)
+        pool.caches[i] = xcache_new(cluster->ndirs);
+
+    if (!(workers = malloc((threads - 1) * sizeof(pthread_t))) || !(args = malloc((threads - 1) * sizeof *args)))
+        exit(1);
+    for (i = 0; i < threads - 1; i++) {
+        args[i].pool = &pool;
+        args[i].id = i + 1;
+        if (pthread_create(&workers[i], NULL, worker, &args[i]))
+            exit(1);
+    }
+
+    while (!cluster->sched_end) {
+        /* Run the colours in a random order so no colour always goes first. */
+        for (i = 0; i < 4; i++)
+            order[i] = i;
+        for (i = 3; i > 0; i--) {
+            j = rng_below(&cluster->ctx.rng, i + 1);
+            tmp = order[i];
+            order[i] = order[j];
+            order[j] = tmp;
+        }
+
+        /* Profiling can be switched on or off between rounds. */
+        for (i = 0; i < pool.ntiles; i++)
+            pool.tiles[i].ctx.prof = cluster->ctx.prof ? &pool.tiles[i].prof : NULL;
+
+        for (i = 0; i < 4; i++) {
+            pool.colour = order[i];
+            atomic_store(&pool.next, 0);
+            sched_barrier_wait(&pool.start);
+            run_colour(&pool, 0);
+            sched_barrier_wait(&pool.done);
+        }
+
+        /* Fold the round back into the cluster then do the callbacks it crossed. */
+        from = cluster->tick;
+        didstuff = 0;
+        for (i = 0; i < pool.ntiles; i++) {
+            tile = &pool.tiles[i];
+            cluster->tick += tile->quota;
+            cluster_stats_add(&cluster->stats, &tile->stats);
+            memset(&tile->stats, '\0', sizeof tile->stats);
+            if (tile->ctx.prof) {
+                prof_add(cluster->ctx.prof, &tile->prof);
+                memset(&tile->prof, '\0', sizeof tile->prof);
+            }
+            didstuff |= tile->didstuff;
+            tile->didstuff = 0;
+        }
+        do_callbacks_span(&cluster->callbacks, from, cluster->tick, -1, -1, didstuff);
+    }
+
+    pool.quit = 1;
+    sched_barrier_wait(&pool.start);
+    for (i = 0; i < threads - 1; i++)
+        pthread_join(workers[i], NULL);
+
+    free(workers);
+    free(args);
+    for (i = 1; i < threads; i++)
+        xcache_free(pool.caches[i]);
+    free(pool.caches);
+    sched_barrier_destroy(&pool.start);
+    sched_barrier_destroy(&pool.done);
+    for (c = 0; c < 4; c++)
+        free(pool.colours[c]);
+    free(pool.tiles);
+    return 0;
+}
+
+/** A band of SYNC_ROWS rows of the grid that is stepped as one unit. */
+struct sync_unit {
+    /** Indexes of the first cell and one past the last. */
+    size_t start, end;
+    /** Execution context, seeded each step from the unit number. */
+    struct cell_ctx ctx;
+    /** Counters updated thru ctx, merged into the cluster after each step. */
+    struct cluster_stats stats;
+    /** Intents made by the units cells, in cell order. */
+    struct sync_intent *intents;
+    size_t nintents, intents_size;
+    /** Cells of the unit left with no energy. */
+    size_t *dying;
+    size_t ndying, dying_size;
+    /** Set if any cell had energy to run this step. */
+    char didstuff;
+    /** Units whose intents can land in this one, in ascending order. */
+    int neighbours[3];
+    int nneighbours;
+};
+
+/** Arguments of a sync worker thread. */
+struct sync_worker {
+    /** Pool the worker belongs to. */
+    struct sync_pool *pool;
+    /** Thread number, 0 is the coordinating thread. */
+    int id;
+};
+
+/** State shared by the coordinating thread and the workers of the sync stepper. */
+struct sync_pool {
+    /** Cluster being stepped, its arena is the current grid. */
+    struct cell_cluster *cluster;
+    /** Copy of the cluster pointed at the back arena, the next grid. */
+    struct cell_cluster next;
+    /** Arena of the next grid, swapped with the clusters after each step. */
+    void *back;
+    /** All the units of the grid. */
+    struct sync_unit *units;
+    /** Number of units. */
+    int nunits;
+    /** Shard being stepped, NULL for the whole grid. */
+    struct cell_shard *shard;
+    /** First and one past the last unit this process steps. */
+    int first, end;
+    /** Next unit to hand out for running and for resolving. */
+    atomic_int next_exec, next_resolve;
+    /** Set to make the workers exit at the next start barrier. */
+    char quit;
+    /** Barriers at the start, between the phases and at the end of each step. */
+    struct sched_barrier start, mid, done;
+    /** Threads, including the coordinating one. */
+    int threads;
+    /** Worker threads and their arguments. */
+    pthread_t *workers;
+    struct sync_worker *args;
+    /** Translation cache of each thread, all NULL if the cluster has none. */
+    struct xcache **caches;
+};
+
+/**
+ * Record an intent, growing the units list if need be.
+ * @param unit Unit the cell making it is in.
+ * @param kind One of SYNC_INTENTS.
+ * @param target Index of the neighbour.
+ * @param value Energy given or the childs energy.
+ * @return The intent, for filling in the rest of a SPOR.
+ */
+static struct sync_intent *sync_intent(struct sync_unit *unit, int kind, size_t target, unsigned long value) {
+    struct sync_intent *intent;
+
+    if (unit->nintents == unit->intents_size) {
+        unit->intents_size = unit->intents_size ? unit->intents_size * 2 : 64;
+        if (!(unit->intents = realloc(unit->intents, unit->intents_size * sizeof *unit->intents)))
+            exit(1);
+    }
+    intent = &unit->intents[unit->nintents++];
+    intent->kind = kind;
+    intent->target = target;
+    intent->value = value;
+    return intent;
+}
+
+/**
+ * Run one cell for a synchronous step. Neighbours are looked at in the current
+ * grid, the cells own energy and genome are kept in the next one.
+ * @param pool Pool with the grids.
+ * @param unit Unit the cell is in.
+ * @param x x coord of the cell.
+ * @param y y coord of the cell.
+ * @param cell Index of the cell.
+ */
+static void sync_cell(struct sync_pool *pool, struct sync_unit *unit, int x, int y, size_t cell) {
+    const struct cell_cluster *cur = pool->cluster;
+    struct cell_cluster *next = &pool->next;
+    struct sync_intent *intent;
+    unsigned long energy;
+    int instptr, reg0, direct, stop, inst;
+    size_t neighb;
+
+    energy = cell_energy(cur, cell);
+    if (energy > 0) {
+        unit->didstuff = 1;
+        direct = rng_below(&unit->ctx.rng, cur->ndirs);
+        for (instptr = reg0 = stop = 0; energy > 0 && instptr < CSIZE && !stop; instptr++) {
+            inst = cell_inst(next, cell, instptr);
+            switch (inst) {
+            case STOP:
+                stop = 1;
+                break;
+            case INCR:
+                reg0++;
+                break;
+            case DNCR:
+                if (reg0 > 0)
+                    reg0--;
+                break;
+            case ZERO:
+                reg0 = 0;
+                break;
+            case TURN:
+                if (reg0 < cur->ndirs)
+                    direct = reg0;
+                break;
+            case CRCH:
+            case KILL:
+                if (energy <= 1)
+                    break;
+                neighb = cell_neighbour(cur, x, y, direct);
+                if (cell_gen(cur, neighb) != 0) {
+                    if (inst == CRCH)
+                        energy += 10;
+                    sync_intent(unit, inst == CRCH ? SYNC_CRCH : SYNC_KILL, neighb, 0);
+                }
+                break;
+            case SHAR:
+                if (energy <= 1)
+                    break;
+                neighb = cell_neighbour(cur, x, y, direct);
+                if (cell_gen(cur, neighb) != 0) {
+                    sync_intent(unit, SYNC_SHAR, neighb, energy/2);
+                    unit->stats.shar_energy += energy/2;
+                    energy = energy/2;
+                }
+                break;
+            case SPOR:
+                if (energy <= 2)
+                    break;
+                neighb = cell_neighbour(cur, x, y, direct);
+                if (cell_gen(cur, neighb) == 0) {
+                    intent = sync_intent(unit, SYNC_SPOR, neighb, energy - 2 + cell_energy(cur, neighb));
+                    intent->gen = cell_gen(cur, cell) + 1;
+                    cell_genome(next, cell, intent->genome);
+                    cell_mutate(next, &unit->ctx, x, y);
+                }
+                break;
+            case RDIR:
+                direct = rng_below(&unit->ctx.rng, cur->ndirs);
+                break;
+            default: /* NOOP and invalid opcodes. */
+                break;
+            }
+            energy--;
+        }
+        cell_set_energy(next, cell, energy);
+        unit->stats.instructions += instptr;
+    }
+
+    if (!energy && cell_gen(cur, cell) != 0) {
+        if (unit->ndying == unit->dying_size) {
+            unit->dying_size = unit->dying_size ? unit->dying_size * 2 : 64;
+            if (!(unit->dying = realloc(unit->dying, unit->dying_size * sizeof *unit->dying)))
+                exit(1);
+        }
+        unit->dying[unit->ndying++] = cell;
+    }
+}
+
+/**
+ * First phase of a step, copy the units rows to the next grid and run them.
+ * @param pool Pool with the grids.
+ * @param unit Unit to run.
+ */
+static void sync_exec(struct sync_pool *pool, struct sync_unit *unit) {
+    const struct cell_cluster *cur = pool->cluster;
+    size_t i;
+    int x, y;
+
+    cell_copy_span(&pool->next, cur, unit->start, unit->end - unit->start);
+    cell_coords(cur, unit->start, &x, &y);
+    for (i = unit->start; i < unit->end; i++) {
+        sync_cell(pool, unit, x, y, i);
+        if (++x == cur->w) {
+            x = 0;
+            y++;
+        }
+    }
+}
+
+/**
+ * Second phase of a step, apply the intents landing in the units rows in the
+ * order they were made then reap the cells that ran out of energy.
+ * @param pool Pool with the grids.
+ * @param unit Unit to resolve.
+ */
+static void sync_resolve(struct sync_pool *pool, struct sync_unit *unit) {
+    struct cell_cluster *next = &pool->next;
+    const struct sync_intent *intent;
+    const struct sync_unit *from;
+    size_t i, t;
+    int n;
+
+    for (n = 0; n < unit->nneighbours; n++) {
+        from = &pool->units[unit->neighbours[n]];
+        for (i = 0; i < from->nintents; i++) {
+            intent = &from->intents[i];
+            t = intent->target;
+            if (t < unit->start || t >= unit->end)
+                continue;
+
+            switch (intent->kind) {
+            case SYNC_CRCH:
+            case SYNC_KILL:
+                /* Only the first one to get there killed it. */
+                if (cell_gen(next, t) != 0) {
+                    cell_clear(next, t);
+                    if (intent->kind == SYNC_CRCH)
+                        unit->stats.crch_deaths++;
+                    else
+                        unit->stats.kill_deaths++;
+                }
+                break;
+            case SYNC_SHAR:
+                if (cell_gen(next, t) != 0)
+                    cell_set_energy(next, t, cell_energy(next, t) + intent->value);
+                break;
+            case SYNC_SPOR:
+                /* Spores only go into cells that were empty, so anything here
+                 * is an earlier spore, the strongest child wins. */
+                if (cell_gen(next, t) == 0)
+                    unit->stats.spor_copies++;
+                else if (intent->value <= cell_energy(next, t))
+                    break;
+                cell_set_genome(next, t, intent->genome);
+                cell_set_gen(next, t, intent->gen);
+                cell_set_energy(next, t, intent->value);
+                break;
+            }
+        }
+    }
+
+    for (i = 0; i < unit->ndying; i++) {
+        t = unit->dying[i];
+        if (cell_gen(next, t) != 0 && cell_energy(next, t) == 0) {
+            cell_clear(next, t);
+            unit->stats.energy_death++;
+        }
+    }
+}
+
+/**
+ * Swap intents with the other shards, the edge units send theirs and the edge
+ * units of the shards either side are filled in with what they sent.
+ * @param pool Pool with a shard.
+ */
+static void sync_exchange(struct sync_pool *pool) {
+    struct sync_unit *unit;
+    int u;
+
+    shard_send(pool->shard, 0, pool->units[pool->first].intents, pool->units[pool->first].nintents);
+    if (pool->end - 1 != pool->first)
+        shard_send(pool->shard, 1, pool->units[pool->end - 1].intents, pool->units[pool->end - 1].nintents);
+    shard_wait(pool->shard);
+
+    /* These units arent ran here so their lists are never grown, they can
+     * point straight into the segment. */
+    u = (pool->first + pool->nunits - 1) % pool->nunits;
+    unit = &pool->units[u];
+    unit->intents = shard_recv(pool->shard, u, &unit->nintents);
+    u = pool->end % pool->nunits;
+    unit = &pool->units[u];
+    unit->intents = shard_recv(pool->shard, u, &unit->nintents);
+}
+
+/**
+ * Run units then resolve them until there are none left, waiting for every
+ * thread to finish running, and for the other shards if there are any, before
+ * resolving.
+ * @param pool Pool to take units from.
+ * @param id Thread number of the caller.
+ */
+static void sync_phases(struct sync_pool *pool, int id) {
+    int u;
+
+    while ((u = pool->first + atomic_fetch_add(&pool->next_exec, 1)) < pool->end) {
+        /* Caches belong to threads, the units context borrows this ones. */
+        pool->units[u].ctx.xcache = pool->caches[id];
+        sync_exec(pool, &pool->units[u]);
+    }
+    sched_barrier_wait(&pool->mid);
+    if (pool->shard) {
+        if (!id)
+            sync_exchange(pool);
+        sched_barrier_wait(&pool->mid);
+    }
+    while ((u = pool->first + atomic_fetch_add(&pool->next_resolve, 1)) < pool->end)
+        sync_resolve(pool, &pool->units[u]);
+}
+
+/**
+ * Sync worker thread, runs both phases of a step each time the start barrier opens.
+ * @param arg The sync_worker.
+ */
+static void *sync_thread(void *arg) {
+    struct sync_pool *pool = ((struct sync_worker *)arg)->pool;
+    int id = ((struct sync_worker *)arg)->id;
+
+    for (;;) {
+        sched_barrier_wait(&pool->start);
+        if (pool->quit)
+            break;
+        sync_phases(pool, id);
+        sched_barrier_wait(&pool->done);
+    }
+    return NULL;
+}
+
+/**
+ * Split the grid into units, map the back grid and start the workers.
+ * @param pool Pool to set up.
+ * @param cluster Cluster to step.
+ * @param threads Threads to use, clamped to 1 to the number of units stepped.
+ * @param shard Shard to step, NULL for the whole grid.
+ * @return 0 ok, 1 fail.
+ */
+static int sync_init(struct sync_pool *pool, struct cell_cluster *cluster, int threads, struct cell_shard *shard) {
+    struct sync_unit *unit;
+    int i, j, k, n, rows;
+
+    memset(pool, '\0', sizeof *pool);
+    pool->cluster = cluster;
+    pool->back = mmap(NULL, cluster->arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (pool->back == MAP_FAILED)
+        return 1;
+
+    /* Units are cut the same whatever the thread count so the results are too. */
+    pool->nunits = (cluster->h + SYNC_ROWS - 1) / SYNC_ROWS;
+    if (!(pool->units = calloc(pool->nunits, sizeof(struct sync_unit))))
+        exit(1);
+    for (i = 0; i < pool->nunits; i++) {
+        unit = &pool->units[i];
+        rows = cluster->h - i * SYNC_ROWS < SYNC_ROWS ? cluster->h - i * SYNC_ROWS : SYNC_ROWS;
+        unit->start = (size_t)i * SYNC_ROWS * cluster->w;
+        unit->end = unit->start + (size_t)rows * cluster->w;
+
+        /* Neighbours are at most a row away so only the units either side, round
+         * the wrap, can reach into this one. Sorted and deduped for small grids. */
+        for (j = 0; j < 3; j++) {
+            k = (i + pool->nunits + j - 1) % pool->nunits;
+            for (n = unit->nneighbours; n > 0 && unit->neighbours[n - 1] >= k; n--)
+                ;
+            if (n < unit->nneighbours && unit->neighbours[n] == k)
+                continue;
+            memmove(&unit->neighbours[n + 1], &unit->neighbours[n], (unit->nneighbours - n) * sizeof(int));
+            unit->neighbours[n] = k;
+            unit->nneighbours++;
+        }
+    }
+
+    pool->shard = shard;
+    pool->first = shard ? shard->first : 0;
+    pool->end = shard ? shard->end : pool->nunits;
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > pool->end - pool->first)
+        threads = pool->end - pool->first;
+    pool->threads = threads;
+    sched_barrier_init(&pool->start, threads, 0);
+    sched_barrier_init(&pool->mid, threads, 0);
+    sched_barrier_init(&pool->done, threads, 0);
+    /* This thread shares the clusters cache, the others get their own. */
+    if (!(pool->caches = calloc(threads, sizeof(struct xcache *))))
+        exit(1);
+    pool->caches[0] = cluster->ctx.xcache;
+    for (i = 1; i < threads && cluster->ctx.xcache; i++)
+        pool->caches[i] = xcache_new(cluster->ndirs);
+    if (!(pool->workers = malloc(threads * sizeof(pthread_t))) || !(pool->args = malloc(threads * sizeof *pool->args)))
+        exit(1);
+    for (i = 0; i < threads - 1; i++) {
+        pool->args[i].pool = pool;
+        pool->args[i].id = i + 1;
+        if (pthread_create(&pool->workers[i], NULL, sync_thread, &pool->args[i]))
+            exit(1);
+    }
+
+    /* Cells die and get born all over the grid at once, let SCHED_LIVE
+     * rebuild the index if its switched back to. */
+    cluster->live_track = 0;
+    return 0;
+}
+
+/**
+ * Stop the workers and free everything sync_init made.
+ * @param pool Pool to free.
+ */
+static void sync_free(struct sync_pool *pool) {
+    int i;
+
+    pool->quit = 1;
+    sched_barrier_wait(&pool->start);
+    for (i = 0; i < pool->threads - 1; i++)
+        pthread_join(pool->workers[i], NULL);
+
+    free(pool->workers);
+    free(pool->args);
+    for (i = 1; i < pool->threads; i++)
+        xcache_free(pool->caches[i]);
+    free(pool->caches);
+    sched_barrier_destroy(&pool->start);
+    sched_barrier_destroy(&pool->mid);
+    sched_barrier_destroy(&pool->done);
+    for (i = pool->first; i < pool->end; i++) {
+        free(pool->units[i].intents);
+        free(pool->units[i].dying);
+    }
+    free(pool->units);
+    munmap(pool->back, pool->cluster->arena_size);
+}
+
+/**
+ * Step the cluster one generation then do the callbacks it crossed.
+ * @param pool Pool set up for the cluster.
+ */
+static void sync_step(struct sync_pool *pool) {
+    struct cell_cluster *cluster = pool->cluster;
+    struct sync_unit *unit;
+    unsigned long seed, from;
+    void *arena;
+    char didstuff;
+    int i;
+
+    /* Every unit gets its own stream off one number from the clusters generator. */
+    seed = rng_next(&cluster->ctx.rng);
+    for (i = pool->first; i < pool->end; i++) {
+        unit = &pool->units[i];
+        cell_ctx_init(&unit->ctx, cluster, &unit->stats, seed, i + 1);
+        unit->nintents = unit->ndying = 0;
+    }
+    /* Taken each step as a callback could have changed the cluster. */
+    pool->next = *cluster;
+    cluster_set_arena(&pool->next, pool->back);
+    if (pool->shard)
+        shard_rows(pool->shard, cluster);
+
+    atomic_store(&pool->next_exec, 0);
+    atomic_store(&pool->next_resolve, 0);
+    sched_barrier_wait(&pool->start);
+    sync_phases(pool, 0);
+    sched_barrier_wait(&pool->done);
+
+    arena = cluster->arena;
+    cluster_set_arena(cluster, pool->back);
+    pool->back = arena;
+
+    from = cluster->tick;
+    cluster->tick += cluster->area;
+    didstuff = 0;
+    for (i = pool->first; i < pool->end; i++) {
+        unit = &pool->units[i];
+        cluster_stats_add(&cluster->stats, &unit->stats);
+        memset(&unit->stats, '\0', sizeof unit->stats);
+        didstuff |= unit->didstuff;
+        unit->didstuff = 0;
+    }
+    do_callbacks_span(&cluster->callbacks, from, cluster->tick, -1, -1, didstuff);
+}
+
+int cluster_step(struct cell_cluster *cluster) {
+    struct sync_pool pool;
+
+    if (sync_init(&pool, cluster, cluster->threads, NULL))
+        return 1;
+    sync_step(&pool);
+    sync_free(&pool);
+    return 0;
+}
+
+int cluster_sched_sync(struct cell_cluster *cluster, int threads) {
+    return cluster_sched_shard(cluster, threads, NULL);
+}
+
+int cluster_sched_shard(struct cell_cluster *cluster, int threads, struct cell_shard *shard) {
+    struct sync_pool pool;
+
+    if (sync_init(&pool, cluster, threads, shard))
+        return 1;
+    while (!cluster->sched_end)
+        sync_step(&pool);
+    sync_free(&pool);
+    return 0;
+}
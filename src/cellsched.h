@@ -0,0 +1,126 @@
+/** @file
+ * Multi threaded tiled scheduler for the cellvm. The toroidal grid is split into
+ * an even number of TILE_SIZE tiles in each direction and coloured like a 2x2
+ * checkerboard. Tiles of one colour are at least a whole tile apart so they can
+ * be ran at the same time without any of their CRCH, KILL, SHAR or SPOR writes
+ * landing on the same cell. The colours take turns in a random order, each tile
+ * running area/TILE_SLICES randomly picked cells per turn, which keeps things
+ * close to the single threaded random cell model.
+ *
+ * Also has the synchronous stepper behind cluster_step(). The grid is split into
+ * units of SYNC_ROWS rows, the same units whatever the number of threads. First
+ * every unit copies its rows into the back grid and runs its live cells, reading
+ * only the front grid. A cells own energy and genome go straight into its place
+ * in the back grid, anything it does to a neighbour is recorded as an intent:
+ * CRCH and KILL clear it, SHAR gives it energy and SPOR places a child. CRCH
+ * pays out and SHAR takes its energy at once, a SPOR mutates the parent like
+ * the usual scheduler does. Then each unit resolves the intents landing in its
+ * rows, from its own unit and the ones either side in unit order, which is the
+ * order of the cells that made them:
+ *  - a kill clears the cell, only the first counts as a death,
+ *  - energy shared with a cell that is still there is added to it,
+ *  - of several spores into one empty cell the one with the most energy is
+ *    placed, the first one on a tie,
+ * then reaps its cells that ran out of energy and werent given any. Each unit
+ * draws its random numbers from its own stream seeded once per step, so runs
+ * come out the same on any number of threads. Finally the grids are swapped.
+ */
+#ifndef _CELLSCHED_H
+#define _CELLSCHED_H
+
+#include <pthread.h>
+
+#include "cellvm.h"
+
+/** Reusable barrier, pthread_barrier_t is not avalible on OSX. */
+struct sched_barrier {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /** Threads that have to arrive before any are let go. */
+    int count;
+    /** Threads waiting on the current generation. */
+    int waiting;
+    /** Bumped each time the barrier opens. */
+    unsigned long generation;
+};
+
+/** What a sync_intent does to its target. */
+enum SYNC_INTENTS {
+    /** Clear the target, counted as a CRCH death. */
+    SYNC_CRCH,
+    /** Clear the target, counted as a KILL death. */
+    SYNC_KILL,
+    /** Add value energy to the target if its still alive. */
+    SYNC_SHAR,
+    /** Place a child with value energy in the empty target. */
+    SYNC_SPOR
+};
+
+/** Something a cell did to a neighbour during a synchronous step. */
+struct sync_intent {
+    /** Index of the neighbour. */
+    size_t target;
+    /** Energy given or the childs energy. */
+    unsigned long value;
+    /** Generation of the child. */
+    unsigned long gen;
+    /** One of SYNC_INTENTS. */
+    int kind;
+    /** Genome of the child, before the parent mutated. */
+    char genome[CSIZE];
+};
+
+/** Shard of the grid ran by one process, see cellshard.h. */
+struct cell_shard;
+
+/**
+ * Tiled scheduler, runs until cluster->sched_end is set like cluster_sched.
+ * Ticks are added to the cluster once per round, and callbacks are fired once
+ * per round for every frequency crossed with x and y set to -1. Falls back to
+ * the single threaded scheduler if the grid is too small to tile.
+ * @param cluster Cluster containing cell processes to schedule.
+ * @param threads Number of threads to use, including the calling one.
+ * @return 0 ok, 1 fail.
+ */
+int cluster_sched_tiled(struct cell_cluster *cluster, int threads);
+
+/**
+ * Synchronous scheduler, runs cluster_step() until cluster->sched_end is set,
+ * keeping the back grid and threads between steps.
+ * @param cluster Cluster containing cell processes to schedule.
+ * @param threads Number of threads to use, including the calling one.
+ * @return 0 ok, 1 fail.
+ */
+int cluster_sched_sync(struct cell_cluster *cluster, int threads);
+
+/**
+ * Synchronous scheduler for the rows of one shard, swapping the rows either side
+ * of it and the intents crossing its edges with the other shards each step.
+ * @param cluster Cluster with the shards rows in it.
+ * @param threads Number of threads to use, including the calling one.
+ * @param shard Shard to step, NULL for the whole grid.
+ * @return 0 ok, 1 fail.
+ */
+int cluster_sched_shard(struct cell_cluster *cluster, int threads, struct cell_shard *shard);
+
+/**
+ * Set up a barrier.
+ * @param barrier Barrier to set up.
+ * @param count Threads that have to wait on it before it opens.
+ * @param shared Set if its in memory shared between processes.
+ */
+void sched_barrier_init(struct sched_barrier *barrier, int count, int shared);
+
+/**
+ * Block until count threads are waiting on the barrier.
+ * @param barrier Barrier to wait on.
+ */
+void sched_barrier_wait(struct sched_barrier *barrier);
+
+/**
+ * Free a barrier no thread is waiting on.
+ * @param barrier Barrier to free.
+ */
+void sched_barrier_destroy(struct sched_barrier *barrier);
+
+#endif
@@ -0,0 +1,230 @@
+/** @file
+ * Multi process sharded runs of the synchronous stepper, see cellshard.h.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "cellshard.h"
+
+/**
+ * Copy a row of the grid out to the segment.
+ * @param cluster Cluster to copy from.
+ * @param y Row to copy.
+ * @param row Where to put its w cells.
+ */
+static void put_row(const struct cell_cluster *cluster, int y, struct shard_cell *row) {
+    size_t i;
+    int x;
+
+    for (x = 0; x < cluster->w; x++) {
+        i = cell_index(cluster, x, y);
+        row[x].gen = cell_gen(cluster, i);
+        row[x].energy = cell_energy(cluster, i);
+        cell_genome(cluster, i, row[x].instructions);
+    }
+}
+
+/**
+ * Copy a row from the segment into the grid.
+ * @param cluster Cluster to copy to.
+ * @param y Row to copy over.
+ * @param row Its w cells.
+ */
+static void get_row(struct cell_cluster *cluster, int y, const struct shard_cell *row) {
+    size_t i;
+    int x;
+
+    for (x = 0; x < cluster->w; x++) {
+        i = cell_index(cluster, x, y);
+        cell_set_gen(cluster, i, row[x].gen);
+        cell_set_energy(cluster, i, row[x].energy);
+        cell_set_genome(cluster, i, row[x].instructions);
+    }
+}
+
+/**
+ * Point a shard at its units, rows and cells.
+ * @param shard Shard with its count, w and nunits set.
+ * @param id Shard number.
+ * @param h Grid height.
+ */
+static void shard_place(struct cell_shard *shard, int id, int h) {
+    shard->id = id;
+    shard->first = id * shard->nunits / shard->count;
+    shard->end = (id + 1) * shard->nunits / shard->count;
+    shard->y0 = shard->first * SYNC_ROWS;
+    shard->y1 = shard->end * SYNC_ROWS < h ? shard->end * SYNC_ROWS : h;
+    shard->start = (size_t)shard->y0 * shard->w;
+    shard->stop = (size_t)shard->y1 * shard->w;
+}
+
+void shard_rows(struct cell_shard *shard, struct cell_cluster *cluster) {
+    size_t w = shard->w;
+    int above, below;
+
+    put_row(cluster, shard->y0, &shard->rows[shard->id * 2 * w]);
+    put_row(cluster, shard->y1 - 1, &shard->rows[(shard->id * 2 + 1) * w]);
+    sched_barrier_wait(shard->barrier);
+
+    above = (shard->id + shard->count - 1) % shard->count;
+    below = (shard->id + 1) % shard->count;
+    get_row(cluster, (shard->y0 + cluster->h - 1) % cluster->h, &shard->rows[(above * 2 + 1) * w]);
+    get_row(cluster, shard->y1 % cluster->h, &shard->rows[below * 2 * w]);
+}
+
+void shard_send(struct cell_shard *shard, int side, const struct sync_intent *intents, size_t n) {
+    struct sync_intent *out = &shard->intents[(shard->id * 2 + side) * shard->cap];
+    size_t i, k;
+
+    for (i = k = 0; i < n; i++)
+        if (intents[i].target < shard->start || intents[i].target >= shard->stop)
+            out[k++] = intents[i];
+    shard->nintents[shard->id * 2 + side] = k;
+}
+
+void shard_wait(struct cell_shard *shard) {
+    sched_barrier_wait(shard->barrier);
+}
+
+struct sync_intent *shard_recv(struct cell_shard *shard, int unit, size_t *n) {
+    int s, first, side;
+
+    for (s = 0; unit >= (s + 1) * shard->nunits / shard->count; s++)
+        ;
+    first = s * shard->nunits / shard->count;
+    side = unit == first ? 0 : 1;
+
+    *n = shard->nintents[s * 2 + side];
+    return &shard->intents[(s * 2 + side) * shard->cap];
+}
+
+/**
+ * Body of a shard process, step the shard then leave its rows and counters in
+ * the segment.
+ * @param shard Shard to run.
+ * @param cluster The processes copy of the cluster.
+ * @param threads Threads to use.
+ * @return Exit status, 0 ok, 1 fail.
+ */
+static int shard_run(struct cell_shard *shard, struct cell_cluster *cluster, int threads) {
+    struct shard_result *result = &shard->results[shard->id];
+    struct cell_cluster gathered;
+
+    /* Only count this shards rows, the parent adds them all up. */
+    memset(&cluster->stats, '\0', sizeof cluster->stats);
+    if (cluster_sched_shard(cluster, threads, shard))
+        return 1;
+
+    gathered = *cluster;
+    cluster_set_arena(&gathered, shard->gather);
+    cell_copy_span(&gathered, cluster, shard->start, shard->stop - shard->start);
+    result->stats = cluster->stats;
+    result->tick = cluster->tick;
+    result->rng = cluster->ctx.rng;
+    result->done = 1;
+    return 0;
+}
+
+int cluster_sched_sharded(struct cell_cluster *cluster, int shards, int threads) {
+    struct cell_shard shard;
+    struct cell_cluster gathered;
+    struct timespec nap = { 0, 10000000 };
+    size_t sizes[5], offset;
+    pid_t *pids;
+    int i, started, left, status, failed;
+    char *at;
+
+    memset(&shard, '\0', sizeof shard);
+    shard.count = shards;
+    shard.w = cluster->w;
+    shard.nunits = (cluster->h + SYNC_ROWS - 1) / SYNC_ROWS;
+    if (shards < 2 || shards > shard.nunits)
+        return 1;
+
+    /* Only cells in the top and bottom rows of a unit can reach out of it, at
+     * most one intent per instruction. */
+    shard.cap = 2 * (size_t)cluster->w * CSIZE;
+    sizes[0] = CELL_ROUNDUP(sizeof(struct sched_barrier));
+    sizes[1] = CELL_ROUNDUP(shards * sizeof(struct shard_result));
+    sizes[2] = CELL_ROUNDUP(shards * 2 * sizeof(size_t));
+    sizes[3] = CELL_ROUNDUP(shards * 2 * (size_t)cluster->w * sizeof(struct shard_cell));
+    sizes[4] = CELL_ROUNDUP(shards * 2 * shard.cap * sizeof(struct sync_intent));
+    for (shard.segment_size = i = 0; i < 5; i++)
+        shard.segment_size += sizes[i];
+
+    /* Both are shared with the shards and only touched where used. */
+    shard.segment = mmap(NULL, shard.segment_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (shard.segment == MAP_FAILED)
+        return 1;
+    shard.gather = mmap(NULL, cluster->arena_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (shard.gather == MAP_FAILED) {
+        munmap(shard.segment, shard.segment_size);
+        return 1;
+    }
+    at = shard.segment;
+    shard.barrier = (struct sched_barrier *)at;
+    shard.results = (struct shard_result *)(at + (offset = sizes[0]));
+    shard.nintents = (size_t *)(at + (offset += sizes[1]));
+    shard.rows = (struct shard_cell *)(at + (offset += sizes[2]));
+    shard.intents = (struct sync_intent *)(at + (offset += sizes[3]));
+    sched_barrier_init(shard.barrier, shards, 1);
+
+    if (!(pids = malloc(shards * sizeof(pid_t))))
+        exit(1);
+    /* Anything buffered would be printed again by every shard. */
+    fflush(stdout);
+    fflush(stderr);
+    for (failed = started = 0; started < shards; started++) {
+        shard_place(&shard, started, cluster->h);
+        if ((pids[started] = fork()) == -1) {
+            failed = 1;
+            break;
+        }
+        if (!pids[started])
+            _exit(shard_run(&shard, cluster, threads));
+    }
+
+    /* A shard that dies leaves the rest stuck on the barrier, so watch them all
+     * rather than waiting on each in turn. */
+    for (left = started; left; ) {
+        if (failed)
+            for (i = 0; i < started; i++)
+                if (pids[i] > 0)
+                    kill(pids[i], SIGKILL);
+        for (i = 0; i < started; i++) {
+            if (pids[i] <= 0 || waitpid(pids[i], &status, WNOHANG) != pids[i])
+                continue;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) || !shard.results[i].done)
+                failed = 1;
+            pids[i] = 0;
+            left--;
+        }
+        if (left)
+            nanosleep(&nap, NULL);
+    }
+
+    if (!failed) {
+        gathered = *cluster;
+        cluster_set_arena(&gathered, shard.gather);
+        cell_copy_span(cluster, &gathered, 0, cluster->area);
+        for (i = 0; i < shards; i++)
+            cluster_stats_add(&cluster->stats, &shard.results[i].stats);
+        cluster->tick = shard.results[0].tick;
+        cluster->ctx.rng = shard.results[0].rng;
+        cluster->live_track = 0;
+    }
+
+    free(pids);
+    /* Killed shards can be left counted as waiting, which destroy would block on. */
+    if (!failed)
+        sched_barrier_destroy(shard.barrier);
+    munmap(shard.gather, cluster->arena_size);
+    munmap(shard.segment, shard.segment_size);
+    return failed;
+}
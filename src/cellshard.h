@@ -0,0 +1,132 @@
+/** @file
+ * Runs the synchronous stepper over several local processes, each owning a
+ * horizontal shard of the grid, for worlds too big for one process to keep fed
+ * from memory.
+ *
+ * Shards are whole runs of the stepper's SYNC_ROWS units, so a sharded run
+ * steps exactly like an unsharded SCHED_SYNC one and gives the same grid and
+ * counters. Each process is forked off the populated cluster and keeps the
+ * full size arenas, but only ever touches its own rows and the row either side
+ * of them, so the rest are never paged in. Neighbours are at most a row away
+ * whatever the topology, so each step a shard needs:
+ *  - the last row of the shard above and the first of the shard below, its
+ *    halo, as they were at the start of the step,
+ *  - the intents made by the units at the edges of those shards that land on
+ *    its rows, to resolve along with its own.
+ *
+ * These go thru one shared memory segment mapped before the fork, with a
+ * mailbox per shard holding its edge rows and the outgoing intents of its edge
+ * units. Each step is:
+ *  1. publish the edge rows, wait for every shard, copy in the halo,
+ *  2. run the shards units,
+ *  3. publish the edge units intents that land outside the shard, wait for
+ *     every shard, resolve the shards units with the neighbouring ones.
+ * A shard can only publish again once every other shard is past the wait that
+ * follows, by which time they have read what it published last, so two waits
+ * a step are all the locking there is. Rows and intents are sent as plain
+ * fixed size records, so another transport like sockets between hosts could
+ * carry the same messages in the same order.
+ *
+ * Callbacks run in every shard process with the shards copy of the cluster, so
+ * only ones that act on the tick alone, like ending the run, are any use.
+ * Afterwards the shards rows, counters, tick and generator are gathered back
+ * into the calling process.
+ */
+#ifndef _CELLSHARD_H
+#define _CELLSHARD_H
+
+#include "cellvm.h"
+#include "cellsched.h"
+
+/** A cell as its sent between shards, the same whatever the arena layout. */
+struct shard_cell {
+    unsigned long gen;
+    unsigned long energy;
+    char instructions[CSIZE];
+};
+
+/** What a shard leaves in the segment when its done. */
+struct shard_result {
+    /** Counters of its rows since the fork. */
+    struct cluster_stats stats;
+    /** Tick and generator it ended on, the same for every shard. */
+    unsigned long tick;
+    struct cell_rng rng;
+    /** Set once the rest has been filled in. */
+    int done;
+};
+
+/** A shard, and where it and the others are in the shared segment. */
+struct cell_shard {
+    /** Shard number and how many there are. */
+    int id, count;
+    /** First and one past the last unit of the stepper in the shard. */
+    int first, end;
+    /** Same for its rows and cells. */
+    int y0, y1;
+    size_t start, stop;
+    /** Grid width, units in the grid and rows per unit. */
+    int w, nunits;
+
+    /** The shared segment and its size. */
+    void *segment;
+    size_t segment_size;
+    /** Barrier every shard waits on twice a step. */
+    struct sched_barrier *barrier;
+    /** First and last rows of each shard, count * 2 * w cells. */
+    struct shard_cell *rows;
+    /** Outgoing intents of the first and last units of each shard, count * 2
+      * lists of cap intents, and how many are in each. */
+    struct sync_intent *intents;
+    size_t *nintents;
+    size_t cap;
+    /** Results of each shard. */
+    struct shard_result *results;
+    /** Arena the shards copy their rows into when done. */
+    void *gather;
+};
+
+/**
+ * Run the synchronous stepper over shards processes until cluster->sched_end is
+ * set in them, then gather the result back into the cluster.
+ * @param cluster Populated cluster to step.
+ * @param shards Number of processes, 2 up to the number of SYNC_ROWS units.
+ * @param threads Threads each process uses.
+ * @return 0 ok, 1 fail.
+ */
+int cluster_sched_sharded(struct cell_cluster *cluster, int shards, int threads);
+
+/**
+ * Publish a shards edge rows, wait for the other shards to, then copy the rows
+ * either side of it into the cluster.
+ * @param shard Shard being stepped.
+ * @param cluster The shards cluster, at the start of a step.
+ */
+void shard_rows(struct cell_shard *shard, struct cell_cluster *cluster);
+
+/**
+ * Publish the intents of one of a shards edge units that land outside it.
+ * @param shard Shard being stepped.
+ * @param side 0 for its first unit, 1 for its last.
+ * @param intents The units intents, in the order they were made.
+ * @param n Number of intents.
+ */
+void shard_send(struct cell_shard *shard, int side, const struct sync_intent *intents, size_t n);
+
+/**
+ * Wait for every shard to publish its intents.
+ * @param shard Shard being stepped.
+ */
+void shard_wait(struct cell_shard *shard);
+
+/**
+ * Get the intents published for a unit of another shard, valid until the next
+ * shard_rows().
+ * @param shard Shard being stepped.
+ * @param unit Edge unit of a neighbouring shard.
+ * @param n Returns the number of intents.
+ * @return The intents in the order they were made.
+ */
+struct sync_intent *shard_recv(struct cell_shard *shard, int unit, size_t *n);
+
+#endif
@@ -0,0 +1,410 @@
+/** @file
+ * Species census, see cellspecies.h.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cellspecies.h"
+
+#if CSIZE == 16 && defined(__AVX2__) && !defined(SPECIES_SCALAR)
+#include <immintrin.h>
+#define SPECIES_AVX2
+#define SPECIES_SSE2
+#define SPECIES_LANES 32
+#elif CSIZE == 16 && defined(__SSE2__) && !defined(SPECIES_SCALAR)
+#include <emmintrin.h>
+#define SPECIES_SSE2
+#define SPECIES_LANES 16
+#else
+/** Representatives per transposed block, 1 leaves them as plain genomes. */
+#define SPECIES_LANES 1
+#endif
+
+/** Smallest distinct genome hash table, a power of 2. */
+#define SPECIES_TABLE_MIN 1024
+
+const char *species_isa(void) {
+#if defined(SPECIES_AVX2)
+    return "avx2";
+#elif defined(SPECIES_SSE2)
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+#ifdef SPECIES_SSE2
+/**
+ * Distance from masks of the instructions that matched straight, shifted up
+ * and shifted down, the lane each shift left empty already set.
+ */
+static inline int mask_distance(unsigned int eq, unsigned int up, unsigned int down) {
+    int d = CSIZE - __builtin_popcount(eq);
+    int u = CSIZE + 1 - __builtin_popcount(up);
+    int w = CSIZE + 1 - __builtin_popcount(down);
+
+    if (u < d)
+        d = u;
+    return w < d ? w : d;
+}
+#endif
+
+int genome_hamming(const char a[CSIZE], const char b[CSIZE]) {
+#ifdef SPECIES_SSE2
+    __m128i va = _mm_loadu_si128((const __m128i *)a), vb = _mm_loadu_si128((const __m128i *)b);
+
+    return CSIZE - __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)));
+#else
+    int i, d;
+
+    for (d = 0, i = 0; i < CSIZE; i++)
+        d += a[i] != b[i];
+    return d;
+#endif
+}
+
+int genome_distance(const char a[CSIZE], const char b[CSIZE]) {
+#ifdef SPECIES_SSE2
+    __m128i va = _mm_loadu_si128((const __m128i *)a), vb = _mm_loadu_si128((const __m128i *)b);
+
+    return mask_distance(_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)),
+                         _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_slli_si128(va, 1), vb)) | 0x0001,
+                         _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_srli_si128(va, 1), vb)) | 0x8000);
+#else
+    int i, d, up, down;
+
+    /* Each shift starts at 1 for the shift and skips the lane it left empty. */
+    for (d = 0, up = down = 1, i = 0; i < CSIZE; i++) {
+        d += a[i] != b[i];
+        if (i > 0)
+            up += a[i - 1] != b[i];
+        if (i < CSIZE - 1)
+            down += a[i + 1] != b[i];
+    }
+    if (up < d)
+        d = up;
+    return down < d ? down : d;
+#endif
+}
+
+/**
+ * Store a species representative in its block.
+ * @param reps Representative blocks.
+ * @param s Species id.
+ * @param genome Representative genome.
+ */
+static void rep_set(unsigned char *reps, size_t s, const char genome[CSIZE]) {
+    unsigned char *rep = reps + s / SPECIES_LANES * CSIZE * SPECIES_LANES + s % SPECIES_LANES;
+    int i;
+
+    for (i = 0; i < CSIZE; i++)
+        rep[i * SPECIES_LANES] = genome[i];
+}
+
+/**
+ * Find the representative nearest a genome, the first one on a tie.
+ * @param reps Representative blocks.
+ * @param nreps Number of representatives, at least 1.
+ * @param genome Genome to look for.
+ * @param idx Where to store the index of the nearest.
+ * @return Its distance.
+ */
+static int nearest(const unsigned char *reps, size_t nreps, const char genome[CSIZE], size_t *idx) {
+#if defined(SPECIES_SSE2)
+    /* A shifted compare has one instruction less to match but costs 1 for the
+     * shift, so for both kinds the distance is CSIZE less the matches and the
+     * nearest representative is the one with the most. */
+    const unsigned char *block;
+    size_t b, nblocks = (nreps + SPECIES_LANES - 1) / SPECIES_LANES;
+    int i, m, best = -1;
+#if defined(SPECIES_AVX2)
+    __m256i a[CSIZE], r, eq, up, down, lane, valid;
+    __m128i h;
+
+    for (i = 0; i < CSIZE; i++)
+        a[i] = _mm256_set1_epi8(genome[i]);
+    lane = _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                            16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31);
+#else
+    __m128i a[CSIZE], r, eq, up, down, lane, valid, h;
+
+    for (i = 0; i < CSIZE; i++)
+        a[i] = _mm_set1_epi8(genome[i]);
+    lane = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+#endif
+
+    for (b = 0; b < nblocks; b++) {
+        block = reps + b * CSIZE * SPECIES_LANES;
+#if defined(SPECIES_AVX2)
+        eq = up = down = _mm256_setzero_si256();
+        /* cmpeq gives -1 per matching lane, subtracting counts them. */
+        for (i = 0; i < CSIZE; i++) {
+            r = _mm256_load_si256((const __m256i *)(block + i * SPECIES_LANES));
+            eq = _mm256_sub_epi8(eq, _mm256_cmpeq_epi8(r, a[i]));
+            if (i > 0)
+                up = _mm256_sub_epi8(up, _mm256_cmpeq_epi8(r, a[i - 1]));
+            if (i < CSIZE - 1)
+                down = _mm256_sub_epi8(down, _mm256_cmpeq_epi8(r, a[i + 1]));
+        }
+        eq = _mm256_max_epu8(eq, _mm256_max_epu8(up, down));
+        /* Lanes past the last representative match nothing. */
+        valid = _mm256_cmpgt_epi8(_mm256_set1_epi8(nreps - b * SPECIES_LANES < SPECIES_LANES ?
+                                                   (int)(nreps - b * SPECIES_LANES) : SPECIES_LANES), lane);
+        eq = _mm256_and_si256(eq, valid);
+        h = _mm_max_epu8(_mm256_castsi256_si128(eq), _mm256_extracti128_si256(eq, 1));
+#else
+        eq = up = down = _mm_setzero_si128();
+        for (i = 0; i < CSIZE; i++) {
+            r = _mm_load_si128((const __m128i *)(block + i * SPECIES_LANES));
+            eq = _mm_sub_epi8(eq, _mm_cmpeq_epi8(r, a[i]));
+            if (i > 0)
+                up = _mm_sub_epi8(up, _mm_cmpeq_epi8(r, a[i - 1]));
+            if (i < CSIZE - 1)
+                down = _mm_sub_epi8(down, _mm_cmpeq_epi8(r, a[i + 1]));
+        }
+        eq = _mm_max_epu8(eq, _mm_max_epu8(up, down));
+        valid = _mm_cmpgt_epi8(_mm_set1_epi8(nreps - b * SPECIES_LANES < SPECIES_LANES ?
+                                             (int)(nreps - b * SPECIES_LANES) : SPECIES_LANES), lane);
+        eq = _mm_and_si128(eq, valid);
+        h = eq;
+#endif
+        /* Fold the block down to its best lane. */
+        h = _mm_max_epu8(h, _mm_srli_si128(h, 8));
+        h = _mm_max_epu8(h, _mm_srli_si128(h, 4));
+        h = _mm_max_epu8(h, _mm_srli_si128(h, 2));
+        h = _mm_max_epu8(h, _mm_srli_si128(h, 1));
+        if ((m = _mm_cvtsi128_si32(h) & 0xff) > best) {
+            best = m;
+#if defined(SPECIES_AVX2)
+            *idx = b * SPECIES_LANES + __builtin_ctz(_mm256_movemask_epi8(_mm256_cmpeq_epi8(eq, _mm256_set1_epi8(m))));
+#else
+            *idx = b * SPECIES_LANES + __builtin_ctz(_mm_movemask_epi8(_mm_cmpeq_epi8(eq, _mm_set1_epi8(m))));
+#endif
+            /* Distinct genomes are never 0 apart, 1 cant be beaten. */
+            if (best >= CSIZE - 1)
+                break;
+        }
+    }
+    return CSIZE - best;
+#else
+    size_t j;
+    int d, best = CSIZE + 1;
+
+    for (j = 0; j < nreps; j++) {
+        if ((d = genome_distance(genome, (const char *)reps + j * CSIZE)) < best) {
+            best = d;
+            *idx = j;
+            if (best <= 1)
+                break;
+        }
+    }
+    return best;
+#endif
+}
+
+void species_init(struct species_census *census, int threshold, size_t max) {
+    size_t size;
+
+    memset(census, '\0', sizeof *census);
+    census->threshold = threshold;
+    census->max = max ? max : 1;
+    /* Whole blocks aligned for the vector loads. */
+    size = (census->max + SPECIES_LANES - 1) / SPECIES_LANES * CSIZE * SPECIES_LANES;
+    if (posix_memalign((void **)&census->reps, 32, size))
+        exit(1);
+    memset(census->reps, '\0', size);
+    if (!(census->species = malloc(census->max * sizeof *census->species)) ||
+        !(census->made = malloc(census->max * sizeof *census->made)) ||
+        !(census->species_ranks = malloc(census->max * sizeof *census->species_ranks)) ||
+        !(census->species_map = malloc(census->max * sizeof *census->species_map)))
+        exit(1);
+}
+
+void species_free(struct species_census *census) {
+    free(census->species);
+    free(census->ids);
+    free(census->genomes);
+    free(census->table);
+    free(census->ranks);
+    free(census->reps);
+    free(census->made);
+    free(census->species_ranks);
+    free(census->species_map);
+    memset(census, '\0', sizeof *census);
+}
+
+/**
+ * Hash a genome, the same multiply and xor as the translation cache.
+ */
+static inline uint64_t genome_hash(const uint64_t key[CSIZE / 8]) {
+    uint64_t hash;
+    int i;
+
+    for (hash = 0, i = 0; i < CSIZE / 8; i++)
+        hash = (hash ^ key[i]) * 0x9e3779b97f4a7c15ULL;
+    return hash ^ (hash >> 29);
+}
+
+/**
+ * Put a genome's index in the hash table, which must have room.
+ */
+static void table_insert(struct species_census *census, uint32_t g) {
+    size_t slot, mask = census->table_size - 1;
+
+    for (slot = genome_hash(census->genomes[g].key) & mask; census->table[slot]; slot = (slot + 1) & mask)
+        ;
+    census->table[slot] = g + 1;
+}
+
+/**
+ * Find a genome, adding it with a count of 0 if its new.
+ * @return Its index in genomes.
+ */
+static uint32_t genome_add(struct species_census *census, const uint64_t key[CSIZE / 8]) {
+    struct species_genome *g;
+    size_t slot, mask = census->table_size - 1, i;
+    uint32_t idx;
+
+    for (slot = genome_hash(key) & mask; (idx = census->table[slot]); slot = (slot + 1) & mask) {
+        g = &census->genomes[idx - 1];
+        if (!memcmp(g->key, key, CSIZE))
+            return idx - 1;
+    }
+
+    if (census->ngenomes == census->genomes_size) {
+        census->genomes_size *= 2;
+        if (!(census->genomes = realloc(census->genomes, census->genomes_size * sizeof *census->genomes)) ||
+            !(census->ranks = realloc(census->ranks, census->genomes_size * sizeof *census->ranks)))
+            exit(1);
+    }
+    g = &census->genomes[census->ngenomes];
+    memcpy(g->key, key, CSIZE);
+    g->count = 0;
+    census->table[slot] = ++census->ngenomes;
+
+    /* Keep the table at most half full so probes stay short. */
+    if (census->ngenomes * 2 > census->table_size) {
+        census->table_size *= 2;
+        free(census->table);
+        if (!(census->table = calloc(census->table_size, sizeof *census->table)))
+            exit(1);
+        for (i = 0; i < census->ngenomes; i++)
+            table_insert(census, i);
+    }
+    return census->ngenomes - 1;
+}
+
+/**
+ * Order ranks biggest count first, then by index so ties always come out the same.
+ */
+static int rank_compare(const void *a, const void *b) {
+    const struct species_rank *ra = a, *rb = b;
+
+    if (ra->count != rb->count)
+        return ra->count < rb->count ? 1 : -1;
+    return ra->index < rb->index ? -1 : ra->index > rb->index;
+}
+
+size_t species_take(struct species_census *census, const struct cell_cluster *cluster) {
+    struct species_genome *g;
+    struct species *sp;
+    uint64_t key[CSIZE / 8];
+    size_t i, s = 0;
+    int d;
+
+    /* Tables only grow, a census is usually taken every so often on the same grid. */
+    if (census->area != cluster->area) {
+        free(census->ids);
+        if (!(census->ids = malloc(cluster->area * sizeof *census->ids)))
+            exit(1);
+        census->area = cluster->area;
+    }
+    if (!census->table) {
+        census->table_size = SPECIES_TABLE_MIN;
+        census->genomes_size = SPECIES_TABLE_MIN / 2;
+        if (!(census->table = malloc(census->table_size * sizeof *census->table)) ||
+            !(census->genomes = malloc(census->genomes_size * sizeof *census->genomes)) ||
+            !(census->ranks = malloc(census->genomes_size * sizeof *census->ranks)))
+            exit(1);
+    }
+    memset(census->table, '\0', census->table_size * sizeof *census->table);
+    census->ngenomes = census->nspecies = 0;
+    census->live = 0;
+    census->tick = cluster->tick;
+
+    /* Count the distinct genomes, ids hold each cells genome index for now. */
+    for (i = 0; i < cluster->area; i++) {
+        if (!cell_gen(cluster, i)) {
+            census->ids[i] = SPECIES_NONE;
+            continue;
+        }
+        cell_genome(cluster, i, (char *)key);
+        census->ids[i] = genome_add(census, key);
+        census->genomes[census->ids[i]].count++;
+        census->live++;
+    }
+
+    /* Most common genomes first, so they become the representatives. */
+    for (i = 0; i < census->ngenomes; i++) {
+        census->ranks[i].count = census->genomes[i].count;
+        census->ranks[i].index = i;
+    }
+    qsort(census->ranks, census->ngenomes, sizeof *census->ranks, rank_compare);
+
+    for (i = 0; i < census->ngenomes; i++) {
+        g = &census->genomes[census->ranks[i].index];
+        d = census->nspecies ? nearest(census->reps, census->nspecies, (const char *)g->key, &s) : CSIZE + 1;
+        if (d > census->threshold && census->nspecies < census->max) {
+            s = census->nspecies++;
+            rep_set(census->reps, s, (const char *)g->key);
+            sp = &census->made[s];
+            memcpy(sp->genome, g->key, CSIZE);
+            sp->count = sp->genomes = 0;
+        }
+        g->species = s;
+        census->made[s].count += g->count;
+        census->made[s].genomes++;
+    }
+
+    /* Species were made in order of their representatives, put them in order
+     * of their size and renumber the cells to match. */
+    for (s = 0; s < census->nspecies; s++) {
+        census->species_ranks[s].count = census->made[s].count;
+        census->species_ranks[s].index = s;
+    }
+    qsort(census->species_ranks, census->nspecies, sizeof *census->species_ranks, rank_compare);
+    for (s = 0; s < census->nspecies; s++) {
+        census->species[s] = census->made[census->species_ranks[s].index];
+        census->species_map[census->species_ranks[s].index] = s;
+    }
+    for (i = 0; i < census->ngenomes; i++)
+        census->genomes[i].species = census->species_map[census->genomes[i].species];
+    for (i = 0; i < cluster->area; i++)
+        if (census->ids[i] != SPECIES_NONE)
+            census->ids[i] = census->genomes[census->ids[i]].species;
+    return census->nspecies;
+}
+
+void species_dump(const struct species_census *census, FILE *file, size_t limit) {
+    const struct species *sp;
+    size_t s, len;
+    int i;
+
+    fprintf(file, "species: tick:%lu live:%lu genomes:%zu species:%zu\n",
+            census->tick, census->live, census->ngenomes, census->nspecies);
+    for (s = 0; s < census->nspecies && (!limit || s < limit); s++) {
+        sp = &census->species[s];
+        /* Trailing NOOPs are left off like the test genomes. */
+        for (len = CSIZE; len > 0 && sp->genome[len - 1] == NOOP; len--)
+            ;
+        fprintf(file, "%zu cells:%lu genomes:%lu genome:", s, sp->count, sp->genomes);
+        for (i = 0; i < (int)len; i++) {
+            if (sp->genome[i] >= 0 && sp->genome[i] < IEND)
+                fprintf(file, i ? ",%s" : "%s", instrlookup[(int)sp->genome[i]]);
+            else
+                fprintf(file, i ? ",0x%02x" : "0x%02x", (unsigned char)sp->genome[i]);
+        }
+        fprintf(file, "\n");
+    }
+}
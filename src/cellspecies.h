@@ -0,0 +1,155 @@
+/** @file
+ * Species census, groups every live genome in the grid into species of
+ * genomes a few instructions apart.
+ *
+ * A census first counts the distinct genomes with a hash table, then goes
+ * through them most common first. Each one joins the species with the nearest
+ * representative if its within the threshold, otherwise it starts a new
+ * species and is its representative. Once the species cap is hit everything
+ * left joins its nearest species whatever the distance, so a census costs at
+ * most distinct genomes * cap distances on top of one pass over the grid.
+ *
+ * Distances are between whole genomes. A genome is exactly CSIZE (16) bytes,
+ * one SSE2 register, so comparing a pair is a compare and a popcount. Finding
+ * the nearest representative is the hot loop, so representatives are kept
+ * transposed in blocks of 16 (32 with AVX2), a register per instruction
+ * holding that instruction of every genome in the block. Each instruction of
+ * the genome being placed is then compared against a whole block at once and
+ * the matches summed per lane, giving the distance to 16 or 32 representatives
+ * in a few dozen instructions with no popcounts. The vector code is picked at
+ * compile time from the -m flags, builds without SSE2 or with a different
+ * CSIZE use the plain C versions and get the same answers. Defining
+ * SPECIES_SCALAR forces the plain versions too, make check builds a headless
+ * that way to hold the vector censuses to the same answers.
+ */
+#ifndef _CELLSPECIES_H
+#define _CELLSPECIES_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "cellvm.h"
+
+/** Default distance a genome can be from a species representative and join it. */
+#define SPECIES_THRESHOLD 2
+/** Default most species a census will make. */
+#define SPECIES_MAX 256
+/** Species id of an empty cell. */
+#define SPECIES_NONE UINT32_MAX
+
+/** A species found by a census. */
+struct species {
+    /** Representative genome, the most common one in the species. */
+    char genome[CSIZE];
+    /** Live cells in the species. */
+    unsigned long count;
+    /** Distinct genomes in the species. */
+    unsigned long genomes;
+};
+
+/** A distinct genome and how many cells have it. */
+struct species_genome {
+    /** The genome as words, for hashing and comparing. */
+    uint64_t key[CSIZE / 8];
+    /** Cells with it. */
+    unsigned long count;
+    /** Species it was put in. */
+    uint32_t species;
+};
+
+/** Distinct genome index and count, for putting them in order. */
+struct species_rank {
+    unsigned long count;
+    uint32_t index;
+};
+
+/** Census results, and the tables reused between censuses. */
+struct species_census {
+    /** Distance threshold and species cap, see species_init(). */
+    int threshold;
+    size_t max;
+    /** Tick the census was taken on. */
+    unsigned long tick;
+    /** Live cells and distinct genomes counted. */
+    unsigned long live;
+    size_t ngenomes;
+    /** Species found, biggest first, their index is their id. */
+    struct species *species;
+    size_t nspecies;
+    /** Species id of each cell, SPECIES_NONE for empty ones. */
+    uint32_t *ids;
+    size_t area;
+
+    /** Distinct genomes, the hash table of 1 + their index, and their order. */
+    struct species_genome *genomes;
+    size_t genomes_size;
+    uint32_t *table;
+    size_t table_size;
+    struct species_rank *ranks;
+    /** Species representatives transposed into blocks for the vector compares. */
+    unsigned char *reps;
+    /** Species in the order they were made, their size order and what each
+      * id became once they were sorted. */
+    struct species *made;
+    struct species_rank *species_ranks;
+    uint32_t *species_map;
+};
+
+/**
+ * Set up an empty census.
+ * @param census Census to set up.
+ * @param threshold Distance a genome can be from a representative and join its species.
+ * @param max Most species to make, at least 1.
+ */
+void species_init(struct species_census *census, int threshold, size_t max);
+
+/**
+ * Free a census.
+ * @param census Census to free.
+ */
+void species_free(struct species_census *census);
+
+/**
+ * Take a census of a cluster, replacing any previous results.
+ * @param census Census to fill in.
+ * @param cluster Cluster to count.
+ * @return Number of species found.
+ */
+size_t species_take(struct species_census *census, const struct cell_cluster *cluster);
+
+/**
+ * Print a census, a summary line then one line per species with its id,
+ * cells, distinct genomes and representative genome.
+ * @param census Census to print.
+ * @param file File to print to.
+ * @param limit Most species to print, 0 for all.
+ */
+void species_dump(const struct species_census *census, FILE *file, size_t limit);
+
+/**
+ * Count the instructions that differ between two genomes.
+ * @param a First genome.
+ * @param b Second genome.
+ * @return 0 to CSIZE.
+ */
+int genome_hamming(const char a[CSIZE], const char b[CSIZE]);
+
+/**
+ * Distance between two genomes, the hamming distance or one plus the distance
+ * with one of them shifted along an instruction either way, whichever is less.
+ * So a genome with an instruction pushed in or dropped at the front counts as
+ * close to the original rather than nothing like it. The instruction shifted
+ * out of the end is not counted.
+ * @param a First genome.
+ * @param b Second genome.
+ * @return 0 to CSIZE.
+ */
+int genome_distance(const char a[CSIZE], const char b[CSIZE]);
+
+/**
+ * Name of the vector instructions the distances were built with.
+ * @return "avx2", "sse2" or "scalar".
+ */
+const char *species_isa(void);
+
+#endif
@@ -0,0 +1,120 @@
+/** @file
+ * Periodic export of a clusters stats, see cellstats.h.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cellstats.h"
+
+/** Counter names in export order, keep in step with stats_write(). */
+static const char *counter_names[] = {
+    "births", "energy_deaths", "crch_deaths", "kill_deaths",
+    "shar_energy", "mutations", "instructions"
+};
+
+int stats_open(struct stats_export *exp, const char *path, int format) {
+    size_t i;
+
+    memset(exp, '\0', sizeof *exp);
+    if (!(exp->file = fopen(path, "w")))
+        return 1;
+    exp->format = format;
+    exp->last_tick = -1;
+
+    if (format == STATS_CSV) {
+        fprintf(exp->file, "tick,live");
+        for (i = 0; i < sizeof counter_names / sizeof *counter_names; i++)
+            fprintf(exp->file, ",%s", counter_names[i]);
+        for (i = 0; i < STATS_GEN_BUCKETS; i++)
+            fprintf(exp->file, ",gen%lu", 1UL << i);
+        fprintf(exp->file, "\n");
+    }
+    return 0;
+}
+
+int stats_format(const char *path) {
+    const char *ext = strrchr(path, '.');
+
+    if (ext && (!strcmp(ext, ".json") || !strcmp(ext, ".jsonl")))
+        return STATS_JSONL;
+    return STATS_CSV;
+}
+
+/**
+ * Histogram bucket of a generation, its log2 capped at the last bucket.
+ */
+static int gen_bucket(unsigned long gen) {
+    int b = 0;
+
+    while (gen >>= 1)
+        b++;
+    return b < STATS_GEN_BUCKETS ? b : STATS_GEN_BUCKETS - 1;
+}
+
+void stats_write(struct stats_export *exp, const struct cell_cluster *cluster) {
+    unsigned long hist[STATS_GEN_BUCKETS] = { 0 }, live, gen;
+    unsigned long counters[sizeof counter_names / sizeof *counter_names];
+    size_t i, ncounters = sizeof counter_names / sizeof *counter_names;
+
+    /* One pass over the grid gets the population and histogram, a row every
+     * million or so ticks makes it a rounding error. */
+    for (live = 0, i = 0; i < cluster->area; i++) {
+        if ((gen = cell_gen(cluster, i))) {
+            live++;
+            hist[gen_bucket(gen)]++;
+        }
+    }
+
+    counters[0] = cluster->stats.spor_copies;
+    counters[1] = cluster->stats.energy_death;
+    counters[2] = cluster->stats.crch_deaths;
+    counters[3] = cluster->stats.kill_deaths;
+    counters[4] = cluster->stats.shar_energy;
+    counters[5] = cluster->stats.mutations;
+    counters[6] = cluster->stats.instructions;
+
+    if (exp->format == STATS_JSONL) {
+        fprintf(exp->file, "{\"tick\":%lu,\"live\":%lu", cluster->tick, live);
+        for (i = 0; i < ncounters; i++)
+            fprintf(exp->file, ",\"%s\":%lu", counter_names[i], counters[i]);
+        fprintf(exp->file, ",\"gen_hist\":[");
+        for (i = 0; i < STATS_GEN_BUCKETS; i++)
+            fprintf(exp->file, i ? ",%lu" : "%lu", hist[i]);
+        fprintf(exp->file, "]}\n");
+    } else {
+        fprintf(exp->file, "%lu,%lu", cluster->tick, live);
+        for (i = 0; i < ncounters; i++)
+            fprintf(exp->file, ",%lu", counters[i]);
+        for (i = 0; i < STATS_GEN_BUCKETS; i++)
+            fprintf(exp->file, ",%lu", hist[i]);
+        fprintf(exp->file, "\n");
+    }
+    exp->last_tick = cluster->tick;
+    exp->rows++;
+}
+
+/**
+ * Write a row, ran as a callback.
+ */
+static void callback_stats(void *userdata, int x, int y, char didstuff) {
+    struct stats_export *exp = userdata;
+
+    stats_write(exp, exp->cluster);
+}
+
+int stats_attach(struct stats_export *exp, struct cell_cluster *cluster, unsigned long every) {
+    exp->cluster = cluster;
+    return add_callback(&cluster->callbacks, callback_stats, every, exp, "STATS");
+}
+
+int stats_close(struct stats_export *exp, const struct cell_cluster *cluster) {
+    int error;
+
+    if (cluster && cluster->tick != exp->last_tick)
+        stats_write(exp, cluster);
+    error = ferror(exp->file) != 0;
+    if (fclose(exp->file))
+        error = 1;
+    return error;
+}
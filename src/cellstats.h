@@ -0,0 +1,87 @@
+/** @file
+ * Periodic export of a clusters stats, for population curves of long runs.
+ *
+ * The counters themselves live in cluster_stats and are bumped by the VM
+ * through the execution context, so each scheduler thread counts into its own
+ * copy with plain increments and the copies are summed after each round.
+ * Leaving them on costs next to nothing.
+ *
+ * An export writes a row every so many ticks with the running counters, the
+ * live population and a histogram of the generations alive. Generations are
+ * bucketed by powers of two, bucket 0 is gen 1, bucket 1 gens 2-3, bucket 2
+ * gens 4-7 and so on, the last bucket takes everything above. Rows are CSV
+ * with a header line or one JSON object per line.
+ */
+#ifndef _CELLSTATS_H
+#define _CELLSTATS_H
+
+#include <stdio.h>
+
+#include "cellvm.h"
+
+/** Generation histogram buckets. */
+#define STATS_GEN_BUCKETS 24
+
+/** Row formats. */
+enum STATS_FORMATS {
+    /** Comma separated with a header line. */
+    STATS_CSV,
+    /** A JSON object per line. */
+    STATS_JSONL
+};
+
+/** Export being written. */
+struct stats_export {
+    /** File being written. */
+    FILE *file;
+    /** One of STATS_FORMATS. */
+    int format;
+    /** Tick of the last row, so the final one isnt written twice. */
+    unsigned long last_tick;
+    /** Rows written. */
+    unsigned long rows;
+    /** Cluster stats_attach() exports. */
+    const struct cell_cluster *cluster;
+};
+
+/**
+ * Create an export file.
+ * @param exp Export to set up.
+ * @param path File to write.
+ * @param format One of STATS_FORMATS.
+ * @return 0 ok, 1 fail.
+ */
+int stats_open(struct stats_export *exp, const char *path, int format);
+
+/**
+ * Pick a format from a file name, .json and .jsonl are JSON lines and the rest CSV.
+ * @param path File name.
+ * @return One of STATS_FORMATS.
+ */
+int stats_format(const char *path);
+
+/**
+ * Write a row for a cluster as it is now.
+ * @param exp Export to write to.
+ * @param cluster Cluster to describe.
+ */
+void stats_write(struct stats_export *exp, const struct cell_cluster *cluster);
+
+/**
+ * Write a row every so many ticks while the cluster runs.
+ * @param exp Export to write to, it must outlive the callback.
+ * @param cluster Cluster to export.
+ * @param every Ticks between rows.
+ * @return Callback slot, -1 on fail.
+ */
+int stats_attach(struct stats_export *exp, struct cell_cluster *cluster, unsigned long every);
+
+/**
+ * Write a last row unless one was just written for this tick, then close the file.
+ * @param exp Export to close.
+ * @param cluster Cluster to describe in the last row, NULL for none.
+ * @return 0 ok, 1 if anything failed to write.
+ */
+int stats_close(struct stats_export *exp, const struct cell_cluster *cluster);
+
+#endif
@@ -0,0 +1,213 @@
+/** @file
+ * Compact binary trace of everything that changes the grid, see celltrace.h.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "celltrace.h"
+
+/** Magic at the start of every trace. */
+static const char trace_magic[8] = "SGTRACE";
+
+/**
+ * Writer thread, writes each buffer handed over by trace_flush().
+ * @param arg The cell_trace.
+ */
+static void *trace_writer(void *arg) {
+    struct cell_trace *trace = arg;
+
+    pthread_mutex_lock(&trace->lock);
+    for (;;) {
+        while (!trace->outlen && !trace->quit)
+            pthread_cond_wait(&trace->cond, &trace->lock);
+        if (!trace->outlen)
+            break;
+
+        /* The buffer is ours till outlen goes back to 0, dont hold the lock over the write. */
+        pthread_mutex_unlock(&trace->lock);
+        if (fwrite(trace->out, 1, trace->outlen, trace->file) != trace->outlen)
+            trace->error = 1;
+        pthread_mutex_lock(&trace->lock);
+        trace->outlen = 0;
+        pthread_cond_broadcast(&trace->cond);
+    }
+    pthread_mutex_unlock(&trace->lock);
+    return NULL;
+}
+
+int trace_open(struct cell_trace *trace, const char *path, const struct cell_cluster *cluster) {
+    struct trace_header header;
+
+    memset(trace, '\0', sizeof *trace);
+    if (!(trace->file = fopen(path, "wb")))
+        return 1;
+    if (!(trace->buf = malloc(TRACE_BUF)) || !(trace->out = malloc(TRACE_BUF)))
+        exit(1);
+
+    memset(&header, '\0', sizeof header);
+    memcpy(header.magic, trace_magic, sizeof header.magic);
+    header.version = TRACE_VERSION;
+    header.csize = CSIZE;
+    header.w = cluster->w;
+    header.h = cluster->h;
+    header.start_tick = cluster->tick;
+    trace->tick = cluster->tick;
+
+    pthread_mutex_init(&trace->lock, NULL);
+    pthread_cond_init(&trace->cond, NULL);
+    if (fwrite(&header, sizeof header, 1, trace->file) != 1 ||
+        pthread_create(&trace->writer, NULL, trace_writer, trace)) {
+        fclose(trace->file);
+        free(trace->buf);
+        free(trace->out);
+        return 1;
+    }
+    return 0;
+}
+
+void trace_flush(struct cell_trace *trace) {
+    unsigned char *tmp;
+
+    pthread_mutex_lock(&trace->lock);
+    while (trace->outlen)
+        pthread_cond_wait(&trace->cond, &trace->lock);
+
+    /* Swap buffers, the writer gets the full one. */
+    tmp = trace->out;
+    trace->out = trace->buf;
+    trace->outlen = trace->len;
+    trace->buf = tmp;
+    trace->len = 0;
+    pthread_cond_broadcast(&trace->cond);
+    pthread_mutex_unlock(&trace->lock);
+}
+
+int trace_close(struct cell_trace *trace) {
+    int error;
+
+    if (trace->len)
+        trace_flush(trace);
+
+    pthread_mutex_lock(&trace->lock);
+    trace->quit = 1;
+    pthread_cond_broadcast(&trace->cond);
+    pthread_mutex_unlock(&trace->lock);
+    pthread_join(trace->writer, NULL);
+
+    error = trace->error;
+    if (fclose(trace->file))
+        error = 1;
+    pthread_mutex_destroy(&trace->lock);
+    pthread_cond_destroy(&trace->cond);
+    free(trace->buf);
+    free(trace->out);
+    return error;
+}
+
+int trace_reader_open(struct trace_reader *reader, const char *path) {
+    memset(reader, '\0', sizeof *reader);
+    if (!(reader->file = fopen(path, "rb")))
+        return 1;
+    if (fread(&reader->header, sizeof reader->header, 1, reader->file) != 1 ||
+        memcmp(reader->header.magic, trace_magic, sizeof trace_magic) ||
+        reader->header.version != TRACE_VERSION || reader->header.csize != CSIZE) {
+        fclose(reader->file);
+        return 1;
+    }
+    reader->tick = reader->header.start_tick;
+    return 0;
+}
+
+void trace_reader_close(struct trace_reader *reader) {
+    fclose(reader->file);
+}
+
+/**
+ * Read a varint.
+ * @param file File to read from.
+ * @param v Where to store the value.
+ * @return 1 if one was read, 0 at the end of the file, -1 if its cut short or too long.
+ */
+static int read_varint(FILE *file, uint64_t *v) {
+    int c, shift;
+
+    *v = 0;
+    for (shift = 0; shift < 64; shift += 7) {
+        if ((c = getc(file)) == EOF)
+            return shift ? -1 : 0;
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return 1;
+    }
+    return -1;
+}
+
+int trace_read(struct trace_reader *reader, struct trace_record *rec) {
+    uint64_t v;
+    int ret, c;
+
+    if ((ret = read_varint(reader->file, &v)) <= 0)
+        return ret;
+    reader->tick += v;
+    rec->tick = reader->tick;
+
+    if ((c = getc(reader->file)) == EOF)
+        return -1;
+    rec->kind = c & 0xf;
+    rec->dir = (c >> 4) & 0x7;
+    if (rec->kind >= TRACE_EVENTS_MAX)
+        return -1;
+
+    if (read_varint(reader->file, &v) != 1)
+        return -1;
+    rec->cell = v;
+
+    rec->value = 0;
+    if (TRACE_VALUED & (1 << rec->kind)) {
+        if (read_varint(reader->file, &v) != 1)
+            return -1;
+        rec->value = v;
+    }
+    return 1;
+}
+
+int trace_apply(struct cell_cluster *cluster, const struct trace_record *rec) {
+    size_t parent;
+    int x, y, px, py, pos;
+
+    if (rec->cell >= cluster->area || rec->dir >= cluster->ndirs)
+        return 1;
+
+    switch (rec->kind) {
+    case TRACE_RUN:
+        cell_set_energy(cluster, rec->cell, rec->value);
+        break;
+    case TRACE_SPOR:
+        /* The parent is back the way the spore went. */
+        cell_coords(cluster, rec->cell, &x, &y);
+        get_neighbour_coords(cluster, x, y, cluster->opposite[rec->dir], &px, &py);
+        parent = cell_index(cluster, px, py);
+        cell_copy(cluster, rec->cell, parent);
+        cell_set_gen(cluster, rec->cell, cell_gen(cluster, parent) + 1);
+        cell_set_energy(cluster, rec->cell, rec->value);
+        break;
+    case TRACE_CRCH:
+    case TRACE_KILL:
+    case TRACE_REAP:
+        cell_clear(cluster, rec->cell);
+        break;
+    case TRACE_SHAR:
+        cell_set_energy(cluster, rec->cell, cell_energy(cluster, rec->cell) + rec->value);
+        break;
+    case TRACE_MUT:
+        if ((pos = rec->value >> 8) >= CSIZE)
+            return 1;
+        cell_set_inst(cluster, rec->cell, pos, (char)(rec->value & 0xff));
+        break;
+    default:
+        return 1;
+    }
+    cluster->tick = rec->tick;
+    return 0;
+}
@@ -0,0 +1,229 @@
+/** @file
+ * Compact binary trace of everything that changes the grid, for analysing runs
+ * offline and replaying them onto a checkpoint.
+ *
+ * A trace is a trace_header followed by one record per event:
+ *   varint  ticks since the last record
+ *   byte    event kind in the low 4 bits, direction in the next 3
+ *   varint  index of the cell the event changed
+ *   varint  value, only for kinds with one (see TRACE_VALUED)
+ * Varints are 7 bits per byte low bits first, the top bit set on all but the
+ * last byte. Most records come out at 4-6 bytes.
+ *
+ * Records are built in a buffer by the simulation thread and handed over to a
+ * writer thread when its full, so the simulation only ever waits on the disk if
+ * it gets a whole buffer ahead. Events are recorded from contexts with a trace
+ * attached, the tiled scheduler never attaches one so only single threaded runs
+ * can be traced.
+ */
+#ifndef _CELLTRACE_H
+#define _CELLTRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "cellvm.h"
+
+/** Trace file format version, bump when the records change. */
+#define TRACE_VERSION 1
+
+/** Size of each of the two record buffers. */
+#define TRACE_BUF (1 << 20)
+/** Most bytes one record can take. */
+#define TRACE_MAXREC 32
+
+/** Kinds of traced event. */
+enum TRACE_EVENTS {
+    /** A cell ran, value is the energy it was left with. */
+    TRACE_RUN,
+    /** A cell was spored from the neighbour in the opposite direction, value is
+      * the childs energy. */
+    TRACE_SPOR,
+    /** A cell was eaten by a CRCH. */
+    TRACE_CRCH,
+    /** A cell was killed by a KILL. */
+    TRACE_KILL,
+    /** A cell was shared with by a SHAR, value is the energy it was given. */
+    TRACE_SHAR,
+    /** A cell was reaped for running out of energy. */
+    TRACE_REAP,
+    /** An instruction of a cell was mutated, value is the position << 8 then the
+      * new instruction. */
+    TRACE_MUT,
+
+    /** Number of event kinds, keep it at the end. */
+    TRACE_EVENTS_MAX
+};
+
+/** Event kinds that are followed by a value. */
+#define TRACE_VALUED ((1 << TRACE_RUN) | (1 << TRACE_SPOR) | (1 << TRACE_SHAR) | (1 << TRACE_MUT))
+
+/** Header at the start of a trace file. */
+struct trace_header {
+    /** "SGTRACE" and a NUL. */
+    char magic[8];
+    /** TRACE_VERSION the file was written as. */
+    uint32_t version;
+    /** CSIZE of the writer. */
+    uint32_t csize;
+    /** Grid size. */
+    uint64_t w, h;
+    /** Cluster tick when tracing started, the tick of the checkpoint to replay onto. */
+    uint64_t start_tick;
+};
+
+/** Trace being written. */
+struct cell_trace {
+    /** File being written by the writer thread. */
+    FILE *file;
+    /** Buffer records are being added to, and how much of it is used. */
+    unsigned char *buf;
+    size_t len;
+    /** Buffer the writer thread owns, and how much of it is still to write, 0 once written. */
+    unsigned char *out;
+    size_t outlen;
+    /** Tick of the last record. */
+    unsigned long tick;
+    /** Records written. */
+    unsigned long events;
+    /** Writer thread. */
+    pthread_t writer;
+    /** Guards out, outlen, quit and error. */
+    pthread_mutex_t lock;
+    /** Signalled whenever out is handed over or written. */
+    pthread_cond_t cond;
+    /** Set to tell the writer to finish up. */
+    char quit;
+    /** Set if a write failed. */
+    char error;
+};
+
+/** A record read back from a trace. */
+struct trace_record {
+    /** Tick of the event. */
+    unsigned long tick;
+    /** One of TRACE_EVENTS. */
+    int kind;
+    /** Direction from the cell that caused the event to the one it changed. */
+    int dir;
+    /** Index of the cell the event changed. */
+    size_t cell;
+    /** Value of the event, 0 if the kind has none. */
+    unsigned long value;
+};
+
+/** Trace being read. */
+struct trace_reader {
+    /** File being read. */
+    FILE *file;
+    /** Header of the trace. */
+    struct trace_header header;
+    /** Tick of the last record read. */
+    unsigned long tick;
+};
+
+#ifdef CELL_TRACE
+/** Record an event if the context has a trace attached, see trace_event(). */
+#define TRACE_EVENT(ctx, tick, kind, cell, dir, value) \
+    do { if ((ctx)->trace) trace_event((ctx)->trace, tick, kind, cell, dir, value); } while (0)
+#else
+#define TRACE_EVENT(ctx, tick, kind, cell, dir, value) do { } while (0)
+#endif
+
+/**
+ * Create a trace file and start its writer thread.
+ * @param trace Trace to set up.
+ * @param path File to write.
+ * @param cluster Cluster that will be traced, as it is now.
+ * @return 0 ok, 1 fail.
+ */
+int trace_open(struct cell_trace *trace, const char *path, const struct cell_cluster *cluster);
+
+/**
+ * Write out any buffered records, stop the writer and close the file.
+ * @param trace Trace to close.
+ * @return 0 ok, 1 if anything failed to write.
+ */
+int trace_close(struct cell_trace *trace);
+
+/**
+ * Hand the filled buffer over to the writer thread, waiting for it to finish
+ * the last one first if need be.
+ * @param trace Trace to flush.
+ */
+void trace_flush(struct cell_trace *trace);
+
+/**
+ * Append a varint to a buffer.
+ * @param p Where to write.
+ * @param v Value to write.
+ * @return Pointer past the varint.
+ */
+static inline unsigned char *trace_varint(unsigned char *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = v | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+/**
+ * Record an event, use TRACE_EVENT() in the VM so its compiled out without CELL_TRACE.
+ * @param trace Trace to record to.
+ * @param tick Tick the event happened on.
+ * @param kind One of TRACE_EVENTS.
+ * @param cell Index of the cell the event changed.
+ * @param dir Direction from the cell that caused the event, 0 if it doesnt matter.
+ * @param value Value of the event, ignored if the kind has none.
+ */
+static inline void trace_event(struct cell_trace *trace, unsigned long tick, int kind,
+                               size_t cell, int dir, unsigned long value) {
+    unsigned char *p;
+
+    if (trace->len > TRACE_BUF - TRACE_MAXREC)
+        trace_flush(trace);
+
+    p = trace_varint(trace->buf + trace->len, tick - trace->tick);
+    *p++ = kind | (dir << 4);
+    p = trace_varint(p, cell);
+    if (TRACE_VALUED & (1 << kind))
+        p = trace_varint(p, value);
+
+    trace->tick = tick;
+    trace->len = p - trace->buf;
+    trace->events++;
+}
+
+/**
+ * Open a trace for reading.
+ * @param reader Reader to set up.
+ * @param path File to read.
+ * @return 0 ok, 1 if it cant be read or isnt a trace this build can read.
+ */
+int trace_reader_open(struct trace_reader *reader, const char *path);
+
+/**
+ * Close a trace opened with trace_reader_open().
+ * @param reader Reader to close.
+ */
+void trace_reader_close(struct trace_reader *reader);
+
+/**
+ * Read the next record of a trace.
+ * @param reader Trace to read from.
+ * @param rec Where to store the record.
+ * @return 1 if a record was read, 0 at the end of the trace, -1 if its corrupt.
+ */
+int trace_read(struct trace_reader *reader, struct trace_record *rec);
+
+/**
+ * Apply a record to a cluster, redoing what the event did to the grid.
+ * @param cluster Cluster to change, restored from the checkpoint the trace started at.
+ * @param rec Record to apply.
+ * @return 0 ok, 1 if the record doesnt make sense for the cluster.
+ */
+int trace_apply(struct cell_cluster *cluster, const struct trace_record *rec);
+
+#endif
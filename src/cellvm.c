@@ -5,326 +5,1013 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "cellvm.h"
+#include "cellsched.h"
+#include "cellxlat.h"
+#include "celltrace.h"
+#include "cellprof.h"
 
-#ifdef DEBUG
 /** Lookup table (instruction -> string) for debugging purposes.
   * Note: do not let get out of order or wrong results will be printed */
-const static char *instrlookup[] = { "NOOP", "STOP", "INCR", "DNCR", "ZERO",
-                                     "TURN", "CRCH", "KILL", "SHAR", "SPOR", "RDIR" };
-#endif
+const char *instrlookup[IEND] = { "NOOP", "STOP", "INCR", "DNCR", "ZERO",
+                                  "TURN", "CRCH", "KILL", "SHAR", "SPOR", "RDIR" };
+
+/**
+ * Add a cell to the live index if its being tracked and the cell isnt already in it.
+ * @param cluster Cluster with the index.
+ * @param i Index of the cell.
+ */
+inline static void live_add(struct cell_cluster *cluster, size_t i) {
+    size_t pos;
+
+    if (!cluster->live_track)
+        return;
+    pos = cluster->live_pos[i];
+    if (pos < cluster->nlive && cluster->live[pos] == i)
+        return;
+    cluster->live_pos[i] = cluster->nlive;
+    cluster->live[cluster->nlive++] = i;
+}
 
 /**
- * Reap a cell if it has no energy left.
- * @param cluster Cluster to reap cell from.
- * @param x X coord of the cell.
- * @param y Y coord of the cell.
- * @return 0 on OK, something else on fail.
+ * Remove a cell from the live index if its being tracked and is in it, the last
+ * cell in the index is moved into its place.
+ * @param cluster Cluster with the index.
+ * @param i Index of the cell.
  */
-inline static int cell_reap(const struct cell_cluster *cluster, int x, int y) {
-    struct cell_proc *current;
+inline static void live_remove(struct cell_cluster *cluster, size_t i) {
+    size_t pos, last;
 
-    current = cluster->cells[x][y];
+    if (!cluster->live_track)
+        return;
+    pos = cluster->live_pos[i];
+    if (pos >= cluster->nlive || cluster->live[pos] != i)
+        return;
+    last = cluster->live[--cluster->nlive];
+    cluster->live[pos] = last;
+    cluster->live_pos[last] = pos;
+}
+
+int cell_reap(struct cell_cluster *cluster, struct cell_ctx *ctx, int x, int y) {
+    size_t i;
 
-    if (current->gen > 0 && current->energy <= 0) {
+    i = cell_index(cluster, x, y);
+
+    if (cell_gen(cluster, i) > 0 && cell_energy(cluster, i) <= 0) {
 #ifdef DEBUG
-        printf("Reaper:%dx%d, gen:%ld, tick:%ld\n", x, y, current->gen, cluster->tick);
+        printf("Reaper:%dx%d, gen:%ld, tick:%ld\n", x, y, cell_gen(cluster, i), cluster->tick);
 #endif
-        memset(current, '\0', sizeof(struct cell_proc));
+        cell_clear(cluster, i);
+        live_remove(cluster, i);
+        ctx->stats->energy_death++;
+        TRACE_EVENT(ctx, cluster->tick, TRACE_REAP, i, 0, 0);
         return 0;
     }
     return 1;
 }
 
 /**
- * Get the neighbour specified by direction reletive to the cell at the coords specified.
- * @param cluster Cell cluster to get cell from.
- * @param x Horizontal co-ords.
- * @param y Vertical co-ords.
- * @param direction Direction of neighbour reletive to specified cell co-ords, LEFT,RIGHT,UP,DOWN.
+ * Sample how many instructions or bits go by before the next mutation.
+ * @param cluster Cluster with the mutation settings.
+ * @param ctx Context to draw the random number from.
+ * @return Units to skip.
  */
-inline static struct cell_proc *get_neighbour(const struct cell_cluster *cluster, int x, int y, int direction) {
-    int xp, yp;
-    if (get_neighbour_coords(x, y, direction, &xp, &yp) != -1)
-        return cluster->cells[xp][yp];
-    else return NULL;
+static unsigned long mutation_gap(const struct cell_cluster *cluster, struct cell_ctx *ctx) {
+    double gap;
+
+    if (!cluster->mutation.rate)
+        return ULONG_MAX / 2;
+    gap = log(rng_unit(&ctx->rng)) / cluster->mutation.logq;
+    return gap < (double)(ULONG_MAX / 2) ? (unsigned long)gap : ULONG_MAX / 2;
 }
 
 /**
- * Core cell logic processor, process the cell at the given co-ords instructions.
- * @param cluster Cluster with the cell to compute.
- * @param x Horizontal co-ords of the cell.
- * @param y Vertical co-ords of the cell.
- * @param TODO
- * @return The cell proccessed on success, NULL on fail.
+ * CRCH, eat the neighbour pointed to by direct if there is one.
+ * @param cluster Cluster with the cell.
+ * @param ctx Execution context of the calling thread.
+ * @param x x coord of the cell.
+ * @param y y coord of the cell.
+ * @param direct Direction register.
+ * @param energy Energy of the cell.
+ * @return 0 on ok, 1 on fail.
  */
-static struct cell_proc *proc_cell(const struct cell_cluster *cluster, int x, int y, char *didstuff) {
-    int reg0, stop, instptr, direct, tmp;
-    struct cell_proc *cell, *neighb;
+inline static int op_crch(struct cell_cluster *cluster, struct cell_ctx *ctx, int x, int y, int direct, unsigned long *energy) {
+    size_t neighb;
+
+    if (*energy <= 1)
+        return 0;
+    neighb = cell_neighbour(cluster, x, y, direct);
+    if (cell_gen(cluster, neighb) != 0) {
+        /* EXPERIMENTAL, kill neighbour. */
+        *energy += 10;
+        cell_clear(cluster, neighb);
+        live_remove(cluster, neighb);
+        ctx->stats->crch_deaths++;
+        TRACE_EVENT(ctx, cluster->tick, TRACE_CRCH, neighb, direct, 0);
+    }
+    return 0;
+}
 
-    reg0 = stop = instptr = 0;
+/**
+ * KILL, kill the neighbour pointed to by direct if there is one.
+ * @param cluster Cluster with the cell.
+ * @param ctx Execution context of the calling thread.
+ * @param x x coord of the cell.
+ * @param y y coord of the cell.
+ * @param direct Direction register.
+ * @param energy Energy of the cell.
+ * @return 0 on ok, 1 on fail.
+ */
+inline static int op_kill(struct cell_cluster *cluster, struct cell_ctx *ctx, int x, int y, int direct, unsigned long *energy) {
+    size_t neighb;
 
-    if ((cell = cluster->cells[x][y]) == NULL) {
-        printf("Could not retreive cell\n");
-        return NULL;
+    if (*energy <= 1)
+        return 0;
+    neighb = cell_neighbour(cluster, x, y, direct);
+    if (cell_gen(cluster, neighb) != 0) {
+        /* EXPERIMENTAL, kill neighbour. */
+        cell_clear(cluster, neighb);
+        live_remove(cluster, neighb);
+        ctx->stats->kill_deaths++;
+        TRACE_EVENT(ctx, cluster->tick, TRACE_KILL, neighb, direct, 0);
     }
+    return 0;
+}
 
-    /* If the instrucions arnt null and theres enough energy. */
-    if (cell->instructions && cell->energy > 0) {
-        *didstuff = 1;
+/**
+ * SHAR, give half the cells energy to the neighbour pointed to by direct.
+ * @param cluster Cluster with the cell.
+ * @param ctx Execution context of the calling thread.
+ * @param x x coord of the cell.
+ * @param y y coord of the cell.
+ * @param direct Direction register.
+ * @param energy Energy of the cell.
+ * @return 0 on ok, 1 on fail.
+ */
+inline static int op_shar(struct cell_cluster *cluster, struct cell_ctx *ctx, int x, int y, int direct, unsigned long *energy) {
+    size_t neighb;
+
+    if (*energy <= 1)
+        return 0;
+    neighb = cell_neighbour(cluster, x, y, direct);
+    if (cell_gen(cluster, neighb) != 0) {
+        /* EXPERIMENTAL, share energy with neighbour. */
+        /* Give neighbour half our energy. */
+        cell_set_energy(cluster, neighb, cell_energy(cluster, neighb) + *energy/2);
+        ctx->stats->shar_energy += *energy/2;
+        TRACE_EVENT(ctx, cluster->tick, TRACE_SHAR, neighb, direct, *energy/2);
+        *energy = *energy/2;
+    }
+    return 0;
+}
+
+/**
+ * SPOR, copy the cell into the neighbour pointed to by direct if its empty.
+ * @param cluster Cluster with the cell.
+ * @param ctx Execution context of the calling thread.
+ * @param x x coord of the cell.
+ * @param y y coord of the cell.
+ * @param cell Index of the cell.
+ * @param direct Direction register.
+ * @param energy Energy of the cell.
+ * @param mutated Set to the number of mutations the cell got from sporing.
+ * @return 0 on ok, 1 on fail.
+ */
+inline static int op_spor(struct cell_cluster *cluster, struct cell_ctx *ctx, int x, int y, size_t cell,
+                          int direct, unsigned long *energy, int *mutated) {
+    unsigned long tmp;
+    size_t neighb;
+
+    *mutated = 0;
+    /* Cant SPOR if you only have one energy, you will spawn a dead child,
+     * hrm maybe we should?. */
+    if (*energy <= 2)
+        return 0;
+    neighb = cell_neighbour(cluster, x, y, direct);
+    /* Spor ok if the cell gen is zero. */
+    if (cell_gen(cluster, neighb) == 0) {
+        tmp = cell_energy(cluster, neighb);
+        /* Copy cell's data to neighbour, increment its gen and take away an energy as a
+         * creation cost. */
+        cell_copy(cluster, neighb, cell);
+        cell_set_gen(cluster, neighb, cell_gen(cluster, cell) + 1);
+        //cell_set_energy(cluster, neighb, 10); // TEST: trying fixed child energy.
+        /* Give the child cell the energy found in cell pre spor. */
+        cell_set_energy(cluster, neighb, *energy - 2 + tmp);
+        live_add(cluster, neighb);
+        TRACE_EVENT(ctx, cluster->tick, TRACE_SPOR, neighb, direct, *energy - 2 + tmp);
+
+        *mutated = cell_mutate(cluster, ctx, x, y);
+        ctx->stats->spor_copies++;
 #ifdef DEBUG
-        printf("Tick %ld, cell:%dx%d, energy:%ld, gen:%ld\n", cluster->tick, x, y, cell->energy, cell->gen);
+        printf("\tspor:true\n");
 #endif
-        direct = rand() % 4;
-        /* Process the cells instructions (if it has any) untill its energy has run out, it has no
-         * instructions left or a STOP opcode is found. */
-        while ((cell->energy > 0) && (instptr < CSIZE) && !stop) {
+    }
+    return 0;
+}
+
+/**
+ * Execute a single instruction and take the energy it costs.
+ * @param cluster Cluster with the cell.
+ * @param ctx Execution context of the calling thread.
+ * @param x x coord of the cell.
+ * @param y y coord of the cell.
+ * @param cell Index of the cell.
+ * @param inst Instruction to execute.
+ * @param reg0 Proccess register.
+ * @param direct Direction register.
+ * @param energy Energy of the cell.
+ * @param stop Set if the instruction was a STOP.
+ * @return 0 on ok, 1 on fail.
+ */
+inline static int exec_inst(struct cell_cluster *cluster, struct cell_ctx *ctx, int x, int y, size_t cell,
+                            int inst, int *reg0, int *direct, unsigned long *energy, int *stop) {
+    int mutated;
+
+    switch (inst) {
+    case NOOP:
+        break;
+    case STOP:
+        *stop = 1;
+        break;
+    case INCR:
+        (*reg0)++;
+        break;
+    case DNCR:
+        if (*reg0 > 0)
+            (*reg0)--;
+        break;
+    case ZERO:
+        *reg0 = 0;
+        break;
+    case TURN:
+        if (*reg0 < cluster->ndirs)
+            *direct = *reg0;
+        break;
+    case CRCH:
+        if (op_crch(cluster, ctx, x, y, *direct, energy))
+            return 1;
+        break;
+    case KILL:
+        if (op_kill(cluster, ctx, x, y, *direct, energy))
+            return 1;
+        break;
+    case SHAR:
+        if (op_shar(cluster, ctx, x, y, *direct, energy))
+            return 1;
+        break;
+    case SPOR:
+        if (op_spor(cluster, ctx, x, y, cell, *direct, energy, &mutated))
+            return 1;
+        break;
+    case RDIR:
+        *direct = rng_below(&ctx->rng, cluster->ndirs);
+        break;
+    default: /* INVALID OPCODE. */
+        break;
+    }
+    (*energy)--;
+    return 0;
+}
+
+/**
+ * Interpret the cells raw instructions, starting part way thru if need be, untill
+ * its energy has run out, it has no instructions left or a STOP opcode is found.
+ * @param cluster Cluster with the cell.
+ * @param ctx Execution context of the calling thread.
+ * @param x x coord of the cell.
+ * @param y y coord of the cell.
+ * @param cell Index of the cell.
+ * @param instptr Instruction to start at.
+ * @param reg0 Value of the proccess register.
+ * @param direct Value of the direction register.
+ * @param energy Energy of the cell.
+ * @return Number of instructions executed, -1 on fail.
+ */
+static int run_interp(struct cell_cluster *cluster, struct cell_ctx *ctx, int x, int y, size_t cell,
+                      int instptr, int reg0, int direct, unsigned long *energy) {
+    int stop, start;
+
+    stop = 0;
+    start = instptr;
+    while ((*energy > 0) && (instptr < CSIZE) && !stop) {
 #ifdef DEBUG
-            printf("\tiptr:0x%x, inst:%s, reg0:0x%x, dir:0x%x, energy:%ld\n", instptr, instrlookup[cell->instructions[instptr]], reg0, direct, cell->energy);
+        printf("\tiptr:0x%x, inst:%s, reg0:0x%x, dir:0x%x, energy:%ld\n", instptr, instrlookup[(int)cell_inst(cluster, cell, instptr)], reg0, direct, *energy);
 #endif
-            switch (cell->instructions[instptr]) {
-            case NOOP:
-                break;
-            case STOP:
-                stop = 1;
-                break;
-            case INCR:
-                reg0++;
-                break;
-            case DNCR:
-                if (reg0 > 0)
-                    reg0--;
-                break;
-            case ZERO:
-                reg0 = 0;
-                break;
-            case TURN:
-                if (reg0 < 4)
-                    direct = reg0;
-                break;
-            case CRCH:
-                if (cell->energy <= 1)
-                    break;
-                else if (!(neighb = get_neighbour(cluster, x, y, direct)))
-                    return NULL;
-                else if (neighb->gen != 0) {
-                    /* EXPERIMENTAL, kill neighbour. */
-                    cell->energy += 10;
-                    memset(neighb, '\0', sizeof *neighb);
-                }
-                break;
-            case KILL:
-                if (cell->energy <= 1)
-                    break;
-                else if (!(neighb = get_neighbour(cluster, x, y, direct)))
-                    return NULL;
-                else if (neighb->gen != 0) {
-                    /* EXPERIMENTAL, kill neighbour. */
-                    memset(neighb, '\0', sizeof *neighb);
-                }
-                break;
-            case SHAR:
-                if (cell->energy <= 1)
-                    break;
-                else if (!(neighb = get_neighbour(cluster, x, y, direct)))
-                    return NULL;
-                else if (neighb->gen != 0) {
-                    /* EXPERIMENTAL, share energy with neighbour. */
-                    /* Give neighbour half our energy. */
-                    neighb->energy += cell->energy/2;
-                    cell->energy = cell->energy/2;
-                }
-                break;
-            case SPOR:
-                /* Cant SPOR if you only have one energy, you will spawn a dead child,
-                 * hrm maybe we should?. */
-                if (cell->energy <= 2)
-                    break;
-                /* invalod neighbour, should not happen. */
-                else if (!(neighb = get_neighbour(cluster, x, y, direct)))
-                    return NULL;
-                /* Spor ok if the cell gen is zero. */
-                else if (neighb->gen == 0) {
-                    tmp = neighb->energy;
-                    /* Copy cell's data to neighbour, increment its gen and take away an energy as a
-                     * creation cost. */
-                    memcpy(neighb, cell, sizeof *neighb);
-                    neighb->gen++;
-                    neighb->energy -= 2;
-                    //neighb->energy = 10; // TEST: trying fixed child energy.
-                    /* Give the child cell the energy found in cell pre spor. */
-                    neighb->energy += tmp;
-
-                    cell_mutate(cluster, x, y, MUTATIONRATE);
-#ifdef DEBUG
-                    printf("\tspor:true\n");
+        if (exec_inst(cluster, ctx, x, y, cell, cell_inst(cluster, cell, instptr), &reg0, &direct, energy, &stop))
+            return -1;
+        instptr++;
+    }
+    return instptr - start;
+}
+
+#ifdef CELL_PROF
+/**
+ * Interpret the cells raw instructions like run_interp, counting each one into
+ * the contexts profile.
+ * @param cluster Cluster with the cell.
+ * @param ctx Execution context of the calling thread, with a profile.
+ * @param x x coord of the cell.
+ * @param y y coord of the cell.
+ * @param cell Index of the cell.
+ * @param direct Value of the direction register.
+ * @param energy Energy of the cell.
+ * @return Number of instructions executed, -1 on fail.
+ */
+static int run_prof(struct cell_cluster *cluster, struct cell_ctx *ctx, int x, int y, size_t cell,
+                    int direct, unsigned long *energy) {
+    struct cell_prof *prof = ctx->prof;
+    unsigned long before;
+    int instptr, reg0, stop, inst, op;
+
+    reg0 = stop = 0;
+    op = IEND;
+    for (instptr = 0; (*energy > 0) && (instptr < CSIZE) && !stop; instptr++) {
+        inst = cell_inst(cluster, cell, instptr);
+        before = *energy;
+        if (exec_inst(cluster, ctx, x, y, cell, inst, &reg0, &direct, energy, &stop))
+            return -1;
+        /* Anything outside the instruction set does nothing, count them together. */
+        op = inst >= 0 && inst < IEND ? inst : IEND;
+        prof->execs[op]++;
+        prof->energy[op] += (long)(before - *energy);
+    }
+    prof->ends[stop ? PROF_STOP : !*energy ? PROF_EXHAUSTED : PROF_END][op]++;
+    prof->runs++;
+    return instptr;
+}
 #endif
-                }
-                break;
-            case RDIR:
-                direct = rand() % 4;
-                break;
-            default: /* INVALID OPCODE. */
-                break;
+
+#ifdef CELL_XCACHE
+/**
+ * Run the cells decoded instructions from the translation cache, with the same
+ * results and energy use as run_interp.
+ * @param cluster Cluster with the cell.
+ * @param ctx Execution context of the calling thread, with a translation cache.
+ * @param x x coord of the cell.
+ * @param y y coord of the cell.
+ * @param cell Index of the cell.
+ * @param direct Value of the direction register.
+ * @param energy Energy of the cell.
+ * @return Number of instructions executed, -1 on fail.
+ */
+static int run_decoded(struct cell_cluster *cluster, struct cell_ctx *ctx, int x, int y, size_t cell,
+                       int direct, unsigned long *energy) {
+    const struct xprog *prog;
+    const struct xop *op;
+    char genome[CSIZE];
+    int count, mutated, ret;
+
+    cell_genome(cluster, cell, genome);
+    if (!(prog = xcache_lookup(ctx->xcache, genome)))
+        return run_interp(cluster, ctx, x, y, cell, 0, 0, direct, energy);
+
+    for (count = 0, op = prog->ops; ; op++) {
+        /* Run out of energy somewhere in the pure instructions or just after them. */
+        if (*energy <= op->npure) {
+            count += *energy;
+            *energy = 0;
+            return count;
+        }
+        *energy -= op->npure;
+        count += op->npure;
+        if (op->dir >= 0)
+            direct = op->dir;
+
+        switch (op->kind) {
+        case XOP_END:
+            return count;
+        case XOP_STOP:
+            (*energy)--;
+            return count + 1;
+        case XOP_CRCH:
+            if (op_crch(cluster, ctx, x, y, direct, energy))
+                return -1;
+            break;
+        case XOP_KILL:
+            if (op_kill(cluster, ctx, x, y, direct, energy))
+                return -1;
+            break;
+        case XOP_SHAR:
+            if (op_shar(cluster, ctx, x, y, direct, energy))
+                return -1;
+            break;
+        case XOP_SPOR:
+            if (op_spor(cluster, ctx, x, y, cell, direct, energy, &mutated))
+                return -1;
+            /* The genome just changed under us, interpret the rest of it. */
+            if (mutated) {
+                (*energy)--;
+                if ((ret = run_interp(cluster, ctx, x, y, cell, op->pc + 1, op->reg, direct, energy)) < 0)
+                    return -1;
+                return count + 1 + ret;
             }
-            cell->energy--;
-            instptr++;
+            break;
+        case XOP_RDIR:
+            direct = rng_below(&ctx->rng, cluster->ndirs);
+            break;
         }
+        (*energy)--;
+        count++;
+    }
+}
+#endif
+
+int proc_cell(struct cell_cluster *cluster, struct cell_ctx *ctx, int x, int y, char *didstuff) {
+    int direct, count;
+    unsigned long energy;
+    size_t cell;
+
+    cell = cell_index(cluster, x, y);
+    energy = cell_energy(cluster, cell);
+#ifdef CELL_PROF
+    if (ctx->prof)
+        ctx->prof->picks++;
+#endif
+
+    /* If theres enough energy. */
+    if (energy > 0) {
+        *didstuff = 1;
+#ifdef DEBUG
+        printf("Tick %ld, cell:%dx%d, energy:%ld, gen:%ld\n", cluster->tick, x, y, energy, cell_gen(cluster, cell));
+#endif
+        direct = rng_below(&ctx->rng, cluster->ndirs);
+        /* The energy is kept in a local and written back before anything else looks
+         * at the cell. */
+#ifdef CELL_PROF
+        if (ctx->prof)
+            count = run_prof(cluster, ctx, x, y, cell, direct, &energy);
+        else
+#endif
+#ifdef CELL_XCACHE
+        if (ctx->xcache)
+            count = run_decoded(cluster, ctx, x, y, cell, direct, &energy);
+        else
+#endif
+        count = run_interp(cluster, ctx, x, y, cell, 0, 0, direct, &energy);
+        if (count < 0)
+            return 1;
+
+        cell_set_energy(cluster, cell, energy);
+        ctx->stats->instructions += count;
+        TRACE_EVENT(ctx, cluster->tick, TRACE_RUN, cell, 0, energy);
 #ifdef DEBUG
-        printf("Cell stopped: iptr:0x%x/0x%x, inst:%s, stp:%d, energy:%ld\n", instptr-1, CSIZE, instrlookup[cell->instructions[instptr-1]], stop, cell->energy);
+        printf("Cell stopped: executed:0x%x/0x%x, energy:%ld\n", count, CSIZE, energy);
  //       if (ARTIFICIAL_LIMIT > 0)
 //            sleep(ARTIFICIAL_LIMIT); /* Sleep so we can see results. */
 #endif
     }
-    return cell;
+    return 0;
+}
+
+/** How each of CELL_TOPOLOGIES is wired. */
+static const struct {
+    /** Name to pick it by. */
+    const char *name;
+    /** Number of directions. */
+    int ndirs;
+    /** Step to the neighbour in each direction, x by even and odd rows. */
+    int dx[2][CELL_MAXDIRS];
+    int dy[CELL_MAXDIRS];
+    /** Direction back the other way. */
+    int opposite[CELL_MAXDIRS];
+} topologies[TOPO_MAX] = {
+    [TOPO_VONNEUMANN] = { "vonneumann", 4,
+        { { -1, 1, 0, 0 }, { -1, 1, 0, 0 } }, { 0, 0, -1, 1 }, { 1, 0, 3, 2 } },
+    [TOPO_MOORE] = { "moore", 8,
+        { { -1, 1, 0, 0, -1, 1, -1, 1 }, { -1, 1, 0, 0, -1, 1, -1, 1 } },
+        { 0, 0, -1, 1, -1, -1, 1, 1 }, { 1, 0, 3, 2, 7, 6, 5, 4 } },
+    /* Odd rows are shifted right so the cells above and below an even row
+     * cell are at x-1 and x, and at x and x+1 for an odd row. */
+    [TOPO_HEX] = { "hex", 6,
+        { { -1, 1, -1, -1, 0, 0 }, { -1, 1, 0, 0, 1, 1 } },
+        { 0, 0, -1, 1, -1, 1 }, { 1, 0, 5, 4, 3, 2 } }
+};
+
+int topology_find(const char *name) {
+    int i;
+
+    for (i = 0; i < TOPO_MAX; i++)
+        if (!strcmp(topologies[i].name, name))
+            return i;
+    return -1;
+}
+
+int cluster_set_topology(struct cell_cluster *cluster, int topology) {
+    int d, p;
+
+    if (topology < 0 || topology >= TOPO_MAX)
+        return 1;
+    /* Hex rows alternate, an odd height would put two odd rows next to each
+     * other where the grid wraps. */
+    if (topology == TOPO_HEX && cluster->h % 2)
+        return 1;
+
+    cluster->topology = topology;
+    cluster->ndirs = topologies[topology].ndirs;
+    for (d = 0; d < CELL_MAXDIRS; d++) {
+        /* Unused directions point at the cell itself, they are never looked up. */
+        for (p = 0; p < 2; p++)
+            cluster->nb_x[p][d] = (topologies[topology].dx[p][d] + 1) * cluster->w;
+        cluster->nb_y[d] = (topologies[topology].dy[d] + 1) * cluster->h;
+        cluster->opposite[d] = topologies[topology].opposite[d];
+    }
+    /* Cached decodes know which TURNs are valid, start them over. */
+    if (cluster->ctx.xcache) {
+        xcache_free(cluster->ctx.xcache);
+        cluster->ctx.xcache = xcache_new(cluster->ndirs);
+    }
+    return 0;
+}
+
+void cluster_set_arena(struct cell_cluster *cluster, void *arena) {
+#ifdef CELL_SOA
+    size_t fields = CELL_ROUNDUP(cluster->area * sizeof(unsigned long));
+
+    cluster->gen = arena;
+    cluster->energy = (unsigned long *)((char *)arena + fields);
+    cluster->instructions = (char (*)[CSIZE])((char *)arena + fields * 2);
+#else
+    cluster->cells = arena;
+#endif
+    cluster->arena = arena;
 }
 
-int cluster_init(struct cell_cluster *cluster) {
-    int x,y,acount;
+int cluster_init(struct cell_cluster *cluster, int w, int h) {
+    size_t size, fields;
+    void *arena;
+    int i;
 
     memset(cluster, '\0', sizeof *cluster);
-    acount = 0;
-    /* Init rand just incase its not, we use it alot. */
-    srand(time(NULL));
-
-    /* Malloc some space for the cells and clear their memory. */
-    for (x = 0; x < X; x++) {
-        for (y = 0; y < Y; y++) {
-            if (!(cluster->cells[x][y] = malloc(sizeof(struct cell_proc))))
-                exit(1);
-
-            memset(cluster->cells[x][y], '\0', sizeof(struct cell_proc));
-            acount += sizeof(struct cell_proc);
-        }
+    if (w < 1 || h < 1 || (size_t)w * h > SIZE_MAX / (2 * sizeof(struct cell_proc)))
+        return 1;
+    cluster->w = w;
+    cluster->h = h;
+    cluster->area = (size_t)w * h;
+
+    /* Grab one block for the whole grid so neighbours are a stride away rather
+     * than a pointer chase, the SoA layout carves it into one array per field.
+     * Its mapped rather than malloc'd so huge grids come back zeroed without
+     * touching every page up front, pages are also aligned well past CELL_ALIGN. */
+    fields = CELL_ROUNDUP(cluster->area * sizeof(unsigned long));
+#if defined(CELL_SOA)
+    size = fields * 2 + CELL_ROUNDUP(cluster->area * CSIZE);
+#elif defined(CELL_PACKED)
+    (void)fields;
+    size = CELL_ROUNDUP(cluster->area * sizeof(struct cell_packed));
+#else
+    (void)fields;
+    size = CELL_ROUNDUP(cluster->area * sizeof(struct cell_proc));
+#endif
+    arena = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (arena == MAP_FAILED)
+        return 1;
+    cluster->arena_size = size;
+    cluster_set_arena(cluster, arena);
+
+    /* Wrapping tables so neighbours are found without any edge tests, entry
+     * k * w + x is x + k - 1 wrapped round. */
+    if (!(cluster->wrap_x = malloc(3 * w * sizeof(int))) || !(cluster->wrap_y = malloc(3 * h * sizeof(int))) ||
+            !(cluster->wrap_row = malloc(3 * h * sizeof(size_t))))
+        exit(1);
+    for (i = 0; i < 3 * w; i++)
+        cluster->wrap_x[i] = (i % w + i / w - 1 + w) % w;
+    for (i = 0; i < 3 * h; i++) {
+        cluster->wrap_y[i] = (i % h + i / h - 1 + h) % h;
+        cluster->wrap_row[i] = (size_t)cluster->wrap_y[i] * w;
     }
+
+    cluster_set_mutation(cluster, MUTATIONRATE, MUTATE_OPCODE);
+    cluster_set_topology(cluster, TOPO_VONNEUMANN);
+    cluster_seed(cluster, 0);
+#if defined(CELL_XCACHE) && !defined(DEBUG)
+    /* Not when debugging, the interpreter prints every instruction. */
+    cluster->ctx.xcache = xcache_new(cluster->ndirs);
+#endif
 #ifdef DEBUG
-    printf("Cell alloc: %db, %dx%dx%ld\n", acount, X, Y, sizeof(struct cell_proc));
+    printf("Cell alloc: %zub, %dx%d\n", size, w, h);
 #endif
     return 0;
 }
 
-void cluster_free(struct cell_cluster *cluster) {
-    int x,y,acount;
-    acount = 0;
+/** Thread unmapping the old arenas of one cluster, see cluster_reset(). */
+struct arena_reclaim {
+    pthread_t thread;
+    /** Guards old and stop. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /** Arena waiting to be unmapped, NULL for none. */
+    void *old;
+    size_t size;
+    /** Set to have the thread finish and stop. */
+    int stop;
+};
 
-    for (x= 0; x < X; x++) {
-        for (y = 0; y < Y; y++) {
-            free(cluster->cells[x][y]);
-            acount += sizeof(struct cell_proc);
-        }
+/**
+ * Unmap each arena handed over, ran on its own thread so the kernel freeing
+ * every page the arena had written doesnt hold up whoever reset the cluster.
+ * @param arg The arena_reclaim.
+ */
+static void *arena_reclaim_run(void *arg) {
+    struct arena_reclaim *rec = arg;
+    void *old;
+
+    pthread_mutex_lock(&rec->lock);
+    for (;;) {
+        while (!rec->old && !rec->stop)
+            pthread_cond_wait(&rec->cond, &rec->lock);
+        if (!rec->old)
+            break;
+        old = rec->old;
+        pthread_mutex_unlock(&rec->lock);
+        munmap(old, rec->size);
+        pthread_mutex_lock(&rec->lock);
+        rec->old = NULL;
+        pthread_cond_broadcast(&rec->cond);
+    }
+    pthread_mutex_unlock(&rec->lock);
+    return NULL;
+}
+
+/**
+ * Start a reclaim thread.
+ * @param size Size of the arenas it will unmap.
+ * @return The reclaim thread, NULL if one cant be had.
+ */
+static struct arena_reclaim *arena_reclaim_new(size_t size) {
+    struct arena_reclaim *rec;
+
+    if (!(rec = calloc(1, sizeof *rec)))
+        exit(1);
+    rec->size = size;
+    pthread_mutex_init(&rec->lock, NULL);
+    pthread_cond_init(&rec->cond, NULL);
+    if (pthread_create(&rec->thread, NULL, arena_reclaim_run, rec)) {
+        pthread_mutex_destroy(&rec->lock);
+        pthread_cond_destroy(&rec->cond);
+        free(rec);
+        return NULL;
     }
+    return rec;
+}
+
+/**
+ * Hand an arena to a reclaim thread, waiting first if its still unmapping the
+ * last one so no more than one is ever held on to.
+ * @param rec Reclaim thread.
+ * @param arena Arena to unmap.
+ */
+static void arena_reclaim_push(struct arena_reclaim *rec, void *arena) {
+    pthread_mutex_lock(&rec->lock);
+    while (rec->old)
+        pthread_cond_wait(&rec->cond, &rec->lock);
+    rec->old = arena;
+    pthread_cond_broadcast(&rec->cond);
+    pthread_mutex_unlock(&rec->lock);
+}
+
+/**
+ * Let a reclaim thread finish the arena its on and stop it.
+ * @param rec Reclaim thread, NULL for none.
+ */
+static void arena_reclaim_free(struct arena_reclaim *rec) {
+    if (!rec)
+        return;
+    pthread_mutex_lock(&rec->lock);
+    rec->stop = 1;
+    pthread_cond_broadcast(&rec->cond);
+    pthread_mutex_unlock(&rec->lock);
+    pthread_join(rec->thread, NULL);
+    pthread_mutex_destroy(&rec->lock);
+    pthread_cond_destroy(&rec->cond);
+    free(rec);
+}
+
+void cluster_free(struct cell_cluster *cluster) {
 #ifdef DEBUG
-    printf("Cell free: %db\n", acount);
+    printf("Cell free: %zub\n", cluster->arena_size);
 #endif
+    arena_reclaim_free(cluster->reclaim);
+    cluster->reclaim = NULL;
+    if (cluster->arena)
+        munmap(cluster->arena, cluster->arena_size);
+    xcache_free(cluster->ctx.xcache);
+    cluster->ctx.xcache = NULL;
+    free(cluster->live);
+    free(cluster->live_pos);
+    free(cluster->wrap_x);
+    free(cluster->wrap_y);
+    free(cluster->wrap_row);
+    free(cluster->dirty);
+    free(cluster->dirty_blocks);
+    free_callbacks(&cluster->callbacks);
+    cluster->arena = NULL;
+    cluster->dirty = cluster->dirty_blocks = NULL;
+    cluster->wrap_x = cluster->wrap_y = NULL;
+    cluster->wrap_row = NULL;
+    cluster->live = cluster->live_pos = NULL;
+    cluster->live_track = 0;
 }
 
 int cluster_reset(struct cell_cluster *cluster) {
-    struct callback_stack tmp = cluster->callbacks;
+    void *arena;
+
+    /* A fresh mapping reads as all zero, empty cells, without anything being
+     * cleared and only gets pages as cells are written. Giving the old one
+     * back is left to the clusters reclaim thread, or done here if one cant
+     * be had. */
+    arena = mmap(NULL, cluster->arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (arena == MAP_FAILED)
+        return 1;
+    if (!cluster->reclaim)
+        cluster->reclaim = arena_reclaim_new(cluster->arena_size);
+    if (cluster->reclaim)
+        arena_reclaim_push(cluster->reclaim, cluster->arena);
+    else
+        munmap(cluster->arena, cluster->arena_size);
+    cluster_set_arena(cluster, arena);
 
-    /* Destruct/restruct the object then copy back some
-     * data we backed up for convenience. */
-    cluster_free(cluster);
-    cluster_init(cluster);
-    memcpy(&cluster->callbacks, &tmp, sizeof cluster->callbacks);
+    /* The rest sized by the grid is kept as is, an empty index is still a
+     * good one and the dirty maps are skipped over till the next full redraw.
+     * Callbacks start over with the tick. */
+    cluster->tick = 0;
+    memset(&cluster->stats, '\0', sizeof cluster->stats);
+    cluster->nlive = 0;
+    if (cluster->dirty)
+        cluster->dirty_all = 1;
+    cluster->sched_end = 0;
+    rewind_callbacks(&cluster->callbacks);
+#ifdef DEBUG
+    printf("Cell reset: %zub\n", cluster->arena_size);
+#endif
     return 0;
 }
 
-int cluster_sched(struct cell_cluster *cluster) {
-    struct cell_proc *current;
-    int x, y;
-    char didstuff;
+void cluster_seed(struct cell_cluster *cluster, unsigned long seed) {
+    struct xcache *xcache = cluster->ctx.xcache;
+    struct cell_trace *trace = cluster->ctx.trace;
+    struct cell_prof *prof = cluster->ctx.prof;
 
-    while (!cluster->sched_end) {
-        didstuff = 0;
+    cluster->seed = seed;
+    cell_ctx_init(&cluster->ctx, cluster, &cluster->stats, seed, 0);
+    cluster->ctx.xcache = xcache;
+    cluster->ctx.trace = trace;
+    cluster->ctx.prof = prof;
+}
+
+void cluster_set_mutation(struct cell_cluster *cluster, unsigned long rate, int mode) {
+    cluster->mutation.rate = rate;
+    cluster->mutation.mode = mode;
+    cluster->mutation.logq = rate ? log1p(-1.0 / rate) : 0;
+    cluster->ctx.mut_skip = mutation_gap(cluster, &cluster->ctx);
+}
+
+void cell_ctx_init(struct cell_ctx *ctx, const struct cell_cluster *cluster, struct cluster_stats *stats,
+                   unsigned long seed, unsigned long stream) {
+    rng_seed(&ctx->rng, seed, stream);
+    ctx->stats = stats;
+    ctx->xcache = NULL;
+    ctx->trace = NULL;
+    ctx->prof = NULL;
+    ctx->mut_skip = mutation_gap(cluster, ctx);
+}
+
+void cluster_track_dirty(struct cell_cluster *cluster, int on) {
+    size_t blocks = (cluster->area + (1 << DIRTY_SHIFT) - 1) >> DIRTY_SHIFT;
+
+    free(cluster->dirty);
+    free(cluster->dirty_blocks);
+    cluster->dirty = cluster->dirty_blocks = NULL;
+    if (!on)
+        return;
+
+    /* Everything starts dirty so the first frame draws it all. */
+    if (!(cluster->dirty = malloc(cluster->area)) || !(cluster->dirty_blocks = malloc(blocks)))
+        exit(1);
+    memset(cluster->dirty, 1, cluster->area);
+    memset(cluster->dirty_blocks, 1, blocks);
+}
+
+void cluster_live_rebuild(struct cell_cluster *cluster) {
+    size_t i;
 
-        /* Proc a random cell. */
-        x = RANDX;
-        y = RANDY;
-        if (!(current = proc_cell(cluster, x, y, &didstuff))) {
+    if (!cluster->live) {
+        if (!(cluster->live = malloc(cluster->area * sizeof(size_t))) ||
+            !(cluster->live_pos = malloc(cluster->area * sizeof(size_t))))
+            exit(1);
+    }
+
+    cluster->nlive = 0;
+    cluster->live_track = 1;
+    for (i = 0; i < cluster->area; i++)
+        if (cell_gen(cluster, i) != 0)
+            live_add(cluster, i);
+}
+
+/**
+ * Run one scheduled cell then do its reaping and callbacks.
+ * @param cluster Cluster containing the cell.
+ * @param x x coord of the cell.
+ * @param y y coord of the cell.
+ */
+inline static void sched_cell(struct cell_cluster *cluster, int x, int y) {
+    char didstuff = 0;
+
+    if (proc_cell(cluster, &cluster->ctx, x, y, &didstuff)) {
 #ifdef DEBUG
-            printf("Cell table error: %dx%d\n", x, y);
+        printf("Cell table error: %dx%d\n", x, y);
 #endif
-            exit(1);
+        exit(1);
+    }
+
+    /* Do any reaping/callbacks that need doing then incremen the tick. */
+    cell_reap(cluster, &cluster->ctx, x, y);
+    do_callbacks(&cluster->callbacks, cluster->tick, x, y, didstuff);
+    cluster->tick++;
+}
+
+/**
+ * SCHED_LIVE scheduler, only ever picks live cells. A uniform pick over the whole
+ * grid lands on a live cell with odds p = nlive/area, so the number of empty picks
+ * before one is geometric, the tick counter is skipped forward by a sample of that
+ * to keep it comparable with SCHED_RANDOM. Dense grids are picked uniformly as the
+ * empty picks are cheaper than the log.
+ * @param cluster Cluster to schedule.
+ */
+static void sched_live(struct cell_cluster *cluster) {
+    unsigned long from;
+    double gap;
+    int x, y;
+
+    if (!cluster->live_track)
+        cluster_live_rebuild(cluster);
+
+    while (!cluster->sched_end) {
+        if (cluster->nlive * 2 >= cluster->area) {
+            sched_cell(cluster, RANDX(cluster), RANDY(cluster));
+            continue;
+        }
+
+        from = cluster->tick;
+        if (!cluster->nlive) {
+            /* Nothing left alive, every pick would be empty. */
+            cluster->tick += cluster->area;
+        } else {
+            gap = log(rng_unit(&cluster->ctx.rng)) / log1p(-(double)cluster->nlive / cluster->area);
+            cluster->tick += gap < cluster->area ? (unsigned long)gap : cluster->area;
         }
+        do_callbacks_span(&cluster->callbacks, from, cluster->tick, -1, -1, 0);
 
-        /* Do any reaping/callbacks that need doing then incremen the tick. */
-        cell_reap(cluster, x, y);
-        do_callbacks(&cluster->callbacks, cluster->tick, x, y, didstuff);
-        cluster->tick++;
+        /* The pick ends the skip even if a callback just ended the run, so a
+         * run always stops between picks and one resumed from a checkpoint
+         * carries on with the next gap like it would have. */
+        if (cluster->nlive) {
+            cell_coords(cluster, cluster->live[rng_below64(&cluster->ctx.rng, cluster->nlive)], &x, &y);
+            sched_cell(cluster, x, y);
+        }
+    }
+}
+
+int cluster_sched(struct cell_cluster *cluster) {
+    if (cluster->sched_mode == SCHED_SYNC)
+        return cluster_sched_sync(cluster, cluster->threads);
+    if (cluster->threads > 1)
+        return cluster_sched_tiled(cluster, cluster->threads);
+    if (cluster->sched_mode == SCHED_LIVE) {
+        sched_live(cluster);
+        return 0;
     }
+
+    /* Proc a random cell. */
+    while (!cluster->sched_end)
+        sched_cell(cluster, RANDX(cluster), RANDY(cluster));
     return 0;
 }
 
-int get_neighbour_coords(int x, int y, int direction, int *xp, int *yp) {
+/**
+ * Stop the scheduler once the budget has been spent.
+ */
+static void callback_budget(void *userdata, int x, int y, char didstuff) {
+    struct cell_budget *budget = userdata;
+
+    if (budget->cluster->tick + 1 >= budget->end)
+        budget->cluster->sched_end = 1;
+}
+
+int cluster_budget(struct cell_cluster *cluster, struct cell_budget *budget, unsigned long ticks) {
+    if (!ticks)
+        return 1;
+    budget->cluster = cluster;
+    budget->end = cluster->tick + ticks;
+    cluster->sched_end = 0;
+
+    /* Callbacks fire on multiples of their frequency, this one fires on tick
+     * end-1 and ends the run, theres no earlier multiple after the tick now. */
+    budget->slot = add_callback(&cluster->callbacks, callback_budget, budget->end > 1 ? budget->end - 1 : 1,
+                                budget, "BUDGET");
+    return budget->slot == -1;
+}
+
+int cluster_run(struct cell_cluster *cluster, unsigned long ticks) {
+    struct cell_budget budget;
+    int failed;
+
+    if (cluster_budget(cluster, &budget, ticks))
+        return 1;
+    failed = cluster_sched(cluster);
+    del_callback(&cluster->callbacks, budget.slot);
+    return failed;
+}
+
+double clock_seconds(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void cluster_stats_add(struct cluster_stats *dst, const struct cluster_stats *src) {
+    dst->energy_death += src->energy_death;
+    dst->spor_copies += src->spor_copies;
+    dst->instructions += src->instructions;
+    dst->mutations += src->mutations;
+    dst->crch_deaths += src->crch_deaths;
+    dst->kill_deaths += src->kill_deaths;
+    dst->shar_energy += src->shar_energy;
+}
+
+int get_neighbour_coords(const struct cell_cluster *cluster, int x, int y, int direction, int *xp, int *yp) {
     /* Using torodial space, which means when a neighvour is requested on an edge
      * it will be wrapped to the other side of the table. */
-    switch (direction) {
-    case LEFT:
-        if (x-1 >= 0) {
-            *xp = x-1;
-            *yp = y;
-        } else {
-            *xp = X-1;
-            *yp = y;
-        }
-        break;
-    case RIGHT:
-        if (x+1 <= X-1) {
-            *xp = x+1;
-            *yp = y;
-        } else {
-            *xp = 0;
-            *yp = y;
-        }
-        break;
-    case UP:
-        if (y-1 >= 0) {
-            *xp = x;
-            *yp = y-1;
-        } else {
-            *xp =  x;
-            *yp = Y-1;
-        }
-        break;
-    case DOWN:
-        if (y+1 <= Y-1) {
-            *xp = x;
-            *yp = y+1;
-        } else {
-            *xp = x;
-            *yp = 0;
-        }
-        break;
-    default:
+    if (direction < 0 || direction >= cluster->ndirs)
         return -1;
-    }
+    *xp = cluster->wrap_x[cluster->nb_x[y & 1][direction] + x];
+    *yp = cluster->wrap_y[cluster->nb_y[direction] + y];
     return 0;
 }
 
-void cell_pop(const struct cell_cluster *cluster, int x, int y, int gen, int energy, const char instructions[CSIZE]) {
-    cluster->cells[x][y]->gen = gen;
-    cluster->cells[x][y]->energy = energy;
+void cell_pop(struct cell_cluster *cluster, int x, int y, int gen, int energy, const char instructions[CSIZE]) {
+    size_t i = cell_index(cluster, x, y);
+
+    cell_set_gen(cluster, i, gen);
+    cell_set_energy(cluster, i, energy);
     if (instructions)
-        memcpy(cluster->cells[x][y]->instructions, instructions, CSIZE);
+        cell_set_genome(cluster, i, instructions);
+    if (gen)
+        live_add(cluster, i);
+    else
+        live_remove(cluster, i);
 }
 
-void cell_seed(const struct cell_cluster *cluster, int x, int y) {
+void cell_seed(struct cell_cluster *cluster, int x, int y) {
     int i, imax;
-    char seed[CSIZE];
+    size_t cell;
 
-    imax = rand() % CSIZE;
+    cell = cell_index(cluster, x, y);
+    imax = rng_below(&cluster->ctx.rng, CSIZE);
     for (i = 0; i < imax; i++)
-        seed[i] = rand() % IEND;
+        cell_set_inst(cluster, cell, i, rng_below(&cluster->ctx.rng, IEND));
 
-    cluster->cells[x][y]->energy = 10; //rand() % 100; /* SOME VAR */
-    cluster->cells[x][y]->gen = 1;
-    memcpy(cluster->cells[x][y]->instructions, seed, imax);
+    cell_set_energy(cluster, cell, 10); //rand() % 100; /* SOME VAR */
+    cell_set_gen(cluster, cell, 1);
+    live_add(cluster, cell);
 }
 
-void cell_mutate(const struct cell_cluster *cluster, int x, int y, unsigned long chance) {
-    int i;
-    for(i = 0; i < CSIZE; i++)
-        if((rand() % chance) == 1)
-            cluster->cells[x][y]->instructions[i] = rand() % IEND;
+int cell_mutate(struct cell_cluster *cluster, struct cell_ctx *ctx, int x, int y) {
+    unsigned long units, pos, at;
+    size_t cell;
+    int count;
+    char inst;
+
+    if (!cluster->mutation.rate)
+        return 0;
+
+    units = cluster->mutation.mode == MUTATE_BIT ? CSIZE * INST_BITS : CSIZE;
+    /* Usual case, the next mutation is past this copy. */
+    if (ctx->mut_skip >= units) {
+        ctx->mut_skip -= units;
+        return 0;
+    }
+
+    cell = cell_index(cluster, x, y);
+    for (count = 0, pos = ctx->mut_skip; pos < units; count++, pos += mutation_gap(cluster, ctx) + 1) {
+        if (cluster->mutation.mode == MUTATE_BIT) {
+            at = pos / INST_BITS;
+            inst = cell_inst(cluster, cell, at) ^ (1 << (pos % INST_BITS));
+        } else {
+            at = pos;
+            inst = rng_below(&ctx->rng, IEND);
+        }
+        cell_set_inst(cluster, cell, at, inst);
+        TRACE_EVENT(ctx, cluster->tick, TRACE_MUT, cell, 0, at << 8 | (unsigned char)inst);
+    }
+    ctx->mut_skip = pos - units;
+    ctx->stats->mutations += count;
+    return count;
 }
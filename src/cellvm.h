@@ -6,19 +6,24 @@
 #define _CELLVM_H
 
 #include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
 #include "config.h"
 #include "cellvmcb.h"
+#include "cellrand.h"
 
 /********** TWEAKABLE **************/
 /** Size of cell instruction cache. */
 #define CSIZE 16
-/** Horizontal cell cluster resolution. */
-#define X 200
-/** Vertical cell cluster resolution. */
-#define Y 200
+/** Default horizontal cell cluster resolution, the size is picked at cluster_init(). */
+#define DEFAULTX 200
+/** Default vertical cell cluster resolution. */
+#define DEFAULTY 200
 
-#define MUTATIONRATE pow(2, 16)
+/** Default 1/X chance of each instruction of a SPOR'ing cell being mutated. */
+#define MUTATIONRATE 65536
 
 /** Default cell energy. PROB TEMP. */
 #define ENERGY 100
@@ -57,7 +62,41 @@ enum INSTRUCTIONS {
     IEND
 };
 
-/** Possible values for the direction register. */
+/** Name of each instruction, indexed by INSTRUCTIONS. */
+extern const char *instrlookup[IEND];
+
+/** Bits an instruction can be mutated in when mutating per bit, enough to hold IEND-1. */
+#define INST_BITS 4
+
+/** Ways a SPOR'ing cell can be mutated. */
+enum MUTATION_MODES {
+    /** Each instruction is replaced by a random one with 1/rate odds. */
+    MUTATE_OPCODE,
+    /** Each of the INST_BITS low bits of each instruction flips with 1/rate odds,
+      * flipping into an invalid opcode leaves it doing nothing like NOOP. */
+    MUTATE_BIT,
+
+    /** Number of mutation modes, keep it at the end. */
+    MUTATE_MAX
+};
+
+/** Ways the single threaded scheduler can pick the next cell to run. */
+enum SCHED_MODES {
+    /** Pick uniformly from every cell in the grid. */
+    SCHED_RANDOM,
+    /** Pick uniformly from the live cell index, skipping the tick counter over
+      * the empty cells SCHED_RANDOM would have picked in between. */
+    SCHED_LIVE,
+    /** Run every live cell at once against the grid as it was, a generation at
+      * a time, see cluster_step(). Uses cluster->threads threads. */
+    SCHED_SYNC,
+
+    /** Number of scheduler modes, keep it at the end. */
+    SCHED_MAX
+};
+
+/** Possible values for the direction register. The diagonals are only there
+ *  in the Moore topology, see CELL_TOPOLOGIES for the hex ones. */
 enum DIRECTIONS {
     /** Value for left/west. */
     LEFT,
@@ -66,13 +105,51 @@ enum DIRECTIONS {
     /** Value for up/north. */
     UP,
     /** Value for down/south. */
-    DOWN
+    DOWN,
+    /** Value for up left/north west. */
+    UPLEFT,
+    /** Value for up right/north east. */
+    UPRIGHT,
+    /** Value for down left/south west. */
+    DOWNLEFT,
+    /** Value for down right/south east. */
+    DOWNRIGHT
 };
 
-/** Random number between 0 and X. */
-#define RANDX (rand() % X)
-/** Random number between 0 and Y. */
-#define RANDY (rand() % Y)
+/** Most directions any topology has. */
+#define CELL_MAXDIRS 8
+
+/** Ways the toroidal grid can be wired, picked with cluster_set_topology(). */
+enum CELL_TOPOLOGIES {
+    /** 4 neighbours, LEFT RIGHT UP DOWN. */
+    TOPO_VONNEUMANN,
+    /** 8 neighbours, the 4 plus the diagonals. */
+    TOPO_MOORE,
+    /** 6 neighbours, odd rows sit half a cell right of even ones. Directions
+      * are LEFT, RIGHT, then up left, down left, up right and down right of
+      * the hex, the grid needs an even height to wrap. */
+    TOPO_HEX,
+
+    /** Number of topologies, keep it at the end. */
+    TOPO_MAX
+};
+
+/** Width and height of scheduler tiles, see cellsched.h. */
+#define TILE_SIZE 32
+/** Each time a tile gets a turn it runs area/TILE_SLICES random cells. */
+#define TILE_SLICES 4
+/** Rows in each unit of work of a synchronous step, see cellsched.h. */
+#define SYNC_ROWS 4
+/** Cells per byte of a clusters dirty_blocks as a shift, 64 cells. */
+#define DIRTY_SHIFT 6
+
+/** Random number between 0 and the cluster width, drawn from the clusters generator. */
+#define RANDX(cluster) ((int)rng_below(&(cluster)->ctx.rng, (cluster)->w))
+/** Random number between 0 and the cluster height, drawn from the clusters generator. */
+#define RANDY(cluster) ((int)rng_below(&(cluster)->ctx.rng, (cluster)->h))
+
+/** Round a byte count up to a multiple of CELL_ALIGN. */
+#define CELL_ROUNDUP(n) (((n) + CELL_ALIGN - 1) & ~((size_t)CELL_ALIGN - 1))
 
 /** Invovidual cell proccess. */
 struct cell_proc {
@@ -84,37 +161,439 @@ struct cell_proc {
     char instructions[CSIZE];
 };
 
-/**TODO*/
+#ifdef CELL_PACKED
+#if defined(CELL_SOA)
+#error "CELL_PACKED and CELL_SOA are different layouts, pick one"
+#endif
+#if CSIZE % 2
+#error "CELL_PACKED puts two instructions in a byte, CSIZE must be even"
+#endif
+
+/** Largest generation or energy a packed cell holds, bigger ones are saturated. */
+#define CELL_PACKED_MAX UINT32_MAX
+
+/** Cell proccess squeezed into half the space of a cell_proc, see CELL_PACKED. */
+struct cell_packed {
+    /** Generation level of the cell, saturating. */
+    uint32_t gen;
+    /** Energy level of the cell, saturating. */
+    uint32_t energy;
+    /** Instructions two to a byte, the even one in the low nibble. */
+    unsigned char instructions[CSIZE / 2];
+};
+#endif
+
+/** Running counters of what has happened in a cluster. Keep it to unsigned
+  * long counters, checkpoints save it as an array of them. */
 struct cluster_stats {
-    /**TODO*/
+    /** Cells reaped for running out of energy. */
     unsigned long energy_death;
-    /**TODO*/
+    /** Successful SPOR copies, the births. */
     unsigned long spor_copies;
-    /**TODO*/
-    unsigned long vs_lucky;
+    /** Instructions executed by all cells. */
+    unsigned long instructions;
+    /** Instructions or bits changed by cell_mutate. */
+    unsigned long mutations;
+    /** Cells eaten by a CRCH. */
+    unsigned long crch_deaths;
+    /** Cells killed by a KILL. */
+    unsigned long kill_deaths;
+    /** Energy given away by SHAR. */
+    unsigned long shar_energy;
+};
+
+/** Mutation settings, see cluster_set_mutation(). */
+struct cell_mutation {
+    /** 1/rate odds of each instruction or bit mutating, 0 for none. */
+    unsigned long rate;
+    /** One of MUTATION_MODES. */
+    int mode;
+    /** log(1 - 1/rate), precomputed for sampling the gap between mutations. */
+    double logq;
+};
+
+struct xcache;
+struct cell_trace;
+struct cell_prof;
+struct arena_reclaim;
+
+/** Per thread execution state handed to proc_cell, so cells can be ran
+ *  from more than one thread with nothing shared but the grid. */
+struct cell_ctx {
+    /** Random number generator. */
+    struct cell_rng rng;
+    /** Counters to update, the scheduler merges them into the cluster. */
+    struct cluster_stats *stats;
+    /** Instructions or bits still to be copied before the next mutation, carried
+      * from one SPOR to the next so most SPORs cost no random numbers at all. */
+    unsigned long mut_skip;
+    /** Translation cache of decoded genomes, see cellxlat.h. NULL to interpret
+      * the raw instructions. Not owned by the context. */
+    struct xcache *xcache;
+    /** Trace to record events to, see celltrace.h. NULL when not tracing, not
+      * owned by the context. */
+    struct cell_trace *trace;
+    /** Profile to count executed opcodes into, see cellprof.h. NULL when not
+      * profiling, not owned by the context. */
+    struct cell_prof *prof;
 };
 
 /** Holds a cluster of computeable cells. */
 struct cell_cluster {
-    /** 2d 'table' array of cells. */
-    struct cell_proc *cells[X][Y];
+    /** Width and height of the grid in cells. */
+    int w, h;
+    /** Number of cells in the grid, w*h. */
+    size_t area;
+    /** Single page aligned mapping backing the cell grid. */
+    void *arena;
+    /** Size of the arena in bytes. */
+    size_t arena_size;
+    /** Thread unmapping arenas given up by cluster_reset(), NULL till the first. */
+    struct arena_reclaim *reclaim;
+#if defined(CELL_SOA)
+    /** Generation of each cell, indexed with cell_index(). */
+    unsigned long *gen;
+    /** Energy of each cell. */
+    unsigned long *energy;
+    /** Instruction cache of each cell. */
+    char (*instructions)[CSIZE];
+#elif defined(CELL_PACKED)
+    /** Flat row major array of packed cells, indexed with cell_index(). */
+    struct cell_packed *cells;
+#else
+    /** Flat row major array of cells, indexed with cell_index(). */
+    struct cell_proc *cells;
+#endif
     /** VM ticks. Incremented each time a cell finishes executeing. */
     unsigned long tick;
-    /**TODO*/
+    /** Counters updated as the cluster runs. */
     struct cluster_stats stats;
     /** Callback subsystem structure, keeps track of callbacks registered to this VM. */
     struct callback_stack callbacks;
+    /** Execution context used by the single threaded scheduler, its generator
+      * is also used for setting up the cluster and seeding the tiled scheduler. */
+    struct cell_ctx ctx;
+    /** Seed last given to cluster_seed(). */
+    unsigned long seed;
+    /** How cells are mutated when they SPOR. */
+    struct cell_mutation mutation;
+    /** Threads cluster_sched should use, above 1 selects the tiled scheduler. */
+    int threads;
+    /** One of SCHED_MODES, used by the single threaded scheduler. */
+    int sched_mode;
+    /** One of CELL_TOPOLOGIES, and how many directions it has. */
+    int topology;
+    int ndirs;
+    /** Offset into wrap_x of each direction for even and odd rows, and into
+      * wrap_y and wrap_row. */
+    int nb_x[2][CELL_MAXDIRS];
+    int nb_y[CELL_MAXDIRS];
+    /** Direction back the other way for each direction. */
+    int opposite[CELL_MAXDIRS];
+    /** x-1, x and x+1 wrapped around the torus, as three runs of w. */
+    int *wrap_x;
+    /** Same for y, and the index of the start of that row. */
+    int *wrap_y;
+    size_t *wrap_row;
+    /** Live cell index, dense array of the indices of every cell with a gen. */
+    size_t *live;
+    /** Position of each cell in live, only meaningful for cells that are in it. */
+    size_t *live_pos;
+    /** Number of cells in live. */
+    size_t nlive;
+    /** Set while the live index is being kept up to date, the tiled scheduler
+      * stops maintaining it and SCHED_LIVE rebuilds it when it next starts. */
+    char live_track;
+    /** A byte per cell set when its gen, energy or genome is written, and a
+      * byte per 1 << DIRTY_SHIFT cells set along with any of theirs. NULL
+      * unless turned on with cluster_track_dirty(). Whoever draws the grid
+      * clears them as it goes. */
+    unsigned char *dirty;
+    unsigned char *dirty_blocks;
+    /** Set when every cell changed at once, like on a reset, so whoever draws
+      * the grid should redraw the lot and clear the maps rather than go by them. */
+    char dirty_all;
     /** Tells the virtual machine when to stop proccessing cells. */
     char sched_end;
 };
 
+/**
+ * Get the arena index of the cell at x,y. All cell access should go thru
+ * the cell_* accessors below with this index so the grid layout can change.
+ * @param cluster Cluster the cell is in.
+ * @param x x coord of the cell.
+ * @param y y coord of the cell.
+ * @return Index of the cell.
+ */
+static inline size_t cell_index(const struct cell_cluster *cluster, int x, int y) {
+    return (size_t)y * cluster->w + x;
+}
+
+/**
+ * Get the arena index of a neighbour, two table lookups with no branches as the
+ * wrapping is all precomputed.
+ * @param cluster Cluster the cell is in.
+ * @param x x coord of the cell.
+ * @param y y coord of the cell.
+ * @param dir Direction of the neighbour, must be below cluster->ndirs.
+ * @return Index of the neighbour.
+ */
+static inline size_t cell_neighbour(const struct cell_cluster *cluster, int x, int y, int dir) {
+    return cluster->wrap_row[cluster->nb_y[dir] + y] + cluster->wrap_x[cluster->nb_x[y & 1][dir] + x];
+}
+
+/**
+ * Get the co-ords of the cell at an arena index, the reverse of cell_index().
+ * @param cluster Cluster the cell is in.
+ * @param i Index of the cell.
+ * @param x Pointer to store the x coord.
+ * @param y Pointer to store the y coord.
+ */
+static inline void cell_coords(const struct cell_cluster *cluster, size_t i, int *x, int *y) {
+    *x = i % cluster->w;
+    *y = i / cluster->w;
+}
+
+/**
+ * Mark a cell as changed if changes are being tracked, the setters below all
+ * call this. Plain byte stores so threads marking cells side by side never
+ * lose each others marks.
+ * @param cluster Cluster the cell is in.
+ * @param i Index of the cell.
+ */
+static inline void cell_mark(struct cell_cluster *cluster, size_t i) {
+    if (cluster->dirty) {
+        cluster->dirty[i] = 1;
+        cluster->dirty_blocks[i >> DIRTY_SHIFT] = 1;
+    }
+}
+
+#if defined(CELL_SOA)
+/** Get the generation of the cell at index i. */
+static inline unsigned long cell_gen(const struct cell_cluster *cluster, size_t i) {
+    return cluster->gen[i];
+}
+
+/** Set the generation of the cell at index i. */
+static inline void cell_set_gen(struct cell_cluster *cluster, size_t i, unsigned long gen) {
+    cluster->gen[i] = gen;
+    cell_mark(cluster, i);
+}
+
+/** Get the energy of the cell at index i. */
+static inline unsigned long cell_energy(const struct cell_cluster *cluster, size_t i) {
+    return cluster->energy[i];
+}
+
+/** Set the energy of the cell at index i. */
+static inline void cell_set_energy(struct cell_cluster *cluster, size_t i, unsigned long energy) {
+    cluster->energy[i] = energy;
+    cell_mark(cluster, i);
+}
+
+/** Get instruction n of the cell at index i. */
+static inline char cell_inst(const struct cell_cluster *cluster, size_t i, int n) {
+    return cluster->instructions[i][n];
+}
+
+/** Set instruction n of the cell at index i. */
+static inline void cell_set_inst(struct cell_cluster *cluster, size_t i, int n, char inst) {
+    cluster->instructions[i][n] = inst;
+    cell_mark(cluster, i);
+}
+
+/** Copy the instruction cache of the cell at index i into genome. */
+static inline void cell_genome(const struct cell_cluster *cluster, size_t i, char genome[CSIZE]) {
+    memcpy(genome, cluster->instructions[i], CSIZE);
+}
+
+/** Overwrite the instruction cache of the cell at index i with genome. */
+static inline void cell_set_genome(struct cell_cluster *cluster, size_t i, const char genome[CSIZE]) {
+    memcpy(cluster->instructions[i], genome, CSIZE);
+    cell_mark(cluster, i);
+}
+
+/** Wipe the cell at index i back to an empty cell. */
+static inline void cell_clear(struct cell_cluster *cluster, size_t i) {
+    cluster->gen[i] = 0;
+    cluster->energy[i] = 0;
+    memset(cluster->instructions[i], '\0', CSIZE);
+    cell_mark(cluster, i);
+}
+
+/** Copy the whole cell at index src over the cell at index dst. */
+static inline void cell_copy(struct cell_cluster *cluster, size_t dst, size_t src) {
+    cluster->gen[dst] = cluster->gen[src];
+    cluster->energy[dst] = cluster->energy[src];
+    memcpy(cluster->instructions[dst], cluster->instructions[src], CSIZE);
+    cell_mark(cluster, dst);
+}
+
+/** Copy n cells from index i of one clusters arena to the same place in another's,
+  * without marking them. */
+static inline void cell_copy_span(struct cell_cluster *dst, const struct cell_cluster *src, size_t i, size_t n) {
+    memcpy(&dst->gen[i], &src->gen[i], n * sizeof *src->gen);
+    memcpy(&dst->energy[i], &src->energy[i], n * sizeof *src->energy);
+    memcpy(dst->instructions[i], src->instructions[i], n * CSIZE);
+}
+#elif defined(CELL_PACKED)
+/** Get the generation of the cell at index i. */
+static inline unsigned long cell_gen(const struct cell_cluster *cluster, size_t i) {
+    return cluster->cells[i].gen;
+}
+
+/** Set the generation of the cell at index i, saturating at CELL_PACKED_MAX. */
+static inline void cell_set_gen(struct cell_cluster *cluster, size_t i, unsigned long gen) {
+    cluster->cells[i].gen = gen < CELL_PACKED_MAX ? gen : CELL_PACKED_MAX;
+    cell_mark(cluster, i);
+}
+
+/** Get the energy of the cell at index i. */
+static inline unsigned long cell_energy(const struct cell_cluster *cluster, size_t i) {
+    return cluster->cells[i].energy;
+}
+
+/** Set the energy of the cell at index i, saturating at CELL_PACKED_MAX. */
+static inline void cell_set_energy(struct cell_cluster *cluster, size_t i, unsigned long energy) {
+    cluster->cells[i].energy = energy < CELL_PACKED_MAX ? energy : CELL_PACKED_MAX;
+    cell_mark(cluster, i);
+}
+
+/** Get instruction n of the cell at index i. */
+static inline char cell_inst(const struct cell_cluster *cluster, size_t i, int n) {
+    return (cluster->cells[i].instructions[n >> 1] >> ((n & 1) * 4)) & 0xf;
+}
+
+/** Set instruction n of the cell at index i, only its low 4 bits are kept. */
+static inline void cell_set_inst(struct cell_cluster *cluster, size_t i, int n, char inst) {
+    unsigned char *b = &cluster->cells[i].instructions[n >> 1];
+    int shift = (n & 1) * 4;
+
+    *b = (*b & ~(0xf << shift)) | ((inst & 0xf) << shift);
+    cell_mark(cluster, i);
+}
+
+/** Copy the instruction cache of the cell at index i into genome. */
+static inline void cell_genome(const struct cell_cluster *cluster, size_t i, char genome[CSIZE]) {
+    const unsigned char *b = cluster->cells[i].instructions;
+    int n;
+
+    for (n = 0; n < CSIZE / 2; n++) {
+        genome[2 * n] = b[n] & 0xf;
+        genome[2 * n + 1] = b[n] >> 4;
+    }
+}
+
+/** Overwrite the instruction cache of the cell at index i with genome. */
+static inline void cell_set_genome(struct cell_cluster *cluster, size_t i, const char genome[CSIZE]) {
+    unsigned char *b = cluster->cells[i].instructions;
+    int n;
+
+    for (n = 0; n < CSIZE / 2; n++)
+        b[n] = (genome[2 * n] & 0xf) | (genome[2 * n + 1] & 0xf) << 4;
+    cell_mark(cluster, i);
+}
+
+/** Wipe the cell at index i back to an empty cell. */
+static inline void cell_clear(struct cell_cluster *cluster, size_t i) {
+    memset(&cluster->cells[i], '\0', sizeof(struct cell_packed));
+    cell_mark(cluster, i);
+}
+
+/** Copy the whole cell at index src over the cell at index dst. */
+static inline void cell_copy(struct cell_cluster *cluster, size_t dst, size_t src) {
+    memcpy(&cluster->cells[dst], &cluster->cells[src], sizeof(struct cell_packed));
+    cell_mark(cluster, dst);
+}
+
+/** Copy n cells from index i of one clusters arena to the same place in another's,
+  * without marking them. */
+static inline void cell_copy_span(struct cell_cluster *dst, const struct cell_cluster *src, size_t i, size_t n) {
+    memcpy(&dst->cells[i], &src->cells[i], n * sizeof(struct cell_packed));
+}
+#else
+/** Get the generation of the cell at index i. */
+static inline unsigned long cell_gen(const struct cell_cluster *cluster, size_t i) {
+    return cluster->cells[i].gen;
+}
+
+/** Set the generation of the cell at index i. */
+static inline void cell_set_gen(struct cell_cluster *cluster, size_t i, unsigned long gen) {
+    cluster->cells[i].gen = gen;
+    cell_mark(cluster, i);
+}
+
+/** Get the energy of the cell at index i. */
+static inline unsigned long cell_energy(const struct cell_cluster *cluster, size_t i) {
+    return cluster->cells[i].energy;
+}
+
+/** Set the energy of the cell at index i. */
+static inline void cell_set_energy(struct cell_cluster *cluster, size_t i, unsigned long energy) {
+    cluster->cells[i].energy = energy;
+    cell_mark(cluster, i);
+}
+
+/** Get instruction n of the cell at index i. */
+static inline char cell_inst(const struct cell_cluster *cluster, size_t i, int n) {
+    return cluster->cells[i].instructions[n];
+}
+
+/** Set instruction n of the cell at index i. */
+static inline void cell_set_inst(struct cell_cluster *cluster, size_t i, int n, char inst) {
+    cluster->cells[i].instructions[n] = inst;
+    cell_mark(cluster, i);
+}
+
+/** Copy the instruction cache of the cell at index i into genome. */
+static inline void cell_genome(const struct cell_cluster *cluster, size_t i, char genome[CSIZE]) {
+    memcpy(genome, cluster->cells[i].instructions, CSIZE);
+}
+
+/** Overwrite the instruction cache of the cell at index i with genome. */
+static inline void cell_set_genome(struct cell_cluster *cluster, size_t i, const char genome[CSIZE]) {
+    memcpy(cluster->cells[i].instructions, genome, CSIZE);
+    cell_mark(cluster, i);
+}
+
+/** Wipe the cell at index i back to an empty cell. */
+static inline void cell_clear(struct cell_cluster *cluster, size_t i) {
+    memset(&cluster->cells[i], '\0', sizeof(struct cell_proc));
+    cell_mark(cluster, i);
+}
+
+/** Copy the whole cell at index src over the cell at index dst. */
+static inline void cell_copy(struct cell_cluster *cluster, size_t dst, size_t src) {
+    memcpy(&cluster->cells[dst], &cluster->cells[src], sizeof(struct cell_proc));
+    cell_mark(cluster, dst);
+}
+
+/** Copy n cells from index i of one clusters arena to the same place in another's,
+  * without marking them. */
+static inline void cell_copy_span(struct cell_cluster *dst, const struct cell_cluster *src, size_t i, size_t n) {
+    memcpy(&dst->cells[i], &src->cells[i], n * sizeof(struct cell_proc));
+}
+#endif
+
 /**
  * Init a cell_cluster structure, must be done before use to allocate
- * space for the cell array.
+ * space for the cell array. The cluster is seeded with 0, use cluster_seed()
+ * for anything else.
  * @param cluster Cluster to init.
- * @return 0 on ok, 1 on fail.
+ * @param w Width of the grid in cells.
+ * @param h Height of the grid in cells.
+ * @return 0 on ok, 1 on fail if the size is silly or the grid cant be allocated.
+ */
+int cluster_init(struct cell_cluster *cluster, int w, int h);
+
+/**
+ * Point a clusters cell accessors at another arena, laid out and sized like the
+ * one cluster_init() made for it. Used to swap between two grids when double
+ * buffering, the cluster does not take ownership.
+ * @param cluster Cluster to repoint.
+ * @param arena Arena of arena_size bytes.
  */
-int cluster_init(struct cell_cluster *cluster);
+void cluster_set_arena(struct cell_cluster *cluster, void *arena);
 
 /**
  * Free a cell_cluster structure init'd with cluster_init.
@@ -124,29 +603,174 @@ void cluster_free(struct cell_cluster *cluster);
 
 /**
  * Reset a cell_cluster to its default state before it was ran
- * preserving various data such as callback assignments.
+ * preserving various data such as callback assignments and the
+ * random number generator, which carries on from where it was.
+ * Costs the same whatever the grid size, the cells get a fresh arena
+ * and the old one is unmapped by a thread kept for the cluster. Only one
+ * old arena is ever waiting on it, a reset that comes before the last one
+ * has been unmapped waits for it.
  * @param cluster Cluster structure to reset.
  * @return 0 ok, 1 fail.
  */
 int cluster_reset(struct cell_cluster *cluster);
 
 /**
- * Scheduler, hands processes over to proc_cell for processing.
+ * Core cell logic processor, runs the instructions of the cell at the given co-ords.
+ * Safe to call from several threads at once as long as no two calls are within
+ * two cells of each other.
+ * @param cluster Cluster with the cell to compute.
+ * @param ctx Execution context of the calling thread.
+ * @param x Horizontal co-ords of the cell.
+ * @param y Vertical co-ords of the cell.
+ * @param didstuff Set to 1 if the cell had energy to run.
+ * @return 0 on success, 1 on fail.
+ */
+int proc_cell(struct cell_cluster *cluster, struct cell_ctx *ctx, int x, int y, char *didstuff);
+
+/**
+ * Reap a cell if it has no energy left.
+ * @param cluster Cluster to reap cell from.
+ * @param ctx Execution context of the calling thread.
+ * @param x X coord of the cell.
+ * @param y Y coord of the cell.
+ * @return 0 if the cell was reaped, 1 otherwise.
+ */
+int cell_reap(struct cell_cluster *cluster, struct cell_ctx *ctx, int x, int y);
+
+/**
+ * Turn tracking of which cells change on or off, see cell_cluster.dirty. Turning
+ * it on marks every cell, cluster_reset() keeps it on.
+ * @param cluster Cluster to track.
+ * @param on Set to track changes, 0 to stop and free the maps.
+ */
+void cluster_track_dirty(struct cell_cluster *cluster, int on);
+
+/**
+ * Build the live cell index from scratch and start keeping it up to date.
+ * @param cluster Cluster to index.
+ */
+void cluster_live_rebuild(struct cell_cluster *cluster);
+
+/**
+ * Seed every random number the cluster uses from now on, two clusters given
+ * the same seed and the same inputs will run identically.
+ * @param cluster Cluster to seed.
+ * @param seed Seed value.
+ */
+void cluster_seed(struct cell_cluster *cluster, unsigned long seed);
+
+/**
+ * Wire the grid up as one of CELL_TOPOLOGIES, clusters start as TOPO_VONNEUMANN.
+ * @param cluster Cluster to change.
+ * @param topology One of CELL_TOPOLOGIES.
+ * @return 0 ok, 1 if the grid cant be wired that way.
+ */
+int cluster_set_topology(struct cell_cluster *cluster, int topology);
+
+/**
+ * Find a topology by name, "vonneumann", "moore" or "hex".
+ * @param name Name of the topology.
+ * @return One of CELL_TOPOLOGIES, -1 if there is no such topology.
+ */
+int topology_find(const char *name);
+
+/**
+ * Set how cells get mutated when they SPOR.
+ * @param cluster Cluster to change.
+ * @param rate 1/rate odds of each instruction or bit mutating, 0 for none.
+ * @param mode One of MUTATION_MODES.
+ */
+void cluster_set_mutation(struct cell_cluster *cluster, unsigned long rate, int mode);
+
+/**
+ * Set up an execution context for running cells of a cluster, without a
+ * translation cache or trace.
+ * @param ctx Context to set up.
+ * @param cluster Cluster the context will run cells of.
+ * @param stats Counters the context should update.
+ * @param seed Seed for the contexts generator.
+ * @param stream Stream of the contexts generator.
+ */
+void cell_ctx_init(struct cell_ctx *ctx, const struct cell_cluster *cluster, struct cluster_stats *stats,
+                   unsigned long seed, unsigned long stream);
+
+/**
+ * Scheduler, hands processes over to proc_cell for processing. Steps the whole
+ * grid with cluster_step() if cluster->sched_mode is SCHED_SYNC, runs the tiled
+ * scheduler from cellsched.h if cluster->threads is above 1, which ignores
+ * SCHED_LIVE, otherwise picks cells as set by cluster->sched_mode.
  * @param cluster Cluster containing cell processes to schedule.
  * @return 0
  */
 int cluster_sched(struct cell_cluster *cluster);
 
+/** Tick budget of a run, see cluster_budget(). */
+struct cell_budget {
+    /** Cluster to stop. */
+    struct cell_cluster *cluster;
+    /** Tick to stop at. */
+    unsigned long end;
+    /** Callback slot checking it. */
+    int slot;
+};
+
+/**
+ * Stop the scheduler once a number of ticks have ran, thru a callback so it
+ * holds for every scheduler. The callback is only checked where the scheduler
+ * does callbacks, so running a cell at a time stops on exactly the budget but
+ * tiled rounds, SCHED_LIVE skips over empty cells and SCHED_SYNC generations
+ * stop at the first check past it. cluster->tick is what really ran.
+ * @param cluster Cluster to stop.
+ * @param budget Budget to fill in, has to outlive the run.
+ * @param ticks Ticks from now to stop after, at least 1.
+ * @return 0 ok, 1 fail.
+ */
+int cluster_budget(struct cell_cluster *cluster, struct cell_budget *budget, unsigned long ticks);
+
+/**
+ * Run the scheduler for a number of ticks, see cluster_budget().
+ * @param cluster Cluster to run.
+ * @param ticks Ticks to run for, at least 1.
+ * @return 0 ok, 1 fail.
+ */
+int cluster_run(struct cell_cluster *cluster, unsigned long ticks);
+
+/**
+ * Seconds on a monotonic clock, for timing runs.
+ * @return Seconds since some fixed point.
+ */
+double clock_seconds(void);
+
+/**
+ * Step the whole grid one generation synchronously, on cluster->threads threads.
+ * Every live cell runs once against the grid as it was at the start of the step,
+ * what they do to their neighbours is collected and resolved into the next grid,
+ * then the grids are swapped. The result only depends on the cluster and not on
+ * the number of threads, see cellsched.h for how conflicts are resolved. Adds
+ * area to the tick and does the callbacks crossed like the tiled scheduler.
+ * @param cluster Cluster to step.
+ * @return 0 ok, 1 fail.
+ */
+int cluster_step(struct cell_cluster *cluster);
+
+/**
+ * Add one set of counters onto another.
+ * @param dst Counters to add to.
+ * @param src Counters to add.
+ */
+void cluster_stats_add(struct cluster_stats *dst, const struct cluster_stats *src);
+
 /**
  * Get the coordenents of the neighbour reletive to cell at x,y.
+ * @param cluster Cluster the cell is in.
  * @param x x coord of the cell to get neighbour from.
  * @param y y coord of the cell.
  * @param direction Direction to look for the neighbour.
  * @param xp Pointer to store the x location of neighbour.
  * @param yp Pointer to store the y location of neighbour.
- * @return 0 on ok, 1 on fail.
+ * @return 0 on ok, -1 if the direction isnt one the topology has.
  */
-int get_neighbour_coords(int x, int y, int direction, int *xp, int *yp);
+int get_neighbour_coords(const struct cell_cluster *cluster, int x, int y, int direction, int *xp, int *yp);
 
 /**
  * Populate the cell at the co-ords specified with the cell attributes also specified.
@@ -157,7 +781,7 @@ int get_neighbour_coords(int x, int y, int direction, int *xp, int *yp);
  * @param energy Cell energy level.
  * @param instructions Cell instruction set.
  */
-void cell_pop(const struct cell_cluster *cluster, int x, int y, int gen, int energy, const char instructions[CSIZE]);
+void cell_pop(struct cell_cluster *cluster, int x, int y, int gen, int energy, const char instructions[CSIZE]);
 
 /**
  * Seed the cell at the coo-ords speicfied with random cell attributes.
@@ -165,9 +789,20 @@ void cell_pop(const struct cell_cluster *cluster, int x, int y, int gen, int ene
  * @param x x coord of the cell.
  * @param y y coord of the cell.
  */
-void cell_seed(const struct cell_cluster *cluster, int x, int y);
+void cell_seed(struct cell_cluster *cluster, int x, int y);
 
-void cell_mutate(const struct cell_cluster *cluster, int x, int y, unsigned long chance);
+/**
+ * Randomly mutate the instructions of the cell at the co-ords specified, as set up
+ * by cluster_set_mutation(). Rather than rolling for every instruction the gap to
+ * the next mutation is sampled from a geometric distribution and carried over in
+ * the ctx, which gives the same odds for a fraction of the random numbers.
+ * @param cluster Cluster with the cell.
+ * @param ctx Execution context of the calling thread.
+ * @param x x coord of the cell.
+ * @param y y coord of the cell.
+ * @return Number of mutations made.
+ */
+int cell_mutate(struct cell_cluster *cluster, struct cell_ctx *ctx, int x, int y);
 
 #endif
 
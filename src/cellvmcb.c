@@ -3,69 +3,263 @@
  *  can be pushed into the callback stack and ran every X clock ticks.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include "cellvmcb.h"
 #include "config.h"
 
 /**
- * Get the next free callback slot avalible in the callback_stack.
- * @param stack Stack to get slot from.
- * @return Slot number free on success, -1 on fail.
+ * Swap two heap entries, keeping their slots heap_pos right.
+ */
+static void heap_swap(struct callback_stack *stack, int a, int b) {
+    int tmp = stack->heap[a];
+
+    stack->heap[a] = stack->heap[b];
+    stack->heap[b] = tmp;
+    stack->slots[stack->heap[a]].heap_pos = a;
+    stack->slots[stack->heap[b]].heap_pos = b;
+}
+
+/**
+ * Due tick of a heap entry.
+ */
+static unsigned long heap_due(const struct callback_stack *stack, int pos) {
+    return stack->slots[stack->heap[pos]].due;
+}
+
+/**
+ * Move a heap entry up or down till the heap is in order again.
+ * @param stack Stack the heap is in.
+ * @param pos Position of the entry that changed.
  */
-static int get_slot(const struct callback_stack *stack) {
-    int i, ret;
+static void heap_fix(struct callback_stack *stack, int pos) {
+    int child;
 
-    for (ret = -1, i = 0; i < CB_MAX; i++) {
-        if (!stack->is_active[i]) {
-            ret = i;
+    while (pos > 0 && heap_due(stack, pos) < heap_due(stack, (pos - 1) / 2)) {
+        heap_swap(stack, pos, (pos - 1) / 2);
+        pos = (pos - 1) / 2;
+    }
+    while ((child = pos * 2 + 1) < stack->nheap) {
+        if (child + 1 < stack->nheap && heap_due(stack, child + 1) < heap_due(stack, child))
+            child++;
+        if (heap_due(stack, pos) <= heap_due(stack, child))
             break;
-        }
+        heap_swap(stack, pos, child);
+        pos = child;
     }
-    return ret;
+    stack->next_due = stack->nheap ? heap_due(stack, 0) : ULONG_MAX;
 }
 
-int add_callback(struct callback_stack *stack, callback_fptr function, unsigned int freq, char *symbol) {
-    int slot;
+/**
+ * Get the next free callback slot, growing the stack if there are none.
+ * @param stack Stack to get slot from.
+ * @return Slot number.
+ */
+static int get_slot(struct callback_stack *stack) {
+    int i;
+
+    for (i = 0; i < stack->nslots; i++)
+        if (stack->slots[i].heap_pos == -1)
+            return i;
+
+    /* Full up, the heap never holds more than there are slots. */
+    if (!(stack->slots = realloc(stack->slots, (stack->nslots + 1) * sizeof *stack->slots)) ||
+        !(stack->heap = realloc(stack->heap, (stack->nslots + 1) * sizeof *stack->heap)))
+        exit(1);
+    return stack->nslots++;
+}
+
+/**
+ * Add a slot to the stack, see add_callback().
+ */
+static int add_slot(struct callback_stack *stack, callback_fptr function, callback_batch_fptr batch,
+                    unsigned long freq, void *userdata) {
     struct callback_slot *ptr;
+    int slot;
 
-    /* Get the next free slot, bail if there is none. */
-    if ((slot = get_slot(stack)) == -1)
+    if (!freq)
         return -1;
 
-    ptr = &stack->callbacks[slot];
+    slot = get_slot(stack);
+    ptr = &stack->slots[slot];
+    memset(ptr, '\0', sizeof *ptr);
     ptr->function = function;
+    ptr->batch = batch;
     ptr->frequency = freq;
+    ptr->userdata = userdata;
+    ptr->mark = stack->nlog;
 
-    /* Set the entry for this slot in the active table to true. */
-    stack->is_active[slot] = 1;
+    /* Due straight away, the first run works out when its really due. */
+    ptr->due = 0;
+    ptr->heap_pos = stack->nheap;
+    stack->heap[stack->nheap++] = slot;
+    heap_fix(stack, ptr->heap_pos);
+    return slot;
+}
 
+int add_callback(struct callback_stack *stack, callback_fptr function, unsigned long freq, void *userdata, char *symbol) {
+    int slot;
+
+    if ((slot = add_slot(stack, function, NULL, freq, userdata)) == -1)
+        return -1;
 #ifdef DEBUG
-    printf("Callback slot %d/%d assigned, freq:1/%d, address:%p symbol:%s\n", slot, CB_MAX, freq, function, symbol);
+    printf("Callback slot %d assigned, freq:1/%lu, address:%p symbol:%s\n", slot, freq, function, symbol);
 #endif
+    return slot;
+}
 
+int add_batch_callback(struct callback_stack *stack, callback_batch_fptr function, unsigned long freq, void *userdata, char *symbol) {
+    int slot;
+
+    if ((slot = add_slot(stack, NULL, function, freq, userdata)) == -1)
+        return -1;
+    stack->nbatch++;
+#ifdef DEBUG
+    printf("Batched callback slot %d assigned, freq:1/%lu, address:%p symbol:%s\n", slot, freq, function, symbol);
+#endif
     return slot;
 }
 
 int del_callback(struct callback_stack *stack, int slot) {
-    /* If the slots not active this request is bullshit so dont do anything
-     * if it is we set it to not active, deleting the structure it self is redundent as
-     * all callbacks are checked against the active list first anyway. */
-    if (stack->is_active[slot]) {
-        stack->is_active[slot] = 0;
+    struct callback_slot *ptr;
+    int pos;
+
+    /* If the slots not active this request is bullshit so dont do anything. */
+    if (slot < 0 || slot >= stack->nslots || (pos = stack->slots[slot].heap_pos) == -1)
+        return 1;
+    ptr = &stack->slots[slot];
+
+    /* Move the last entry into the hole and put it in its place. */
+    if (pos != --stack->nheap) {
+        heap_swap(stack, pos, stack->nheap);
+        ptr->heap_pos = -1;
+        heap_fix(stack, pos);
+    } else {
+        ptr->heap_pos = -1;
+        stack->next_due = stack->nheap ? heap_due(stack, 0) : ULONG_MAX;
+    }
+    if (ptr->batch && !--stack->nbatch)
+        stack->nlog = 0;
 #ifdef DEBUG
-        printf("Callback slot %d removed, address:%p\n", slot, stack->callbacks[slot].function);
+    printf("Callback slot %d removed\n", slot);
 #endif
-        return 0;
-    } else
-        return 1;
+    return 0;
+}
+
+void free_callbacks(struct callback_stack *stack) {
+    free(stack->slots);
+    free(stack->heap);
+    free(stack->log);
+    memset(stack, '\0', sizeof *stack);
+}
+
+void rewind_callbacks(struct callback_stack *stack) {
+    int i;
+
+    /* 0 is before every tick so keeps the heap in order. */
+    for (i = 0; i < stack->nheap; i++)
+        stack->slots[stack->heap[i]].due = 0;
+    stack->next_due = 0;
+}
+
+/**
+ * Hand a batched callback the coords logged since it last ran.
+ * @param stack Stack the callback is in.
+ * @param slot Slot of the callback.
+ */
+static void run_batch(struct callback_stack *stack, int slot) {
+    struct callback_slot *ptr = &stack->slots[slot];
+    size_t mark = ptr->mark;
+
+    ptr->mark = stack->nlog;
+    ptr->batch(ptr->userdata, stack->log + mark, stack->nlog - mark);
+}
+
+/**
+ * Drop the coords every batched callback has been handed.
+ * @param stack Stack to trim the log of.
+ */
+static void trim_log(struct callback_stack *stack) {
+    size_t low = stack->nlog;
+    int i;
+
+    for (i = 0; i < stack->nheap; i++)
+        if (stack->slots[stack->heap[i]].batch && stack->slots[stack->heap[i]].mark < low)
+            low = stack->slots[stack->heap[i]].mark;
+    if (!low)
+        return;
+
+    memmove(stack->log, stack->log + low, (stack->nlog - low) * sizeof *stack->log);
+    stack->nlog -= low;
+    for (i = 0; i < stack->nheap; i++)
+        if (stack->slots[stack->heap[i]].batch)
+            stack->slots[stack->heap[i]].mark -= low;
 }
 
-int do_callbacks(const struct callback_stack *stack, unsigned long reltick, int x, int y, char didstuff) {
+void log_callback_coord(struct callback_stack *stack, int x, int y) {
     int i;
 
-    for (i = 0; i < CB_MAX; i++)
-        /* If the callback slot is active and it is the right tick % freqnecy. */
-        if (stack->is_active[i] && (!(reltick % stack->callbacks[i].frequency)))
-            stack->callbacks[i].function(x,y, didstuff);
+    if (x < 0)
+        return;
+    if (stack->nlog == stack->maxlog) {
+        if (stack->maxlog < CB_LOG_MAX) {
+            stack->maxlog = stack->maxlog ? stack->maxlog * 2 : 256;
+            if (!(stack->log = realloc(stack->log, stack->maxlog * sizeof *stack->log)))
+                exit(1);
+        } else {
+            /* Full, hand everyone what they have early rather than lose any. */
+            for (i = 0; i < stack->nheap; i++)
+                if (stack->slots[stack->heap[i]].batch && stack->slots[stack->heap[i]].mark < stack->nlog)
+                    run_batch(stack, stack->heap[i]);
+            stack->nlog = 0;
+            for (i = 0; i < stack->nheap; i++)
+                stack->slots[stack->heap[i]].mark = 0;
+        }
+    }
+    stack->log[stack->nlog].x = x;
+    stack->log[stack->nlog].y = y;
+    stack->nlog++;
+}
+
+int do_callbacks_span(struct callback_stack *stack, unsigned long from, unsigned long to, int x, int y, char didstuff) {
+    struct callback_slot *ptr;
+    callback_fptr function;
+    void *userdata;
+    unsigned long freq;
+    int slot, batched = 0;
+
+    if (from >= to)
+        return 0;
+    if (!stack->nheap) {
+        stack->next_due = ULONG_MAX;
+        return 0;
+    }
+
+    while (stack->nheap && stack->next_due < to) {
+        slot = stack->heap[0];
+        ptr = &stack->slots[slot];
+        freq = ptr->frequency;
+
+        /* Is there a multiple of the frequency in the span, due is only ever
+         * early so it may not be. Move it on before calling it as the callback
+         * can add and remove others. */
+        ptr->due = ((to - 1) / freq + 1) * freq;
+        heap_fix(stack, 0);
+        if ((to - 1) / freq * freq < from)
+            continue;
+
+        if (ptr->batch) {
+            run_batch(stack, slot);
+            batched = 1;
+        } else {
+            function = ptr->function;
+            userdata = ptr->userdata;
+            function(userdata, x, y, didstuff);
+        }
+    }
+    if (batched)
+        trim_log(stack);
 
     return 0;
 }
@@ -1,31 +1,64 @@
 /** @file
  *  A callback system for the cellvm, functions and times
  *  can be pushed into the callback stack and ran every X clock ticks.
+ *
+ *  Callbacks are kept in a min-heap on the next tick they are due, so a tick
+ *  where nothing is due costs one compare no matter how many are registered.
+ *  Batched callbacks get every cell that did something since their last call
+ *  in one array rather than being called per tick.
  */
 #ifndef _CELLVMCB_H
 #define _CELLVMCB_H
 
-/** MAX callback stack size. */
-#define CB_MAX 3
+#include <stddef.h>
+
+/** Most coords kept for batched callbacks, they get called early if it fills. */
+#define CB_LOG_MAX 65536
+
+/** A cell passed to batched callbacks. */
+struct callback_coord {
+    int x, y;
+};
 
 /** Prototype for the callback function. */
-typedef void(*callback_fptr)(int x, int y, char didstuff);
+typedef void(*callback_fptr)(void *userdata, int x, int y, char didstuff);
+
+/** Prototype for batched callback functions, coords are in the order the cells ran. */
+typedef void(*callback_batch_fptr)(void *userdata, const struct callback_coord *coords, size_t n);
 
 /** Holds a single callbacks information. */
 struct callback_slot {
     /** How many clockticks should occour between callbacks. */
-    unsigned int frequency;
-    /** Function to call. */
+    unsigned long frequency;
+    /** Next tick the callback could be due, only ever early. */
+    unsigned long due;
+    /** Function to call, one of these is set. */
     callback_fptr function;
+    callback_batch_fptr batch;
+    /** Passed to the function. */
+    void *userdata;
+    /** Where in the log the coords for the next batch start. */
+    size_t mark;
+    /** Position in the heap, -1 if the slot is free. */
+    int heap_pos;
 };
 
-/** Stores callbacks and metadata used for managing their add/removal. */
+/** Stores callbacks and metadata used for managing their add/removal. All
+  * zeroes is an empty stack. */
 struct callback_stack {
-    /** Array of callback structures. */
-    struct callback_slot callbacks[CB_MAX];
-    /** Table of active slots, value of 1 if the slot with the same
-      * index number is active, 0 if its avalible. */
-    char is_active[CB_MAX];
+    /** Array of callback structures, slot numbers index it. */
+    struct callback_slot *slots;
+    int nslots;
+    /** Slot numbers of the active callbacks, a min-heap on due. */
+    int *heap;
+    int nheap;
+    /** Due tick of the top of the heap, callbacks are skipped till then. */
+    unsigned long next_due;
+    /** Cells that did something since the oldest batched callback ran. */
+    struct callback_coord *log;
+    size_t nlog, maxlog;
+    /** Active batched callbacks, nothing is logged without any. */
+    int nbatch;
 };
 
 /**
@@ -33,10 +66,24 @@ struct callback_stack {
  * @param stack Callback stack to append to.
  * @param function Function that should be called.
  * @param freq Amount of clock ticks between callbacks.
+ * @param userdata Passed to the function.
  * @param symbol Symbol name of callback function. (anything contextually meaningful)
  * @return Slot number callback was allocated, -1 on fail.
  */
-int add_callback(struct callback_stack *stack, callback_fptr function, unsigned int freq, char *symbol);
+int add_callback(struct callback_stack *stack, callback_fptr function, unsigned long freq, void *userdata, char *symbol);
+
+/**
+ * Add a batched callback, its called every freq ticks with each cell that did
+ * something since it was last called. Cells ran by the tiled and live schedulers
+ * in bulk are not logged.
+ * @param stack Callback stack to append to.
+ * @param function Function that should be called.
+ * @param freq Amount of clock ticks between callbacks.
+ * @param userdata Passed to the function.
+ * @param symbol Symbol name of callback function. (anything contextually meaningful)
+ * @return Slot number callback was allocated, -1 on fail.
+ */
+int add_batch_callback(struct callback_stack *stack, callback_batch_fptr function, unsigned long freq, void *userdata, char *symbol);
 
 /**
  * Deletes a callback from the stack.
@@ -47,11 +94,53 @@ int add_callback(struct callback_stack *stack, callback_fptr function, unsigned
 int del_callback(struct callback_stack *stack, int slot);
 
 /**
- * Iterate thru the callback structure and run them.
+ * Free everything a stack allocated, leaving it empty.
+ * @param stack Stack to free.
+ */
+void free_callbacks(struct callback_stack *stack);
+
+/**
+ * Make every callback due again, for when the tick goes back to 0.
+ * @param stack Stack to rewind.
+ */
+void rewind_callbacks(struct callback_stack *stack);
+
+/**
+ * Log a cell for the batched callbacks, see do_callbacks().
+ * @param stack Stack to log to.
+ * @param x x coord of the cell.
+ * @param y y coord of the cell.
+ */
+void log_callback_coord(struct callback_stack *stack, int x, int y);
+
+/**
+ * Run each callback once if any tick in [from, to) would have triggered it, for
+ * schedulers that advance more than one tick at a time.
+ * @param stack Stack to run callbacks from.
+ * @param from First tick of the span.
+ * @param to One past the last tick of the span.
+ * @param x x coord passed to the callbacks, -1 if the span covers many cells.
+ * @param y y coord passed to the callbacks, -1 if the span covers many cells.
+ * @param didstuff Passed to the callbacks.
+ * @return 0 ok, 1 fail
+ */
+int do_callbacks_span(struct callback_stack *stack, unsigned long from, unsigned long to, int x, int y, char didstuff);
+
+/**
+ * Run the callbacks due on a tick, ran after every cell.
  * @param stack Stack to run callbacks from.
  * @param reltick The current tick interval.
+ * @param x x coord of the cell that ran.
+ * @param y y coord of the cell that ran.
+ * @param didstuff Set if the cell did anything, its logged for batched callbacks.
  * @return 0 ok ,1 fail
  */
-int do_callbacks(const struct callback_stack *stack, unsigned long reltick, int x, int y, char didstuff);
+static inline int do_callbacks(struct callback_stack *stack, unsigned long reltick, int x, int y, char didstuff) {
+    if (stack->nbatch && didstuff)
+        log_callback_coord(stack, x, y);
+    if (reltick < stack->next_due)
+        return 0;
+    return do_callbacks_span(stack, reltick, reltick + 1, x, y, didstuff);
+}
 
 #endif
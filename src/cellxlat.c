@@ -0,0 +1,72 @@
+/** @file
+ * Genome translation cache for the cellvm, see cellxlat.h.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "cellxlat.h"
+
+/** Kind of xop each instruction decodes to, XOP_END for the pure ones. */
+static const unsigned char xop_kinds[IEND] = {
+    [STOP] = XOP_STOP, [CRCH] = XOP_CRCH, [KILL] = XOP_KILL,
+    [SHAR] = XOP_SHAR, [SPOR] = XOP_SPOR, [RDIR] = XOP_RDIR
+};
+
+struct xcache *xcache_new(int ndirs) {
+    struct xcache *cache;
+
+    if (!(cache = calloc(1, sizeof *cache)))
+        exit(1);
+    cache->ndirs = ndirs;
+    return cache;
+}
+
+void xcache_free(struct xcache *cache) {
+    free(cache);
+}
+
+void xlat_decode(const char genome[CSIZE], struct xprog *prog, int ndirs) {
+    struct xop *op;
+    int pc, reg, npure, dir, kind;
+
+    memcpy(prog->key, genome, CSIZE);
+    prog->state = 2;
+    op = prog->ops;
+    reg = npure = 0;
+    dir = -1;
+
+    for (pc = 0; pc < CSIZE; pc++) {
+        kind = (genome[pc] >= 0 && genome[pc] < IEND) ? xop_kinds[(int)genome[pc]] : XOP_END;
+
+        /* Pure instructions just get tracked, invalid opcodes act as NOOP. */
+        if (kind == XOP_END) {
+            if (genome[pc] == INCR)
+                reg++;
+            else if (genome[pc] == DNCR && reg > 0)
+                reg--;
+            else if (genome[pc] == ZERO)
+                reg = 0;
+            else if (genome[pc] == TURN && reg < ndirs)
+                dir = reg;
+            npure++;
+            continue;
+        }
+
+        op->npure = npure;
+        op->dir = dir;
+        op->kind = kind;
+        op->pc = pc;
+        op->reg = reg;
+        /* Nothing after a STOP can ever run. */
+        if (op++->kind == XOP_STOP)
+            return;
+        npure = 0;
+        dir = -1;
+    }
+
+    op->npure = npure;
+    op->dir = dir;
+    op->kind = XOP_END;
+    op->pc = CSIZE;
+    op->reg = reg;
+}
@@ -0,0 +1,127 @@
+/** @file
+ * Genome translation cache for the cellvm. A genome only changes when it gets
+ * mutated, so rather than interpreting the raw instructions every time a cell
+ * runs they are decoded once into a short list of xops and cached by content.
+ *
+ * reg0 starts at 0 every run and only INCR, DNCR and ZERO touch it, so its value
+ * at every instruction is known when decoding. That makes every run of pure
+ * instructions (NOOP, INCR, DNCR, ZERO, TURN) fold down to "spend n energy and
+ * maybe set a known direction", which is fused onto the instruction with an
+ * effect that follows it. Anything after a STOP is dropped.
+ */
+#ifndef _CELLXLAT_H
+#define _CELLXLAT_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "cellvm.h"
+
+#if CSIZE % 8
+#error "cellxlat hashes genomes a word at a time, CSIZE must be a multiple of 8"
+#endif
+
+/** log2 of the number of genomes a translation cache holds. */
+#define XCACHE_BITS 8
+/** Number of genomes a translation cache holds. */
+#define XCACHE_SIZE (1 << XCACHE_BITS)
+
+/** Kinds of decoded instruction. */
+enum XOP_KINDS {
+    /** Ran off the end of the instruction cache. */
+    XOP_END,
+    XOP_STOP,
+    XOP_CRCH,
+    XOP_KILL,
+    XOP_SHAR,
+    XOP_SPOR,
+    XOP_RDIR
+};
+
+/** A decoded instruction with the pure instructions before it folded in. */
+struct xop {
+    /** Pure instructions ran before this one, each costs an energy. */
+    unsigned char npure;
+    /** Direction the pure instructions leave set, -1 if they dont TURN. */
+    signed char dir;
+    /** One of XOP_KINDS. */
+    unsigned char kind;
+    /** Position of the instruction in the genome. */
+    unsigned char pc;
+    /** Value of reg0 at this instruction. */
+    unsigned char reg;
+};
+
+/** A decoded genome. */
+struct xprog {
+    /** Genome this was decoded from, the cache key, as words for comparing. */
+    uint64_t key[CSIZE / 8];
+    /** 0 when empty, 1 when the key has been seen once, 2 once decoded. */
+    char state;
+    /** Decoded instructions, always ending in XOP_STOP or XOP_END. */
+    struct xop ops[CSIZE + 1];
+};
+
+/** Direct mapped cache of decoded genomes, one per thread. */
+struct xcache {
+    /** Cache entries, indexed by a hash of the genome. */
+    struct xprog progs[XCACHE_SIZE];
+    /** Directions of the topology the genomes are decoded for. */
+    int ndirs;
+};
+
+/**
+ * Allocate an empty translation cache.
+ * @param ndirs Directions of the clusters topology, TURNs past it are NOOPs.
+ * @return The cache, exits on fail like cluster_init.
+ */
+struct xcache *xcache_new(int ndirs);
+
+/**
+ * Free a translation cache from xcache_new().
+ * @param cache Cache to free.
+ */
+void xcache_free(struct xcache *cache);
+
+/**
+ * Decode a genome into a list of xops.
+ * @param genome Genome to decode.
+ * @param prog Where to store the result.
+ * @param ndirs Directions of the clusters topology.
+ */
+void xlat_decode(const char genome[CSIZE], struct xprog *prog, int ndirs);
+
+/**
+ * Get the decoded form of a genome. Genomes are only decoded the second time
+ * they are looked up in a row, so one off mutants that would only thrash the
+ * cache are left to the interpreter.
+ * @param cache Cache to look in.
+ * @param genome Genome to look up.
+ * @return The decoded genome, valid until the next lookup, or NULL if the
+ *         genome should be interpreted this time.
+ */
+static inline const struct xprog *xcache_lookup(struct xcache *cache, const char genome[CSIZE]) {
+    struct xprog *prog;
+    uint64_t hash, diff, key[CSIZE / 8];
+    int i;
+
+    memcpy(key, genome, CSIZE);
+    for (hash = 0, i = 0; i < CSIZE / 8; i++)
+        hash = (hash ^ key[i]) * 0x9e3779b97f4a7c15ULL;
+    prog = &cache->progs[hash >> (64 - XCACHE_BITS)];
+
+    for (diff = 0, i = 0; i < CSIZE / 8; i++)
+        diff |= prog->key[i] ^ key[i];
+    if (!diff && prog->state == 2)
+        return prog;
+
+    if (diff || !prog->state) {
+        memcpy(prog->key, key, CSIZE);
+        prog->state = 1;
+        return NULL;
+    }
+    xlat_decode(genome, prog, cache->ndirs);
+    return prog;
+}
+
+#endif
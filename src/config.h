@@ -15,6 +15,35 @@
 
 #define ARTIFICIAL_LIMIT 0
 
+/** Defined if the cell grid should be stored as seperate gen, energy and
+ *  instruction arrays (structure of arrays) instead of one array of cell_proc. */
+//#define CELL_SOA
+
+/** Defined if cells should be packed into half the space, 32 bit generations
+ *  and energy that saturate rather than wrap and instructions 4 bits each.
+ *  Any instruction is below 16 so nothing is lost but the top of the counters.
+ *  Cant be used with CELL_SOA. */
+//#define CELL_PACKED
+
+/** Defined if the cell VM should use PCG32 rather than xoshiro256** for
+ *  its random numbers. */
+//#define RNG_PCG32
+
+/** Defined if cells should be ran from the decoded genome cache in cellxlat.h
+ *  rather than interpreted, ignored when DEBUG is defined. */
+#define CELL_XCACHE
+
+/** Defined if the event hooks in celltrace.h are compiled into the VM, nothing
+ *  is recorded unless a trace is attached to a context. */
+#define CELL_TRACE
+
+/** Defined if the opcode profiler in cellprof.h is compiled into the VM, cells
+ *  are only profiled while a profile is attached to a context. */
+#define CELL_PROF
+
+/** Alignment of the cell arena, should be the cache line size. */
+#define CELL_ALIGN 64
+
 /** Defined if SDL dispaly output/input collection is enabled. */
 #define SDL_DISPLAY
 
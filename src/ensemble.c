@@ -0,0 +1,407 @@
+/** @file
+ *  Ensemble entry point, runs a sweep of independent headless worlds over a
+ *  grid of parameters on every core and writes a line of summary stats per run.
+ *
+ *  Each run is a whole cluster with its own callbacks, translation cache and
+ *  generator, scheduled single threaded start to finish on one worker. Runs
+ *  are dealt out to the workers in contiguous ranges, a worker that runs out
+ *  steals the back half of the range of another so slow runs dont leave cores
+ *  idle at the end of a sweep.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "cellvm.h"
+#include "cellgenome.h"
+#include "cellstats.h"
+
+/** Most values a swept parameter can take. */
+#define ENS_MAXVALS 64
+
+/** Settings of one run of the sweep. */
+struct ens_run {
+    /** Seed of the run. */
+    unsigned long seed;
+    /** Energy the starting cells get. */
+    unsigned long energy;
+    /** Mutation rate, see cluster_set_mutation(). */
+    unsigned long mutation;
+};
+
+/** Range of runs a worker has left. The owner takes from the front, thieves
+ *  take the back half. */
+struct ens_queue {
+    pthread_mutex_t lock;
+    /** Next run to take and one past the last. */
+    size_t next, end;
+};
+
+/** Whole sweep, shared by the workers. */
+struct ens_sweep {
+    /** Every run in the sweep. */
+    struct ens_run *runs;
+    size_t nruns;
+    /** Queue of each worker. */
+    struct ens_queue *queues;
+    int nworkers;
+    /** Grid size, tick budget and mutation mode of every run. */
+    int w, h;
+    unsigned long ticks;
+    int mutmode;
+    /** Genomes to start each run with, the GUI set if there are none. */
+    const char **genomes;
+    int ngenomes;
+    /** Each run exports its stats to this plus the run number and .csv if set. */
+    const char *stats_prefix;
+    unsigned long stats_every;
+    /** Where the results go, guarded by out_lock. */
+    FILE *out;
+    pthread_mutex_t out_lock;
+    /** Set if any run failed. */
+    char failed;
+};
+
+/** Arguments of a worker thread. */
+struct ens_worker {
+    /** Sweep the worker belongs to. */
+    struct ens_sweep *sweep;
+    /** Worker number, also the queue it owns. */
+    int id;
+};
+
+/**
+ * Print program usage information to console.
+ * @param name Name the program was run as.
+ */
+static void print_help(const char *name) {
+    printf("Silicion Genesis %s (ensemble)\n", SGVER);
+    printf("Usage: %s [options]\n", name);
+    printf("\t-j workers\tWorker threads (default every online core).\n");
+    printf("\t-r runs\t\tRuns of each parameter combination, seeded seed..seed+runs-1 (default 1).\n");
+    printf("\t-s seed\t\tFirst seed (default time).\n");
+    printf("\t-t ticks\tTicks each run goes for (default 10000000).\n");
+    printf("\t-x width\tGrid width (default %d).\n", DEFAULTX);
+    printf("\t-y height\tGrid height (default %d).\n", DEFAULTY);
+    printf("\t-e list\t\tComma separated starting energies to sweep (default %d).\n", ENERGY);
+    printf("\t-m list\t\tComma separated mutation rates to sweep (default %d).\n", MUTATIONRATE);
+    printf("\t-B\t\tMutate single bits rather than whole instructions.\n");
+    printf("\t-g genome\tStart runs with this genome, can be repeated (default the GUI set).\n");
+    printf("\t-S prefix\tExport each runs stats every -I ticks to prefix<run>.csv.\n");
+    printf("\t-I ticks\tTicks between stats rows (default 1000000).\n");
+    printf("\t-o file\t\tWrite the results here rather than stdout.\n");
+}
+
+/**
+ * Parse a comma separated list of numbers.
+ * @param str List to parse.
+ * @param vals Where to store the values, ENS_MAXVALS long.
+ * @return Number of values, 0 if the list is bad.
+ */
+static int parse_list(const char *str, unsigned long *vals) {
+    char *end;
+    int n;
+
+    for (n = 0; n < ENS_MAXVALS; n++) {
+        vals[n] = strtoul(str, &end, 0);
+        if (end == str)
+            return 0;
+        if (*end == '\0')
+            return n + 1;
+        if (*end != ',')
+            return 0;
+        str = end + 1;
+    }
+    return 0;
+}
+
+/**
+ * Take the next run for a worker, stealing if its own range is empty.
+ * @param sweep Sweep to take from.
+ * @param id Worker taking a run.
+ * @param run Where to store the run number.
+ * @return 1 if a run was taken, 0 if there are none left.
+ */
+static int take_run(struct ens_sweep *sweep, int id, size_t *run) {
+    struct ens_queue *own = &sweep->queues[id], *victim;
+    size_t mid, end;
+    int i, got = 0;
+
+    pthread_mutex_lock(&own->lock);
+    if (own->next < own->end) {
+        *run = own->next++;
+        got = 1;
+    }
+    pthread_mutex_unlock(&own->lock);
+    if (got)
+        return 1;
+
+    for (i = 1; i < sweep->nworkers; i++) {
+        victim = &sweep->queues[(id + i) % sweep->nworkers];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->next < victim->end) {
+            /* Take the back half, rounded up so a last run can be stolen. */
+            end = victim->end;
+            mid = end - (end - victim->next + 1) / 2;
+            victim->end = mid;
+            got = 1;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (!got)
+            continue;
+
+        /* Only the owner ever adds to a queue, so it cant have changed. */
+        pthread_mutex_lock(&own->lock);
+        own->next = mid + 1;
+        own->end = end;
+        pthread_mutex_unlock(&own->lock);
+        *run = mid;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Run one world of the sweep and write out its results.
+ * @param sweep Sweep the run is in.
+ * @param n Run number.
+ * @param cluster Empty cluster of the sweeps size to run it on, with no callbacks.
+ */
+static void run_world(struct ens_sweep *sweep, size_t n, struct cell_cluster *cluster) {
+    const struct ens_run *run = &sweep->runs[n];
+    struct stats_export stats;
+    char stats_path[PATH_MAX];
+    double secs;
+    unsigned long live, maxgen, gen;
+    size_t i;
+    int g;
+
+    cluster_set_mutation(cluster, run->mutation, sweep->mutmode);
+    cluster_seed(cluster, run->seed);
+    if (sweep->ngenomes) {
+        for (g = 0; g < sweep->ngenomes; g++)
+            cell_pop(cluster, RANDX(cluster), RANDY(cluster), 1, run->energy,
+                     genome_find(sweep->genomes[g])->instructions);
+    } else {
+        genome_pop_defaults(cluster, run->energy);
+    }
+
+    if (sweep->stats_prefix) {
+        if (snprintf(stats_path, sizeof stats_path, "%s%zu.csv", sweep->stats_prefix, n) >= (int)sizeof stats_path ||
+            stats_open(&stats, stats_path, STATS_CSV)) {
+            fprintf(stderr, "Cant write stats for run %zu\n", n);
+            sweep->failed = 1;
+            return;
+        }
+        stats_attach(&stats, cluster, sweep->stats_every);
+    }
+
+    secs = clock_seconds();
+    cluster_run(cluster, sweep->ticks);
+    secs = clock_seconds() - secs;
+
+    if (sweep->stats_prefix && stats_close(&stats, cluster)) {
+        fprintf(stderr, "Stats %s are incomplete\n", stats_path);
+        sweep->failed = 1;
+    }
+
+    for (live = maxgen = 0, i = 0; i < cluster->area; i++) {
+        if ((gen = cell_gen(cluster, i))) {
+            live++;
+            maxgen = gen > maxgen ? gen : maxgen;
+        }
+    }
+
+    pthread_mutex_lock(&sweep->out_lock);
+    fprintf(sweep->out, "%zu,%lu,%lu,%lu,%lu,%.3f,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n",
+            n, run->seed, run->energy, run->mutation, cluster->tick, secs,
+            cluster->stats.instructions, cluster->stats.spor_copies, cluster->stats.energy_death,
+            cluster->stats.crch_deaths, cluster->stats.kill_deaths, cluster->stats.shar_energy,
+            cluster->stats.mutations, live, maxgen);
+    fflush(sweep->out);
+    pthread_mutex_unlock(&sweep->out_lock);
+}
+
+/**
+ * Worker thread, runs worlds until there are none left to take or steal.
+ * @param arg The ens_worker.
+ */
+static void *worker(void *arg) {
+    struct ens_sweep *sweep = ((struct ens_worker *)arg)->sweep;
+    int id = ((struct ens_worker *)arg)->id;
+    struct cell_cluster cluster;
+    int ready = 0;
+    size_t n;
+
+    /* Every world is the same size, so a worker keeps one grid and resets it
+     * between worlds rather than mapping a new one each time. */
+    while (take_run(sweep, id, &n)) {
+        if (ready && cluster_reset(&cluster)) {
+            cluster_free(&cluster);
+            ready = 0;
+        }
+        if (!ready && cluster_init(&cluster, sweep->w, sweep->h)) {
+            fprintf(stderr, "Run %zu cant allocate a %dx%d grid\n", n, sweep->w, sweep->h);
+            sweep->failed = 1;
+            continue;
+        }
+        ready = 1;
+        /* The last worlds budget and stats are no use to this one. */
+        free_callbacks(&cluster.callbacks);
+        run_world(sweep, n, &cluster);
+    }
+    if (ready)
+        cluster_free(&cluster);
+    return NULL;
+}
+
+/**
+ * Application entry point.
+ */
+int main(int argc, char *argv[]) {
+    struct ens_sweep sweep;
+    struct ens_worker *args;
+    pthread_t *threads;
+    unsigned long energies[ENS_MAXVALS], mutations[ENS_MAXVALS], seed, reps;
+    const char *genomes[64], *outpath;
+    int opt, nenergies, nmutations, i, e, m;
+    size_t r, n, per;
+
+    memset(&sweep, '\0', sizeof sweep);
+    sweep.nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    sweep.w = DEFAULTX;
+    sweep.h = DEFAULTY;
+    sweep.ticks = 10000000;
+    sweep.mutmode = MUTATE_OPCODE;
+    sweep.genomes = genomes;
+    sweep.stats_every = 1000000;
+    seed = time(NULL);
+    reps = 1;
+    energies[0] = ENERGY;
+    mutations[0] = MUTATIONRATE;
+    nenergies = nmutations = 1;
+    outpath = NULL;
+
+    while ((opt = getopt(argc, argv, "j:r:s:t:x:y:e:m:Bg:S:I:o:h")) != -1) {
+        switch (opt) {
+        case 'j':
+            sweep.nworkers = atoi(optarg);
+            break;
+        case 'r':
+            reps = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            sweep.ticks = strtoul(optarg, NULL, 0);
+            break;
+        case 'x':
+            sweep.w = atoi(optarg);
+            break;
+        case 'y':
+            sweep.h = atoi(optarg);
+            break;
+        case 'e':
+            if (!(nenergies = parse_list(optarg, energies))) {
+                fprintf(stderr, "Bad energy list %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'm':
+            if (!(nmutations = parse_list(optarg, mutations))) {
+                fprintf(stderr, "Bad mutation list %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'B':
+            sweep.mutmode = MUTATE_BIT;
+            break;
+        case 'g':
+            if (!genome_find(optarg)) {
+                fprintf(stderr, "Unknown genome %s\n", optarg);
+                return 1;
+            }
+            if (sweep.ngenomes < 64)
+                genomes[sweep.ngenomes++] = optarg;
+            break;
+        case 'S':
+            sweep.stats_prefix = optarg;
+            break;
+        case 'I':
+            sweep.stats_every = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            outpath = optarg;
+            break;
+        default:
+            print_help(argv[0]);
+            return 1;
+        }
+    }
+    if (sweep.nworkers < 1 || reps < 1 || sweep.ticks < 1 || sweep.stats_every < 1) {
+        print_help(argv[0]);
+        return 1;
+    }
+    if (!(sweep.out = outpath ? fopen(outpath, "w") : stdout)) {
+        fprintf(stderr, "Cant write %s\n", outpath);
+        return 1;
+    }
+
+    /* Every combination of the swept parameters, each ran with the same seeds so
+     * runs differing only by one parameter can be compared directly. */
+    sweep.nruns = (size_t)nenergies * nmutations * reps;
+    if (!(sweep.runs = malloc(sweep.nruns * sizeof *sweep.runs)))
+        exit(1);
+    for (n = 0, e = 0; e < nenergies; e++) {
+        for (m = 0; m < nmutations; m++) {
+            for (r = 0; r < reps; r++, n++) {
+                sweep.runs[n].seed = seed + r;
+                sweep.runs[n].energy = energies[e];
+                sweep.runs[n].mutation = mutations[m];
+            }
+        }
+    }
+
+    /* Deal the runs out in even ranges, stealing evens out the rest. */
+    if (!(sweep.queues = malloc(sweep.nworkers * sizeof *sweep.queues)) ||
+        !(threads = malloc(sweep.nworkers * sizeof *threads)) ||
+        !(args = malloc(sweep.nworkers * sizeof *args)))
+        exit(1);
+    per = sweep.nruns / sweep.nworkers;
+    for (n = 0, i = 0; i < sweep.nworkers; i++) {
+        pthread_mutex_init(&sweep.queues[i].lock, NULL);
+        sweep.queues[i].next = n;
+        n += per + ((size_t)i < sweep.nruns % sweep.nworkers);
+        sweep.queues[i].end = n;
+    }
+    pthread_mutex_init(&sweep.out_lock, NULL);
+
+    fprintf(sweep.out, "run,seed,energy,mutation,ticks,secs,instructions,spor_copies,"
+            "energy_death,crch_deaths,kill_deaths,shar_energy,mutations,live,max_gen\n");
+
+    for (i = 0; i < sweep.nworkers; i++) {
+        args[i].sweep = &sweep;
+        args[i].id = i;
+        if (pthread_create(&threads[i], NULL, worker, &args[i]))
+            exit(1);
+    }
+    for (i = 0; i < sweep.nworkers; i++)
+        pthread_join(threads[i], NULL);
+
+    if (outpath)
+        fclose(sweep.out);
+    for (i = 0; i < sweep.nworkers; i++)
+        pthread_mutex_destroy(&sweep.queues[i].lock);
+    pthread_mutex_destroy(&sweep.out_lock);
+    free(sweep.queues);
+    free(sweep.runs);
+    free(threads);
+    free(args);
+    return sweep.failed;
+}
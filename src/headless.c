@@ -0,0 +1,448 @@
+/** @file
+ *  Headless entry point, runs the cell VM for a fixed number of ticks with no
+ *  display attached and reports how fast it went.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <signal.h>
+
+#include "config.h"
+#include "cellvm.h"
+#include "cellgenome.h"
+#include "cellckpt.h"
+#include "celltrace.h"
+#include "cellshard.h"
+#include "cellstats.h"
+#include "cellprof.h"
+#include "cellspecies.h"
+#include "cellframes.h"
+
+/* Checkpoint file, ticks between background checkpoints and the writer
+ * currently running, assigned by main(). */
+static const char *ckpt_path;
+static unsigned long ckpt_every;
+static pid_t ckpt_pid = -1;
+
+/* Species census and the file its written to every stats interval, assigned by main(). */
+static struct species_census census;
+static FILE *species_file;
+
+/** Ticks between checks for the profiler signals. */
+#define SIGNAL_TICKS 1000000
+
+/* Opcode profile, and the signals asking for it to be dumped or switched. */
+static struct cell_prof prof;
+static volatile sig_atomic_t prof_dump_req, prof_toggle_req;
+
+/**
+ * Print program usage information to console.
+ * @param name Name the program was run as.
+ */
+static void print_help(const char *name) {
+    printf("Silicion Genesis %s (headless)\n", SGVER);
+    printf("Usage: %s [options]\n", name);
+    printf("\t-s seed\t\tSeed for the random number generator (default time).\n");
+    printf("\t-x width\tGrid width (default %d).\n", DEFAULTX);
+    printf("\t-y height\tGrid height (default %d).\n", DEFAULTY);
+    printf("\t-t ticks\tTicks to run for, -j, -L, -G and -F can go a round past it (default 10000000).\n");
+    printf("\t-g genome\tPopulate a test genome, can be repeated (default the GUI set).\n");
+    printf("\t-n count\tPopulate count randomly seeded cells.\n");
+    printf("\t-j threads\tRun the tiled scheduler on this many threads.\n");
+    printf("\t-m rate\t\t1/rate odds of each instruction mutating on SPOR (default %d).\n", MUTATIONRATE);
+    printf("\t-B\t\tMutate single bits rather than whole instructions.\n");
+    printf("\t-L\t\tOnly schedule live cells, skipping the tick counter over empty ones.\n"
+           "\t\t\tSingle threaded only, the tiled scheduler picks from every cell.\n");
+    printf("\t-G\t\tStep every cell at once a generation at a time, the same on any -j.\n");
+    printf("\t-F shards\tSplit the grid into this many processes stepping like -G, each using\n"
+           "\t\t\t-j threads. Cant be used with -S, -D, -O, -i, -P or -T.\n");
+    printf("\t-N topology\tNeighbourhood, vonneumann, moore or hex (default vonneumann).\n");
+    printf("\t-R file\t\tResume from a checkpoint, the grid and populate options are ignored.\n");
+    printf("\t-C file\t\tWrite a checkpoint here when done.\n");
+    printf("\t-i ticks\tAlso checkpoint to the -C file in the background this often.\n");
+    printf("\t-S file\t\tExport stats here every -I ticks, as JSON lines if it ends in .json\n"
+           "\t\t\tor .jsonl and CSV otherwise.\n");
+    printf("\t-I ticks\tTicks between stats rows and species censuses (default 1000000).\n");
+    printf("\t-D file\t\tWrite a species census here every -I ticks and at the end.\n");
+    printf("\t-O target\tExport frames every -o ticks and at the end, to numbered files\n"
+           "\t\t\tnamed by a pattern with a %%d, PNGs if it ends in .png and PPMs\n"
+           "\t\t\totherwise, or to a command if it starts with | as PPMs on its stdin.\n"
+           "\t\t\tFrames are written in the background and dropped if it falls behind.\n");
+    printf("\t-o ticks\tTicks between frames (default the -I interval).\n");
+    printf("\t-V view\t\tView to export, energy, generation, living or genmap (default energy).\n");
+    printf("\t-P\t\tProfile opcodes from the start and print the profile at the end. SIGUSR2\n"
+           "\t\t\tswitches profiling on or off while running, SIGUSR1 prints it so far.\n");
+    printf("\t-T file\t\tTrace every event to this file, single threaded only. The cluster\n"
+           "\t\t\tit starts from is checkpointed to file.ckpt for replaying onto.\n");
+}
+
+/**
+ * Start a background checkpoint, unless the last one is still being written.
+ */
+static void callback_checkpoint(void *userdata, int x, int y, char didstuff) {
+    if (ckpt_pid != -1) {
+        if (cluster_save_wait(ckpt_pid, 0) == -1)
+            return;
+        ckpt_pid = -1;
+    }
+    if ((ckpt_pid = cluster_save_bg(userdata, ckpt_path)) == -1)
+        fprintf(stderr, "Cant start a checkpoint to %s\n", ckpt_path);
+}
+
+/**
+ * Take a species census and write it out.
+ */
+static void callback_species(void *userdata, int x, int y, char didstuff) {
+    species_take(&census, userdata);
+    species_dump(&census, species_file, 0);
+}
+
+/**
+ * Note a SIGUSR1 (dump the profile) or SIGUSR2 (switch profiling on or off),
+ * acted on by callback_signals().
+ */
+static void handle_signal(int sig) {
+    if (sig == SIGUSR1)
+        prof_dump_req = 1;
+    else
+        prof_toggle_req = 1;
+}
+
+/**
+ * Act on any profiler signals.
+ */
+static void callback_signals(void *userdata, int x, int y, char didstuff) {
+    struct cell_cluster *cluster = userdata;
+
+    if (prof_toggle_req) {
+        prof_toggle_req = 0;
+        cluster->ctx.prof = cluster->ctx.prof ? NULL : &prof;
+        fprintf(stderr, "Profiling %s at tick %lu\n", cluster->ctx.prof ? "on" : "off", cluster->tick);
+    }
+    if (prof_dump_req) {
+        prof_dump_req = 0;
+        fprintf(stderr, "tick:%lu\n", cluster->tick);
+        prof_dump(&prof, stderr);
+    }
+}
+
+/**
+ * Application entry point.
+ */
+int main(int argc, char *argv[]) {
+    struct cell_cluster cluster;
+    const struct genome_def *def;
+    const char *genomes[64];
+    struct cell_budget stop;
+    unsigned long seed, mutation, budget, start_tick, start_instructions, stats_every, frames_every;
+    const char *resume, *trace_path, *stats_path, *species_path, *frames_path, *view_name;
+    struct cell_trace trace;
+    struct stats_export stats;
+    struct frame_export frames;
+    render_view view;
+    char trace_ckpt[PATH_MAX];
+    int opt, i, ngenomes, nseeds, width, height, threads, mutmode, schedmode, profile, topology, shards, fw, fh;
+    double secs;
+
+    seed = time(NULL);
+    budget = 10000000;
+    width = DEFAULTX;
+    height = DEFAULTY;
+    ngenomes = nseeds = 0;
+    threads = 1;
+    mutation = MUTATIONRATE;
+    mutmode = MUTATE_OPCODE;
+    schedmode = SCHED_RANDOM;
+    topology = TOPO_VONNEUMANN;
+    resume = trace_path = stats_path = species_path = frames_path = NULL;
+    view_name = "energy";
+    stats_every = 1000000;
+    frames_every = 0;
+    profile = 0;
+    shards = 0;
+
+    while ((opt = getopt(argc, argv, "s:x:y:t:g:n:j:m:BLGF:N:R:C:i:T:S:I:D:O:o:V:Ph")) != -1) {
+        switch (opt) {
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'x':
+            width = atoi(optarg);
+            break;
+        case 'y':
+            height = atoi(optarg);
+            break;
+        case 't':
+            budget = strtoul(optarg, NULL, 0);
+            break;
+        case 'g':
+            if (!genome_find(optarg)) {
+                fprintf(stderr, "Unknown genome %s\n", optarg);
+                return 1;
+            }
+            if (ngenomes < 64)
+                genomes[ngenomes++] = optarg;
+            break;
+        case 'n':
+            nseeds = atoi(optarg);
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'm':
+            mutation = strtoul(optarg, NULL, 0);
+            break;
+        case 'B':
+            mutmode = MUTATE_BIT;
+            break;
+        case 'L':
+            schedmode = SCHED_LIVE;
+            break;
+        case 'G':
+            schedmode = SCHED_SYNC;
+            break;
+        case 'F':
+            shards = atoi(optarg);
+            break;
+        case 'N':
+            if ((topology = topology_find(optarg)) < 0) {
+                fprintf(stderr, "Unknown topology %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'R':
+            resume = optarg;
+            break;
+        case 'C':
+            ckpt_path = optarg;
+            break;
+        case 'i':
+            ckpt_every = strtoul(optarg, NULL, 0);
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        case 'P':
+            profile = 1;
+            break;
+        case 'S':
+            stats_path = optarg;
+            break;
+        case 'I':
+            stats_every = strtoul(optarg, NULL, 0);
+            break;
+        case 'D':
+            species_path = optarg;
+            break;
+        case 'O':
+            frames_path = optarg;
+            break;
+        case 'o':
+            frames_every = strtoul(optarg, NULL, 0);
+            break;
+        case 'V':
+            view_name = optarg;
+            break;
+        default:
+            print_help(argv[0]);
+            return 1;
+        }
+    }
+
+    if (threads < 1) {
+        print_help(argv[0]);
+        return 1;
+    }
+    if (budget == 0) {
+        fprintf(stderr, "Tick budget must be at least 1\n");
+        return 1;
+    }
+    if (ckpt_every && !ckpt_path) {
+        fprintf(stderr, "-i needs a checkpoint file from -C\n");
+        return 1;
+    }
+    if ((stats_path || species_path) && !stats_every) {
+        fprintf(stderr, "Stats and species interval must be at least 1\n");
+        return 1;
+    }
+    if (!frames_every)
+        frames_every = stats_every;
+    if (frames_path && !frames_every) {
+        fprintf(stderr, "Frame interval must be at least 1\n");
+        return 1;
+    }
+    if (!(view = render_find(view_name))) {
+        fprintf(stderr, "Unknown view %s\n", view_name);
+        return 1;
+    }
+    if (shards && (shards < 2 || stats_path || species_path || frames_path || ckpt_every || profile || trace_path)) {
+        fprintf(stderr, "Shards must be at least 2 and cant be used with -S, -D, -O, -i, -P or -T\n");
+        return 1;
+    }
+    if (trace_path && threads > 1) {
+        fprintf(stderr, "Only single threaded runs can be traced\n");
+        return 1;
+    }
+
+    /* A resumed run keeps the mutation, scheduler and topology settings it was saved with. */
+    if (resume) {
+        if (cluster_load(&cluster, resume)) {
+            fprintf(stderr, "Cant load checkpoint %s\n", resume);
+            return 1;
+        }
+        seed = cluster.seed;
+        schedmode = cluster.sched_mode;
+    } else if (cluster_init(&cluster, width, height)) {
+        fprintf(stderr, "Cant allocate a %dx%d grid\n", width, height);
+        return 1;
+    }
+    if (shards) {
+        if (shards > (cluster.h + SYNC_ROWS - 1) / SYNC_ROWS) {
+            fprintf(stderr, "A %d row grid cant be split into %d shards\n", cluster.h, shards);
+            return 1;
+        }
+        schedmode = cluster.sched_mode = SCHED_SYNC;
+    }
+    if (schedmode == SCHED_SYNC && (trace_path || profile)) {
+        fprintf(stderr, "Synchronous runs cant be traced or profiled\n");
+        return 1;
+    }
+    /* The tiled scheduler never looks at sched_mode, so -j would quietly drop -L. */
+    if (schedmode == SCHED_LIVE && threads > 1) {
+        fprintf(stderr, "Live runs, with -L or resumed from one, are single threaded only\n");
+        return 1;
+    }
+    cluster.threads = threads;
+    if (!resume) {
+        if (cluster_set_topology(&cluster, topology)) {
+            fprintf(stderr, "Hex grids need an even height\n");
+            return 1;
+        }
+        cluster.sched_mode = schedmode;
+        cluster_set_mutation(&cluster, mutation, mutmode);
+        cluster_seed(&cluster, seed);
+    }
+    start_tick = cluster.tick;
+    start_instructions = cluster.stats.instructions;
+
+    /* Tiled, live and sync runs can go a little past the budget, the tick
+     * printed at the end is what really ran. */
+    cluster_budget(&cluster, &stop, budget);
+    if (ckpt_every)
+        add_callback(&cluster.callbacks, callback_checkpoint, ckpt_every, &cluster, "CHECKPOINT");
+
+    /* Populate the requested test cells, or the same set the GUI uses. */
+    if (resume) {
+        /* Already populated. */
+    } else if (ngenomes) {
+        for (i = 0; i < ngenomes; i++) {
+            def = genome_find(genomes[i]);
+            cell_pop(&cluster, RANDX(&cluster), RANDY(&cluster), 1, ENERGY, def->instructions);
+        }
+    } else if (!nseeds) {
+        genome_pop_defaults(&cluster, ENERGY);
+    }
+    for (i = 0; i < nseeds; i++)
+        cell_seed(&cluster, RANDX(&cluster), RANDY(&cluster));
+
+    /* Trace from here, a checkpoint of the cluster as it is now is what to replay onto. */
+    if (trace_path) {
+        if (snprintf(trace_ckpt, sizeof trace_ckpt, "%s.ckpt", trace_path) >= (int)sizeof trace_ckpt ||
+            cluster_save(&cluster, trace_ckpt)) {
+            fprintf(stderr, "Cant write checkpoint for trace %s\n", trace_path);
+            return 1;
+        }
+        if (trace_open(&trace, trace_path, &cluster)) {
+            fprintf(stderr, "Cant write trace %s\n", trace_path);
+            return 1;
+        }
+        cluster.ctx.trace = &trace;
+    }
+
+    if (stats_path) {
+        if (stats_open(&stats, stats_path, stats_format(stats_path))) {
+            fprintf(stderr, "Cant write stats %s\n", stats_path);
+            return 1;
+        }
+        stats_attach(&stats, &cluster, stats_every);
+    }
+    if (species_path) {
+        if (!(species_file = fopen(species_path, "w"))) {
+            fprintf(stderr, "Cant write species %s\n", species_path);
+            return 1;
+        }
+        species_init(&census, SPECIES_THRESHOLD, SPECIES_MAX);
+        add_callback(&cluster.callbacks, callback_species, stats_every, &cluster, "SPECIES");
+    }
+    if (frames_path) {
+        /* An encoder that quits early shouldnt take the run with it. */
+        if (frames_path[0] == '|')
+            signal(SIGPIPE, SIG_IGN);
+        frame_fit(cluster.w, cluster.h, FRAMES_MAX, &fw, &fh);
+        if (frames_open(&frames, frames_path, view, fw, fh)) {
+            fprintf(stderr, "Cant write frames %s\n", frames_path);
+            return 1;
+        }
+        frames_attach(&frames, &cluster, frames_every);
+    }
+
+    if (profile)
+        cluster.ctx.prof = &prof;
+    signal(SIGUSR1, handle_signal);
+    signal(SIGUSR2, handle_signal);
+    add_callback(&cluster.callbacks, callback_signals, SIGNAL_TICKS, &cluster, "SIGNALS");
+
+    secs = clock_seconds();
+    if (!shards)
+        cluster_sched(&cluster);
+    else if (cluster_sched_sharded(&cluster, shards, threads)) {
+        fprintf(stderr, "Sharded run failed\n");
+        return 1;
+    }
+    secs = clock_seconds() - secs;
+
+    if (trace_path) {
+        cluster.ctx.trace = NULL;
+        if (trace_close(&trace))
+            fprintf(stderr, "Trace %s is incomplete\n", trace_path);
+        else
+            printf("trace: events:%lu\n", trace.events);
+    }
+    if (stats_path && stats_close(&stats, &cluster))
+        fprintf(stderr, "Stats %s are incomplete\n", stats_path);
+    if (species_path) {
+        if (census.tick != cluster.tick || !census.area)
+            callback_species(&cluster, 0, 0, 0);
+        i = ferror(species_file);
+        if (fclose(species_file) || i)
+            fprintf(stderr, "Species %s are incomplete\n", species_path);
+    }
+    if (frames_path && frames_close(&frames, &cluster))
+        fprintf(stderr, "Frames %s are incomplete\n", frames_path);
+    if (ckpt_pid != -1 && cluster_save_wait(ckpt_pid, 1))
+        fprintf(stderr, "Background checkpoint to %s failed\n", ckpt_path);
+    if (ckpt_path && cluster_save(&cluster, ckpt_path))
+        fprintf(stderr, "Cant write checkpoint %s\n", ckpt_path);
+
+    printf("seed:%lu grid:%dx%d threads:%d ticks:%lu\n", seed, cluster.w, cluster.h, threads, cluster.tick);
+    printf("time:%.3fs ticks/s:%.0f instructions/s:%.0f\n", secs,
+           (cluster.tick - start_tick) / secs, (cluster.stats.instructions - start_instructions) / secs);
+    printf("stats: instructions:%lu spor_copies:%lu energy_death:%lu mutations:%lu shar_energy:%lu\n",
+           cluster.stats.instructions, cluster.stats.spor_copies,
+           cluster.stats.energy_death, cluster.stats.mutations, cluster.stats.shar_energy);
+    printf("deaths: energy:%lu crch:%lu kill:%lu\n",
+           cluster.stats.energy_death, cluster.stats.crch_deaths, cluster.stats.kill_deaths);
+    if (species_path)
+        printf("species: live:%lu genomes:%zu species:%zu\n", census.live, census.ngenomes, census.nspecies);
+    if (frames_path)
+        printf("frames: written:%lu dropped:%lu\n", frames.written, frames.dropped);
+    if (prof.picks)
+        prof_dump(&prof, stdout);
+
+    if (species_path)
+        species_free(&census);
+    cluster_free(&cluster);
+    return 0;
+}
@@ -4,11 +4,18 @@
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
 
 #include "main.h"
 #include "config.h"
 #include "cellvm.h"
+#include "cellgenome.h"
+#include "cellprof.h"
 #include "sdlio.h"
 
 /* Global cluster and screen pointers, assigned by main(). */
@@ -28,8 +35,14 @@ static void print_help(void) {
            \n\tg for Generation view. \
            \n\tl for Living cells view. \
            \n\tm for Genmap(KIND OF) view. \
+           \n\tp to start/stop and print the opcode Profile. \
            \n\tr for Restart. \
            \n\tq to Quit..\n");
+    printf("Options:\n\t-x width\tGrid width (default %d). \
+           \n\t-y height\tGrid height (default %d). \
+           \n\t-p pixels\tScreen pixels per cell (default %d). \
+           \n\t-f fps\t\tFrames per second to redraw at (default %d).\n", DEFAULTX, DEFAULTY, PIXELSPEROBJECT,
+           DISPLAY_FPS);
 }
 
 /**
@@ -46,70 +59,157 @@ static void handle_exit(void) {
 //    cp = NULL;
 }
 
+/** Held by the display while it reads the grid and by the simulation while it
+ *  frees or repopulates it, running cells dont take it. */
+static pthread_mutex_t grid_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Opcode profile, counted into while switched on with p. */
+static struct cell_prof prof;
+
+/** Set when the user has asked to quit rather than restart, simulation thread only. */
+static char quit;
+
+/** Set once the simulation thread has finished. */
+static atomic_int sim_done;
+
 /**
- * Do GUI and other SDL updates.
+ * Handle keys forwarded by the display, ran on the simulation thread.
  */
-static void callback_update(int x, int y, char didstuff) {
-    if (didstuff) {
-        display_call(cp, x, y, 1, 1);
-        glfwSwapBuffers(sp);
-        glfwPollEvents();
+static void callback_input(void *userdata, int x, int y, char didstuff) {
+    struct cell_cluster *cluster = userdata;
+    int key;
+
+    while ((key = input_poll()) != -1) {
+        switch (key) {
+        case GLFW_KEY_Q:
+            quit = 1;
+            cluster->sched_end = 1;
+            break;
+        case GLFW_KEY_R:
+            cluster->sched_end = 1;
+            break;
+        case GLFW_KEY_P:
+            /* Print what was counted when switching off. */
+            if (cluster->ctx.prof) {
+                prof_dump(cluster->ctx.prof, stdout);
+                cluster->ctx.prof = NULL;
+            } else {
+                memset(&prof, '\0', sizeof prof);
+                cluster->ctx.prof = &prof;
+                printf("profiling\n");
+            }
+            break;
+        }
     }
 }
 
+/**
+ * Simulation thread, runs the cluster flat out and restarts it on request.
+ */
+static void *sim_thread(void *arg) {
+    int failed;
+
+    do {
+        /* Populate random spots with some test cells and run the scheduler. */
+        pthread_mutex_lock(&grid_lock);
+        genome_pop_defaults(cp, ENERGY);
+        pthread_mutex_unlock(&grid_lock);
+
+        /* Populate the grid with some randomly seeded cells. */
+//        for (i = 0; i < 300; i++)
+//            cell_seed(cp, RANDX(cp), RANDY(cp));
+
+        cluster_sched(cp);
+        if (quit)
+            break;
+
+        pthread_mutex_lock(&grid_lock);
+        failed = cluster_reset(cp);
+        pthread_mutex_unlock(&grid_lock);
+    } while (!failed);
+
+    atomic_store(&sim_done, 1);
+    return NULL;
+}
+
 /**
  * Application entry point.
  */
 int main(int argc, char *argv[]) {
     struct cell_cluster cluster;
     GLFWwindow *screen;
-    int i;
-
-    /* Test instructions, they do what they are called... */
-    char randpop[CSIZE] = { SPOR, STOP };
-    char popleft[CSIZE] = { ZERO, TURN, SPOR, STOP };
-    char popright[CSIZE] = { INCR, TURN, SPOR, STOP };
-    char popup[CSIZE] = { INCR, INCR, TURN, SPOR, STOP };
-    char popdown[CSIZE] = { INCR, INCR, INCR, TURN, SPOR, STOP };
-    char star[CSIZE] = { TURN, SPOR, INCR, TURN, SPOR, INCR, TURN, SPOR, INCR, TURN, SPOR, STOP };
-    char rightup[CSIZE] = { INCR, TURN, SPOR, INCR, TURN, SPOR, STOP };
-    char randpopeat[CSIZE] = { SPOR, RDIR, CRCH, STOP };
+    pthread_t sim;
+    struct timespec wait;
+    double next, left;
+    int opt, width, height, scale, fps;
+
+    width = DEFAULTX;
+    height = DEFAULTY;
+    scale = PIXELSPEROBJECT;
+    fps = DISPLAY_FPS;
+    while ((opt = getopt(argc, argv, "x:y:p:f:")) != -1) {
+        switch (opt) {
+        case 'x':
+            width = atoi(optarg);
+            break;
+        case 'y':
+            height = atoi(optarg);
+            break;
+        case 'p':
+            scale = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        case 'f':
+            fps = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        default:
+            print_help();
+            exit(1);
+        }
+    }
 
     /* Init display system and cluster. */
-    if (cluster_init(&cluster) || !(screen = display_init(&cluster)))
+    if (cluster_init(&cluster, width, height) || !(screen = display_init(&cluster, scale)))
         exit(1);
     else
         atexit(handle_exit);
 
     cp = &cluster;
     sp = screen;
-    srand(time(NULL));
+    cluster_seed(&cluster, time(NULL));
 
-    add_callback(&cluster.callbacks, callback_update, 1, "SDL_GUI_UPDATE");
+    add_callback(&cluster.callbacks, callback_input, INPUT_TICKS, &cluster, "SDL_INPUT");
 
     /* Show title untill enter is pressed. */
     print_help();
 //    display_title(screen);
 
-    do {
-        draw_all(&cluster, DRAW_BLANK);
-
-        /* Populate random spots with some test cells and run the scheduler. */
-        cell_pop(&cluster, RANDX, RANDY, 1, ENERGY, randpop);
-        cell_pop(&cluster, RANDX, RANDY, 1, ENERGY, popup);
-        cell_pop(&cluster, RANDX, RANDY, 1, ENERGY, popleft);
-        cell_pop(&cluster, RANDX, RANDY, 1, ENERGY, popright);
-        cell_pop(&cluster, RANDX, RANDY, 1, ENERGY, popdown);
-        cell_pop(&cluster, RANDX, RANDY, 1, ENERGY, star);
-        cell_pop(&cluster, RANDX, RANDY, 1, ENERGY, rightup);
+    if (pthread_create(&sim, NULL, sim_thread, NULL))
+        exit(1);
 
-        /* Populate the grid with some randomly seeded cells. */
-//        for (i = 0; i < 300; i++)
-//            cell_seed(&cluster, RANDX, RANDY);
+    /* The simulation runs flat out on its own thread, this one just redraws the
+     * grid fps times a second and passes input over. */
+    while (!atomic_load(&sim_done)) {
+        next = glfwGetTime() + 1.0 / fps;
 
-        cluster_sched(&cluster);
+        glfwPollEvents();
+        if (glfwWindowShouldClose(sp)) {
+            input_push(GLFW_KEY_Q);
+            glfwSetWindowShouldClose(sp, 0);
+        }
+
+        pthread_mutex_lock(&grid_lock);
+        display_frame(cp);
+        pthread_mutex_unlock(&grid_lock);
+        glfwSwapBuffers(sp);
 
-    } while (!cluster_reset(&cluster));
+        if ((left = next - glfwGetTime()) > 0) {
+            wait.tv_sec = left;
+            wait.tv_nsec = (left - wait.tv_sec) * 1e9;
+            nanosleep(&wait, NULL);
+        }
+    }
+    pthread_join(sim, NULL);
 
-    return 0;
+    /* exit rather than return, handle_exit needs the cluster on this stack. */
+    exit(0);
 }
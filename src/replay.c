@@ -0,0 +1,116 @@
+/** @file
+ *  Trace replayer, rebuilds the grid of a traced run by applying its trace to
+ *  the checkpoint it started from, without running any cells.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "cellvm.h"
+#include "cellckpt.h"
+#include "celltrace.h"
+
+/** Names of each TRACE_EVENTS kind for printing. */
+static const char *event_names[TRACE_EVENTS_MAX] = {
+    "run", "spor", "crch", "kill", "shar", "reap", "mut"
+};
+
+/**
+ * Print program usage information to console.
+ * @param name Name the program was run as.
+ */
+static void print_help(const char *name) {
+    printf("Silicion Genesis %s (replay)\n", SGVER);
+    printf("Usage: %s [options] checkpoint trace\n", name);
+    printf("\t-t tick\t\tStop before the first event on or after this tick.\n");
+    printf("\t-C file\t\tCheckpoint the rebuilt grid here, the stats and generator are\n"
+           "\t\t\tleft as they were in the starting checkpoint.\n");
+    printf("\t-v\t\tPrint every event.\n");
+}
+
+/**
+ * Application entry point.
+ */
+int main(int argc, char *argv[]) {
+    struct cell_cluster cluster;
+    struct trace_reader reader;
+    struct trace_record rec;
+    unsigned long counts[TRACE_EVENTS_MAX] = { 0 };
+    unsigned long stop, live;
+    const char *out;
+    size_t i;
+    int opt, ret, verbose, x, y;
+
+    stop = 0;
+    out = NULL;
+    verbose = 0;
+    while ((opt = getopt(argc, argv, "t:C:vh")) != -1) {
+        switch (opt) {
+        case 't':
+            stop = strtoul(optarg, NULL, 0);
+            break;
+        case 'C':
+            out = optarg;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            print_help(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        print_help(argv[0]);
+        return 1;
+    }
+
+    if (cluster_load(&cluster, argv[optind])) {
+        fprintf(stderr, "Cant load checkpoint %s\n", argv[optind]);
+        return 1;
+    }
+    if (trace_reader_open(&reader, argv[optind + 1])) {
+        fprintf(stderr, "Cant read trace %s\n", argv[optind + 1]);
+        return 1;
+    }
+    if (reader.header.w != (uint64_t)cluster.w || reader.header.h != (uint64_t)cluster.h ||
+        reader.header.start_tick != cluster.tick) {
+        fprintf(stderr, "Trace starts at tick %lu on a %lux%lu grid, the checkpoint is tick %lu %dx%d\n",
+                (unsigned long)reader.header.start_tick, (unsigned long)reader.header.w,
+                (unsigned long)reader.header.h, cluster.tick, cluster.w, cluster.h);
+        return 1;
+    }
+
+    while ((ret = trace_read(&reader, &rec)) == 1) {
+        if (stop && rec.tick >= stop)
+            break;
+        if (verbose) {
+            cell_coords(&cluster, rec.cell, &x, &y);
+            printf("%lu %s %dx%d dir:%d value:%lu\n", rec.tick, event_names[rec.kind], x, y, rec.dir, rec.value);
+        }
+        if (trace_apply(&cluster, &rec)) {
+            fprintf(stderr, "Bad %s event at tick %lu\n", event_names[rec.kind], rec.tick);
+            return 1;
+        }
+        counts[rec.kind]++;
+    }
+    trace_reader_close(&reader);
+    if (ret < 0)
+        fprintf(stderr, "Trace is cut short or corrupt, stopped at tick %lu\n", cluster.tick);
+
+    for (live = 0, i = 0; i < cluster.area; i++)
+        live += cell_gen(&cluster, i) != 0;
+
+    printf("tick:%lu live:%lu", cluster.tick, live);
+    for (i = 0; i < TRACE_EVENTS_MAX; i++)
+        printf(" %s:%lu", event_names[i], counts[i]);
+    printf("\n");
+
+    if (out && cluster_save(&cluster, out)) {
+        fprintf(stderr, "Cant write checkpoint %s\n", out);
+        return 1;
+    }
+    cluster_free(&cluster);
+    return 0;
+}
@@ -4,75 +4,125 @@
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdatomic.h>
 
 #include "sdlio.h"
 #include "cellvm.h"
+#include "cellrender.h"
 
 duptr display_call;
 
+/** Framebuffer the views draw into, uploaded by display_render(). */
+static struct cell_frame frame;
+
+/** Texture the framebuffer is uploaded to. */
+static GLuint frame_texture;
+
+/** Size of the window in screen pixels. */
+static int window_w, window_h;
+
+/** View display_frame() draws with, the one display_call uses. */
+static render_view view;
+
+/** Set when the whole frame has to be redrawn, like after switching view. */
+static char repaint;
+
 /**
- * Updates a pixel on the screen to the color specified.
- * @param screen SDL screen to draw to.
- * @param x Horizontal coord.
- * @param y Vertical coord.
- * @param R Red color value. (16 bit)
+ * Updates a pixel in the framebuffer to the color specified.
+ * @param x Horizontal pixel coord.
+ * @param y Vertical pixel coord.
+ * @param R Red color value, clamped to 0-1 like glColor3f.
  * @param G Green color value.
  * @param B Blue color value.
- * @param flush Update the display now if true.
  */
 inline static void display_update(int x, int y, float R, float G, float B) {
-    glColor3f(R,G,B);
+    frame_set(&frame, x, y, R, G, B);
+}
 
-    int xmod = x * PIXELSPEROBJECT;
-    int ymod = y * PIXELSPEROBJECT;
+/** Keys waiting for the simulation thread, single producer single consumer
+ *  ring so neither side ever blocks on the other. */
+static struct {
+    int keys[INPUT_QUEUE];
+    /** Next slot to read, only written by the consumer. */
+    atomic_uint head;
+    /** Next slot to write, only written by the producer. */
+    atomic_uint tail;
+} input_queue;
+
+int input_push(int key) {
+    unsigned int tail = atomic_load_explicit(&input_queue.tail, memory_order_relaxed);
+
+    if (tail - atomic_load_explicit(&input_queue.head, memory_order_acquire) == INPUT_QUEUE)
+        return 1;
+    input_queue.keys[tail % INPUT_QUEUE] = key;
+    atomic_store_explicit(&input_queue.tail, tail + 1, memory_order_release);
+    return 0;
+}
 
-    glBegin(GL_QUADS);
-    glVertex3f(xmod, ymod, 0);
-    glVertex3f(xmod+PIXELSPEROBJECT, ymod, 0);
-    glVertex3f(xmod+PIXELSPEROBJECT, ymod+PIXELSPEROBJECT, 0);
-    glVertex3f(xmod, ymod+PIXELSPEROBJECT, 0);
+int input_poll(void) {
+    unsigned int head = atomic_load_explicit(&input_queue.head, memory_order_relaxed);
+    int key;
 
-    glEnd();
+    if (head == atomic_load_explicit(&input_queue.tail, memory_order_acquire))
+        return -1;
+    key = input_queue.keys[head % INPUT_QUEUE];
+    atomic_store_explicit(&input_queue.head, head + 1, memory_order_release);
+    return key;
 }
 
-struct cell_cluster *cluster;
 void key_callback(GLFWwindow *window, int key, int scancode, int action, int mods) {
+  if (action != GLFW_PRESS)
+    return;
+
+  /* Views belong to the display so are switched here, anything to do with the
+   * simulation gets passed on to its thread. Only changed cells get redrawn
+   * each frame so the next one has to redraw the lot. */
   switch(key) {
     case GLFW_KEY_G:
       printf("display generation request\n");
-      //draw_all(cluster, DRAW_GENERATION);
       display_call = draw_local_generation;
+      view = render_generation;
+      repaint = 1;
       break;
     case GLFW_KEY_E:
       printf("display energy request\n");
-      //draw_all(cluster, DRAW_ENERGY);
       display_call = draw_local_energy;
+      view = render_energy;
+      repaint = 1;
       break;
     case GLFW_KEY_L:
       printf("display living request\n");
-      //draw_all(cluster, DRAW_LIVING);
       display_call = draw_local_living;
+      view = render_living;
+      repaint = 1;
       break;
     case GLFW_KEY_M:
       printf("display genmap request\n");
-      //draw_all(cluster, DRAW_GENMAP);
       display_call = draw_local_gmap;
-    case GLFW_KEY_R:
-      cluster->sched_end = 1;
+      view = render_gmap;
+      repaint = 1;
       break;
+    case GLFW_KEY_R:
     case GLFW_KEY_Q:
-      exit(0);
+    case GLFW_KEY_P:
+      input_push(key);
+      break;
   }
 }
 
-GLFWwindow *display_init(struct cell_cluster *cluster) {
+GLFWwindow *display_init(struct cell_cluster *cluster, int scale) {
     GLFWwindow *window;
-    cluster = cluster;
+    int fw, fh;
+
+    /* Grids too big to show a pixel per cell get sampled down to fit. */
+    frame_fit(cluster->w, cluster->h, DISPLAYMAX, &fw, &fh);
+    window_w = fw * scale;
+    window_h = fh * scale;
 
     if(!glfwInit()) {
         return NULL;
     }
-    else if (!(window = glfwCreateWindow(X*PIXELSPEROBJECT, Y*PIXELSPEROBJECT, "sg", NULL, NULL))) {
+    else if (!(window = glfwCreateWindow(window_w, window_h, "sg", NULL, NULL))) {
         return NULL;
     }
 
@@ -87,30 +137,87 @@ GLFWwindow *display_init(struct cell_cluster *cluster) {
     glDepthFunc(GL_LEQUAL);
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
-    glOrtho(0.0, X*PIXELSPEROBJECT, Y*PIXELSPEROBJECT, 0.0, -1.0, 1.0);
+    glOrtho(0.0, window_w, window_h, 0.0, -1.0, 1.0);
 
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
     glClearColor(1.0, 1.0, 1.0, 0.0);
-    glViewport(0, 0, X*PIXELSPEROBJECT, Y*PIXELSPEROBJECT);
+    glViewport(0, 0, window_w, window_h);
+
+    /* The grid is drawn as one texture with a texel per pixel of the frame,
+     * stretched over the window without filtering so cells stay square. */
+    if (frame_init(&frame, fw, fh))
+        return NULL;
+    glGenTextures(1, &frame_texture);
+    glBindTexture(GL_TEXTURE_2D, frame_texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, fw, fh, 0, GL_RGBA, GL_UNSIGNED_BYTE, frame.pixels);
+    frame_clean(&frame);
 
     display_call = draw_local_gmap; /* Set display call to generations by default. */
+    view = render_gmap;
+    repaint = 1;
+    /* Have the VM mark the cells it changes so frames only redraw those. */
+    cluster_track_dirty(cluster, 1);
 
 #ifdef DEBUG
-    printf("Display init ok: %dx%d @ %d^2\n", X*PIXELSPEROBJECT, Y*PIXELSPEROBJECT, PIXELSPEROBJECT);
+    printf("Display init ok: %dx%d @ %d^2\n", window_w, window_h, scale);
 #endif
     return window;
 }
 
 void display_close(void) {
+  glDeleteTextures(1, &frame_texture);
+  frame_free(&frame);
   glfwTerminate();
 }
 
+void display_render(void) {
+    glBindTexture(GL_TEXTURE_2D, frame_texture);
+
+    /* Only send the rows that changed since the last frame. */
+    if (frame.dirty_lo < frame.dirty_hi) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, frame.dirty_lo, frame.w, frame.dirty_hi - frame.dirty_lo,
+                        GL_RGBA, GL_UNSIGNED_BYTE, &frame.pixels[(size_t)frame.dirty_lo * frame.w * 4]);
+        frame_clean(&frame);
+    }
+
+    glBegin(GL_QUADS);
+    glTexCoord2f(0, 0);
+    glVertex3f(0, 0, 0);
+    glTexCoord2f(1, 0);
+    glVertex3f(window_w, 0, 0);
+    glTexCoord2f(1, 1);
+    glVertex3f(window_w, window_h, 0);
+    glTexCoord2f(0, 1);
+    glVertex3f(0, window_h, 0);
+    glEnd();
+}
+
+void display_frame(struct cell_cluster *cluster) {
+    /* Only cells that changed since the last frame, huge grids never cost more
+     * than a pixel per cell of the window. */
+    if (repaint) {
+        render_all(&frame, cluster, view);
+        repaint = 0;
+    } else {
+        render_dirty(&frame, cluster, view);
+    }
+    display_render();
+}
+
 void draw_all( const struct cell_cluster *cluster, enum DISPLAY_TYPE type) {
-    int x, y;
+    int px, py, x, y;
+
+    for (px = 0; px < frame.w; px++) {
+        for (py = 0; py < frame.h; py++) {
+            frame_cell(&frame, cluster, px, py, &x, &y);
 
-    for (x = 0; x < X; x++) {
-        for (y = 0; y < Y; y++) {
             /* What are we going to blanket update the screen with?. */
             switch (type) {
             case DRAW_ENERGY:
@@ -126,7 +233,7 @@ void draw_all( const struct cell_cluster *cluster, enum DISPLAY_TYPE type) {
                 draw_local_gmap(cluster, x, y, 0 , 0);
                 break;
             case DRAW_BLANK:
-                display_update(x, y, 0, 0, 0);
+                display_update(px, py, 0, 0, 0);
                 break;
             default:
                 break;
@@ -135,101 +242,45 @@ void draw_all( const struct cell_cluster *cluster, enum DISPLAY_TYPE type) {
     }
 }
 
-void draw_local_energy(const struct cell_cluster *cluster, int x, int y, char neighbours, char render) {
+/**
+ * Draw a cell with one of the views, and its neighbours if asked.
+ * @param render_cell View to colour the cells with.
+ * @param cluster Cluster to get data from.
+ * @param x X coord.
+ * @param y Y coord.
+ * @param neighbours Update the cells around the one specified too if true.
+ * @param render Render the frame once the cells are drawn if true.
+ */
+static void draw_local(void (*render_cell)(struct cell_frame *, const struct cell_cluster *, int, int),
+                       const struct cell_cluster *cluster, int x, int y, char neighbours, char render) {
     int i, xptr, yptr;
-    struct cell_proc *proc;
-
-    proc = cluster->cells[x][y];
 
-    if (proc->energy < 256)
-        display_update(x, y, proc->energy, 0, 0);
-    else if (proc->energy < 512)
-        display_update(x, y, 255, proc->energy, 0);
-    else if (proc->energy < 768)
-        display_update(x, y, 255, 255, proc->energy);
-    else
-        display_update(x, y, 255, 255, 255);
+    render_cell(&frame, cluster, x, y);
 
     if (neighbours) {
-        for (i = LEFT; i <= DOWN; i++) {
-            get_neighbour_coords(x, y, i, &xptr, &yptr);
-            draw_local_energy(cluster, xptr, yptr, 0, render);
+        /* Get the direction coords for each neighbour with a cellvm helper call. */
+        for (i = 0; i < cluster->ndirs; i++) {
+            get_neighbour_coords(cluster, x, y, i, &xptr, &yptr);
+            render_cell(&frame, cluster, xptr, yptr);
         }
     }
-}
 
-void draw_local_generation(const struct cell_cluster *cluster, int x, int y, char neighbours, char render) {
-    int i, xptr, yptr;
-    struct cell_proc *proc;
-
-    proc = cluster->cells[x][y];
+    if (render)
+        display_render();
+}
 
-    /* Attempt to fit more colours in by stepping thru the R,G,B scale, very bad way to do this. */
-    if (proc->gen < 256)
-        display_update(x, y, 0, proc->gen, 0);
-    else if (proc->gen < 512)
-        display_update(x, y, 0, 255, proc->gen);
-    else if (proc->gen < 768)
-        display_update(x, y, proc->gen, 255, 255);
-    else
-        printf("color overflow -fix me- ....%ld\n", proc->gen);
+void draw_local_energy(const struct cell_cluster *cluster, int x, int y, char neighbours, char render) {
+    draw_local(render_energy, cluster, x, y, neighbours, render);
+}
 
-    if (neighbours) {
-        for (i = LEFT; i <= DOWN; i++) {
-            get_neighbour_coords(x, y, i, &xptr, &yptr);
-            draw_local_generation(cluster, xptr, yptr, 0, render);
-        }
-    }
+void draw_local_generation(const struct cell_cluster *cluster, int x, int y, char neighbours, char render) {
+    draw_local(render_generation, cluster, x, y, neighbours, render);
 }
 
 void draw_local_living(const struct cell_cluster *cluster, int x, int y, char neighbours, char render) {
-    int i, xptr, yptr;
-    struct cell_proc *ptr;
-
-    ptr = cluster->cells[x][y];
-
-    /* Update the current pixel. */
-    if (ptr->energy > 0)
-        display_update(x, y, 0, 0, 255);
-    else
-        display_update(x, y, 0, 0, 0);
-
-    if (neighbours) {
-        /* And its neighbours. */
-        for (i = LEFT; i <= DOWN; i++) {
-            /* Get the direction coords for the neighbour with a cellvm helper call and
-             * recursivly call this function to update each neighbour. */
-            get_neighbour_coords(x, y, i, &xptr, &yptr);
-            draw_local_living(cluster, xptr, yptr, 0, render);
-        }
-    }
+    draw_local(render_living, cluster, x, y, neighbours, render);
 }
 
 void draw_local_gmap(const struct cell_cluster *cluster, int x, int y, char neighbours, char render) {
-    int i, xptr, yptr, color;
-    struct cell_proc *proc;
-
-    color = 0;
-    proc = cluster->cells[x][y];
-
-    /* Simple hash alrogithem to make a unique color for the cell. */
-    for (i = 0; proc->instructions[i] != STOP && i < CSIZE; i++) {
-        color += proc->instructions[i];
-        color += (color << 10);
-        color ^= (color >> 6);
-    }
-    color += (color << 3);
-    color += (color >> 11);
-    color ^= (color << 15);
-
-    /* the << shifts for the R,G,B channels give the output a little colour
-     * rather than bland grey scale images. */
-    display_update(x, y, color<<1, color<<2, color<<4);
-
-    if (neighbours) {
-        for (i = LEFT; i <= DOWN; i++) {
-            get_neighbour_coords(x, y, i, &xptr, &yptr);
-            draw_local_gmap(cluster, xptr, yptr, 0, render);
-        }
-    }
+    draw_local(render_gmap, cluster, x, y, neighbours, render);
 }
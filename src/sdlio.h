@@ -15,8 +15,21 @@
 /** Path of the start up logo to display with display_title(). */
 #define STARTLOGO "logo.bmp"
 
+/** Default screen pixels per cell, or per pixel of the frame when the grid is sampled down. */
 #define PIXELSPEROBJECT 4
 
+/** Most cells drawn along a side, bigger grids are sampled down to fit. */
+#define DISPLAYMAX 1024
+
+/** Default frames per second the display is redrawn at. */
+#define DISPLAY_FPS 30
+
+/** Keys that can be waiting for the simulation thread, must be a power of 2. */
+#define INPUT_QUEUE 64
+
+/** Ticks between the simulation thread checking for queued keys. */
+#define INPUT_TICKS 10000
+
 /** Function pointer for screen display functions. */
 typedef void(*duptr)(const struct cell_cluster*, int x, int y, char neighbours, char render);
 
@@ -34,16 +47,47 @@ enum DISPLAY_TYPE {
 };
 
 /**
- * Init the SDL display system.
+ * Init the SDL display system, sized to fit the cluster, and start the cluster
+ * tracking which cells change.
+ * @param cluster Cluster that will be drawn.
+ * @param scale Screen pixels per cell, see PIXELSPEROBJECT.
  * @return SDL screen on success, NULL on fail.
  */
-GLFWwindow *display_init(struct cell_cluster *cluster);
+GLFWwindow *display_init(struct cell_cluster *cluster, int scale);
 
 /**
  * Shutdown SDL.
  */
 void display_close(void);
 
+/**
+ * Queue a key for the simulation thread, only call from the display thread.
+ * @param key GLFW key code.
+ * @return 0 ok, 1 if the queue is full and the key was dropped.
+ */
+int input_push(int key);
+
+/**
+ * Take the next key queued by the display, only call from the simulation thread.
+ * @return GLFW key code, -1 if nothing is waiting.
+ */
+int input_poll(void);
+
+/**
+ * Redraw the cells that changed since the last frame with the current
+ * display_call view, or all of them after a view switch, and render the frame.
+ * Cells are read while the simulation is running so can be a little torn,
+ * which only ever shows up as a stray pixel colour until the cell next changes.
+ * @param cluster Cluster to draw, it has to be tracking changes, see display_init().
+ */
+void display_frame(struct cell_cluster *cluster);
+
+/**
+ * Upload the rows of the framebuffer that changed and draw it to the window
+ * as one textured quad, call glfwSwapBuffers() after to show it.
+ */
+void display_render(void);
+
 /**
  * Updates the whole screen with map of the data in the cluster.
  * @param screen Screen to draw updates too.
@@ -59,7 +103,7 @@ void draw_all(const struct cell_cluster *cluster, enum DISPLAY_TYPE type);
  * @param x X coord.
  * @param y Y coord.
  * @param neighbours Update the cells around the one specified that could have been modified if true.
- * @param render Render the updates before the function exits if true.
+ * @param render Render the frame before the function exits if true.
  */
 void draw_local_energy(const struct cell_cluster *cluster, int x, int y, char neighbours, char render);
 